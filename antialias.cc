@@ -0,0 +1,469 @@
+/*
+ * antialias.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include <omp.h> // OpenMP
+
+#include "antialias.h"
+
+const int EDGE_BATCH = 16384;   // pixels resampled at a time
+const int SAMPLE_CHUNK = 256;   // samples per OpenMP work item
+const int EDGE_SAMPLING = 4;    // rows of which the edges are ranked
+const double EDGE_MARGIN = 2.0; // the budget they are ranked for, over
+const int FIRST_SAMPLES = 4;    // the first resampling, a jittered 2 x 2
+const int PIXEL_OVERHEAD = 8;   // cost of a pixel beyond its iterations
+const int SAMPLE_OVERHEAD = 96; // and of a sample, taken on its own
+
+static inline uint32_t hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/*
+ * Sample k of a pixel is jittered within cell k of a grid x grid division
+ * of the pixel (sample FIRST_SAMPLES + k of the second resampling within
+ * cell k of the larger grid)
+ */
+static inline void sample_point(int hx, int hy, int k, int cell, int grid,
+                                double *sx, double *sy)
+{
+    const uint32_t h = hash32(hash32(hash32(hx) ^ hy) ^ k);
+
+    *sx = hx - 0.5 + (cell % grid + (h & 0xFFFF) / 65536.0) / grid;
+    *sy = hy - 0.5 + (cell / grid + (h >> 16) / 65536.0) / grid;
+}
+
+/*
+ * Compute per samples for each of the n pixels at[] (as hy * width + hx),
+ * the kth of which is sample first + k in cell k of grid, into its[i *
+ * per + k]
+ */
+static void take_samples(const frame *f, const int *at, int n, int per,
+                         int first, int grid, uint32_t *its)
+{
+    const int width = f->width;
+    const int total = n * per;
+    std::vector<double> sx(total), sy(total);
+    double *x = &sx[0];
+    double *y = &sy[0];
+
+    #pragma omp parallel default(none), shared(f, at, x, y, its),\
+                         firstprivate(n, per, first, grid, width, total)
+    {
+        #pragma omp for
+        for (int i = 0; i < n; i++) {
+            for (int k = 0; k < per; k++) {
+                sample_point(at[i] % width, at[i] / width, first + k, k, grid,
+                             &x[i * per + k], &y[i * per + k]);
+            }
+        }
+
+        // Samples of neighbouring edge pixels cost alike, so chunks do too
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < total; i += SAMPLE_CHUNK) {
+            const int m = total - i < SAMPLE_CHUNK ? total - i : SAMPLE_CHUNK;
+
+            compute_samples(f, x + i, y + i, m, its + i);
+        }
+    }
+}
+
+static inline int color_distance(uint32_t a, uint32_t b)
+{
+    return abs((int)(a >> 16 & 0xFF) - (int)(b >> 16 & 0xFF)) +
+           abs((int)(a >> 8 & 0xFF) - (int)(b >> 8 & 0xFF)) +
+           abs((int)(a & 0xFF) - (int)(b & 0xFF));
+}
+
+const int NEED_SCALE = 256;
+const int MAX_NEED = 3 * 255 * NEED_SCALE / SAMPLE_OVERHEAD;
+
+/* A pixel to resample, and how much it needs it */
+struct edge {
+    int at;             // hy * width + hx (or an index, for the grid)
+    int need;
+    uint32_t count;     // what a sample of it is expected to cost
+};
+
+/*
+ * How much a pixel needs resampling, given by how much of its colour
+ * differs and the count its samples are expected to cost: a sharp edge
+ * between bands far from the set is fixed cheaply, and shows as much as
+ * one in the noise near it
+ */
+static inline int need_of(int distance, uint32_t count)
+{
+    return (int)(distance * (double)NEED_SCALE / (count + SAMPLE_OVERHEAD));
+}
+
+/* The cost in iterations of per samples of e: about its count each */
+static inline double sample_cost(const edge &e, int per)
+{
+    return per * (double)(e.count + SAMPLE_OVERHEAD);
+}
+
+/*
+ * The least need above which candidates whose costs are in bin (by need)
+ * add up to at most budget, and *spent, what they add up to
+ */
+static int threshold(const std::vector<double> &bin, double budget,
+                     double *spent)
+{
+    int t = MAX_NEED;
+
+    *spent = 0.0;
+    while (t >= 0 && *spent + bin[t] <= budget)
+        *spent += bin[t--];
+    return t;
+}
+
+/*
+ * The candidates which need it most and whose costs of per samples each
+ * add up to at most budget, in order. Candidates are ranked through a
+ * histogram of need, and ties are broken in favour of earlier ones, so the
+ * choice takes linear time and is repeatable.
+ */
+static void choose(const std::vector<edge> &c, int per, double budget,
+                   std::vector<edge> *chosen)
+{
+    std::vector<double> bin(MAX_NEED + 1, 0.0);
+    double spent;
+
+    for (size_t i = 0; i < c.size(); i++)
+        bin[c[i].need] += sample_cost(c[i], per);
+    const int t = threshold(bin, budget, &spent);
+
+    chosen->clear();
+    for (size_t i = 0; i < c.size(); i++) {
+        if (c[i].need > t) {
+            chosen->push_back(c[i]);
+        } else if (c[i].need == t &&
+                   spent + sample_cost(c[i], per) <= budget) {
+            chosen->push_back(c[i]);
+            spent += sample_cost(c[i], per);
+        }
+    }
+}
+
+/*
+ * The pixels of row hy whose counts differ from that of a pixel next to
+ * them, and need resampling at least t, into out (room for a row), giving
+ * how many there are and adding how many differ to *edges. A pixel's
+ * colour differs as much as it does from the most different of those next
+ * to it, and as samples may land on either side of the edge, they are
+ * expected to cost the highest of their counts. differs is room for a row.
+ */
+static int row_edges(const uint32_t *its, int its_pitch,
+                     const uint32_t *pixels, int pitch, int width, int height,
+                     int hy, int t, uint8_t *differs, edge *out, int *edges)
+{
+    const uint32_t *row = its + hy*its_pitch;
+    const uint32_t *above = hy > 0 ? row - its_pitch : row;
+    const uint32_t *below = hy + 1 < height ? row + its_pitch : row;
+    const uint32_t *rgb = pixels + hy*pitch;
+    const uint32_t *rgb_above = hy > 0 ? rgb - pitch : rgb;
+    const uint32_t *rgb_below = hy + 1 < height ? rgb + pitch : rgb;
+    const int last = width - 1;
+    int n = 0;
+
+    /*
+     * Vectorised: most pixels are like all their neighbours. Fractions
+     * differ from pixel to pixel, but smoothly, so only counts are
+     * compared.
+     */
+    for (int hx = 1; hx < last; hx++) {
+        const uint32_t c = row[hx] & COUNT_MASK;
+
+        differs[hx] = ((row[hx - 1] & COUNT_MASK) != c) |
+                      ((row[hx + 1] & COUNT_MASK) != c) |
+                      ((above[hx] & COUNT_MASK) != c) |
+                      ((below[hx] & COUNT_MASK) != c);
+    }
+    for (int k = 0; k < 2; k++) {
+        const int hx = k == 0 ? 0 : last;
+        const uint32_t c = row[hx] & COUNT_MASK;
+
+        differs[hx] = ((row[std::max(hx - 1, 0)] & COUNT_MASK) != c) |
+                      ((row[std::min(hx + 1, last)] & COUNT_MASK) != c) |
+                      ((above[hx] & COUNT_MASK) != c) |
+                      ((below[hx] & COUNT_MASK) != c);
+    }
+
+    for (int hx = 0; hx < width; hx++) {
+        if (!differs[hx])
+            continue;
+        ++*edges;
+
+        const int left = hx > 0 ? hx - 1 : hx;
+        const int right = hx < last ? hx + 1 : hx;
+        const uint32_t col = rgb[hx];
+        edge e;
+
+        e.at = hy * width + hx;
+        e.count = std::max(std::max(std::max(row[left] & COUNT_MASK,
+                                             row[right] & COUNT_MASK),
+                                    std::max(above[hx] & COUNT_MASK,
+                                             below[hx] & COUNT_MASK)),
+                           row[hx] & COUNT_MASK);
+        e.need = need_of(std::max(std::max(color_distance(rgb[left], col),
+                                           color_distance(rgb[right], col)),
+                                  std::max(color_distance(rgb_above[hx], col),
+                                           color_distance(rgb_below[hx],
+                                                          col))),
+                         e.count);
+        if (e.need >= t)
+            out[n++] = e;
+    }
+    return n;
+}
+
+/*
+ * The edges of a frame, no fewer than choose() would choose from them all
+ * with budget_per_cost times the cost of the frame, for per samples each,
+ * in order. Near the boundary most pixels are edges, too many to list and
+ * rank, so the need they are chosen down to is found from every
+ * EDGE_SAMPLING'th row first, with a margin, and only those which need as
+ * much are listed. *edges is how many there are and *cost the cost in
+ * iterations of the frame, with the points which did not escape taken to
+ * have left early.
+ */
+static void find_edges(const uint32_t *its, int its_pitch,
+                       const uint32_t *pixels, int pitch, int width,
+                       int height, uint32_t max_its, int per,
+                       double budget_per_cost, std::vector<edge> *candidates,
+                       int *edges, double *cost)
+{
+    std::vector<double> bin(MAX_NEED + 1, 0.0);
+    double sampled_cost = 0.0;
+
+    #pragma omp parallel default(none), shared(its, pixels, bin),\
+                         firstprivate(its_pitch, pitch, width, height,\
+                                      max_its, per),\
+                         reduction(+:sampled_cost)
+    {
+        std::vector<double> mine(MAX_NEED + 1, 0.0);
+        std::vector<uint8_t> differs(width);
+        std::vector<edge> out(width);
+        int ignored = 0;
+
+        #pragma omp for schedule(dynamic)
+        for (int hy = 0; hy < height; hy += EDGE_SAMPLING) {
+            const uint32_t *row = its + hy*its_pitch;
+            const int n = row_edges(its, its_pitch, pixels, pitch, width,
+                                    height, hy, 0, &differs[0], &out[0],
+                                    &ignored);
+            uint64_t row_cost = (uint64_t)width * PIXEL_OVERHEAD;
+
+            for (int hx = 0; hx < width; hx++) {
+                const uint32_t n = row[hx] & COUNT_MASK;
+
+                row_cost += n < max_its ? n : 0;
+            }
+            for (int i = 0; i < n; i++)
+                mine[out[i].need] += sample_cost(out[i], per);
+            sampled_cost += row_cost;
+        }
+
+        #pragma omp critical
+        for (int i = 0; i <= MAX_NEED; i++)
+            bin[i] += mine[i];
+    }
+
+    double spent;
+    const int t = threshold(bin, EDGE_MARGIN * budget_per_cost *
+                            sampled_cost, &spent);
+
+    std::vector<std::vector<edge> > rows(height);
+    std::vector<edge> *picked = &rows[0];
+    double frame_cost = 0.0;
+    int found = 0;
+
+    #pragma omp parallel default(none), shared(its, pixels, picked),\
+                         firstprivate(its_pitch, pitch, width, height,\
+                                      max_its, t),\
+                         reduction(+:frame_cost, found)
+    {
+        std::vector<uint8_t> differs(width);
+        std::vector<edge> out(width);
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int hy = 0; hy < height; hy++) {
+            const uint32_t *row = its + hy*its_pitch;
+            const int n = row_edges(its, its_pitch, pixels, pitch, width,
+                                    height, hy, t, &differs[0], &out[0],
+                                    &found);
+            uint64_t row_cost = (uint64_t)width * PIXEL_OVERHEAD;
+
+            for (int hx = 0; hx < width; hx++) {
+                const uint32_t n = row[hx] & COUNT_MASK;
+
+                row_cost += n < max_its ? n : 0;
+            }
+            picked[hy].assign(out.begin(), out.begin() + n);
+            frame_cost += row_cost;
+        }
+    }
+
+    candidates->clear();
+    for (int hy = 0; hy < height; hy++)
+        candidates->insert(candidates->end(), rows[hy].begin(),
+                           rows[hy].end());
+
+    *edges = found;
+    *cost = frame_cost;
+}
+
+/* Channel sums of the colours of counts, with glitched ones left out */
+struct color_sum {
+    uint32_t r, g, b, n;
+};
+
+static inline void add_color(color_sum *s, const color_map *map, uint32_t c)
+{
+    if (c & GLITCHED)
+        return;
+
+    const uint32_t rgb = color_of(map, c);
+    s->r += (rgb >> 16) & 0xFF;
+    s->g += (rgb >> 8) & 0xFF;
+    s->b += rgb & 0xFF;
+    s->n++;
+}
+
+static inline uint32_t mean_color(const color_sum *s)
+{
+    const uint32_t half = s->n / 2;
+
+    return ((s->r + half) / s->n) << 16 | ((s->g + half) / s->n) << 8 |
+           (s->b + half) / s->n;
+}
+
+/*
+ * Take per samples, the kth in cell k of grid, for each of the pixels at,
+ * in batches, and add their colours to sums. If spread is not NULL it is
+ * given the largest colour distance between a pixel and its samples.
+ */
+static void resample(const frame *f, const color_map *map,
+                     const std::vector<int> &at, int per, int first, int grid,
+                     std::vector<color_sum> *sums, std::vector<int> *spread)
+{
+    std::vector<uint32_t> its(EDGE_BATCH * per);
+
+    for (size_t b = 0; b < at.size(); b += EDGE_BATCH) {
+        const int n = at.size() - b < (size_t)EDGE_BATCH ? at.size() - b
+                                                         : EDGE_BATCH;
+
+        take_samples(f, &at[b], n, per, first, grid, &its[0]);
+        for (int i = 0; i < n; i++) {
+            color_sum *s = &(*sums)[b + i];
+            const uint32_t mean = mean_color(s);
+            int d = 0;
+
+            for (int k = 0; k < per; k++) {
+                const uint32_t c = its[i * per + k];
+
+                add_color(s, map, c);
+                if (spread != NULL && !(c & GLITCHED) &&
+                    color_distance(color_of(map, c), mean) > d)
+                    d = color_distance(color_of(map, c), mean);
+            }
+            if (spread != NULL)
+                (*spread)[b + i] = d;
+        }
+    }
+}
+
+void render_antialiased(const render_params *p, int grid,
+                        const uint32_t *its, int its_pitch,
+                        uint32_t *pixels, int pitch, aa_stats *stats)
+{
+    const int width = p->width;
+    const int cells = grid * grid;
+    std::vector<edge> edges, first;
+    color_map map;
+    double frame_cost;
+    aa_stats done = { width * p->height, 0, 0, 0, 0 };
+
+    build_color_map(&map, &p->col, p->kp.max_its,
+                    (p->kp.flags & KERNEL_SMOOTH) != 0, its, its_pitch, width,
+                    p->height);
+    colorize(its, its_pitch, width, p->height, &map, pixels, pitch);
+    // Half the budget for the first resampling, unless there is no grid
+    const double share = grid > 2 ? AA_BUDGET / 2 : AA_BUDGET;
+    find_edges(its, its_pitch, pixels, pitch, width, p->height,
+               p->kp.max_its, FIRST_SAMPLES, share, &edges, &done.edges,
+               &frame_cost);
+    const double budget = AA_BUDGET * frame_cost;
+    choose(edges, FIRST_SAMPLES, share * frame_cost, &first);
+    done.resampled = first.size();
+
+    if (!first.empty()) {
+        const int n = first.size();
+        std::vector<int> at(n), spread(n);
+        std::vector<color_sum> sums(n);
+        double spent = 0.0;
+        frame f;
+
+        setup_frame(&f, p->kern, &p->kp, p->center_x, p->center_y,
+                    p->delta_x, p->delta_y, width, p->height);
+
+        for (int i = 0; i < n; i++) {
+            color_sum s = { 0, 0, 0, 0 };
+
+            at[i] = first[i].at;
+            add_color(&s, &map, first[i].count);
+            sums[i] = s;
+            spent += sample_cost(first[i], FIRST_SAMPLES);
+        }
+        resample(&f, &map, at, FIRST_SAMPLES, 0, 2, &sums, &spread);
+        done.samples = n * FIRST_SAMPLES;
+
+        // The rest of the budget on those whose samples spread most
+        if (grid > 2) {
+            std::vector<edge> spreading, refine;
+            std::vector<int> refine_at;
+            std::vector<color_sum> refine_sums;
+
+            for (int i = 0; i < n; i++) {
+                if (spread[i] > 0) {
+                    edge e = { i, need_of(spread[i], first[i].count),
+                               first[i].count };
+                    spreading.push_back(e);
+                }
+            }
+            choose(spreading, cells, budget - spent, &refine);
+            for (size_t j = 0; j < refine.size(); j++) {
+                refine_at.push_back(at[refine[j].at]);
+                refine_sums.push_back(sums[refine[j].at]);
+            }
+            resample(&f, &map, refine_at, cells, FIRST_SAMPLES, grid,
+                     &refine_sums, NULL);
+            for (size_t j = 0; j < refine.size(); j++)
+                sums[refine[j].at] = refine_sums[j];
+            done.refined = refine.size();
+            done.samples += done.refined * cells;
+        }
+
+        for (int i = 0; i < n; i++) {
+            pixels[at[i] / width * pitch + at[i] % width] =
+                mean_color(&sums[i]);
+        }
+    }
+
+    if (stats != NULL)
+        *stats = done;
+}
@@ -0,0 +1,55 @@
+/*
+ * antialias.h
+ *
+ * Adaptive anti-aliasing. One sample per pixel aliases wherever the count
+ * changes from one pixel to the next, but supersampling every pixel costs
+ * as many times over as there are samples. Only pixels whose count differs
+ * from one of their four neighbours' are resampled, with four jittered
+ * samples, and those whose samples disagree most among themselves are
+ * given a jittered grid of samples as well. A pixel's colour is the mean of
+ * the colours of its samples.
+ *
+ * Near the boundary nearly every pixel differs from a neighbour, so the
+ * extra samples of a frame are limited to costing AA_BUDGET of what the
+ * frame did, as told by its counts. Half of that goes on first resampling
+ * the pixels which need it most for what their samples cost, the rest on
+ * grids for those whose samples spread most.
+ *
+ * Jitter is a hash of the pixel and the sample, so a frame comes out the
+ * same each time it is rendered.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef ANTIALIAS_H
+#define ANTIALIAS_H
+
+#include <stdint.h>
+
+#include "render.h"
+
+const int MAX_AA_GRID = 8;      // at most 8 x 8 more samples per pixel
+const double AA_BUDGET = 0.3;   // extra cost of a frame, as a fraction
+
+struct aa_stats {
+    int pixels;         // in the frame
+    int edges;          // differing from a neighbour
+    int resampled;      // of those, within the budget
+    int refined;        // of which were given the grid too
+    int samples;        // computed in all, beyond one per pixel
+};
+
+/*
+ * Colour the counts of the frame described by p as render_colors() does,
+ * anti-aliasing with up to grid x grid samples (2 <= grid <= MAX_AA_GRID)
+ * on top of the four a pixel is first resampled with. its and pixels must
+ * be different buffers. If stats is not NULL it says what was done.
+ */
+void render_antialiased(const render_params *p, int grid,
+                        const uint32_t *its, int its_pitch,
+                        uint32_t *pixels, int pitch, aa_stats *stats);
+
+#endif // ANTIALIAS_H
@@ -0,0 +1,212 @@
+/*
+ * async.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "async.h"
+#include "placement.h"
+#include "tiles.h"
+
+const int NUM_SLOTS = 3;
+
+struct async_renderer {
+    async_setup setup;
+
+    /*
+     * The frame being computed is built up in work and copied into a free
+     * slot each time it is published. ready and shown are slot indices, or
+     * -1.
+     */
+    uint32_t *work;         // alloc_counts(), owned by the render thread
+    async_frame slot[NUM_SLOTS];
+    int ready;
+    int shown;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool pending;           // a request not yet started
+    render_params request;
+    int request_depth;
+    long generation;        // of the latest request
+    bool stopping;
+
+    pthread_t thread;
+};
+
+/* What the render thread is working on, for the progressive callbacks */
+struct job {
+    async_renderer *r;
+    const render_params *p;
+    int depth;
+    long generation;
+};
+
+
+static void publish(job *j, const uint32_t *its, int step)
+{
+    async_renderer *r = j->r;
+    const int width = r->setup.width;
+    const int height = r->setup.height;
+
+    pthread_mutex_lock(&r->lock);
+    if (j->generation != r->generation) {
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+
+    // A slot neither ready nor shown; an unseen ready frame is superseded
+    int free_slot = 0;
+    while (free_slot == r->shown || free_slot == r->ready)
+        free_slot++;
+    pthread_mutex_unlock(&r->lock);
+
+    /*
+     * The display thread only touches the ready and shown slots, so the
+     * copy needs no lock
+     */
+    async_frame *f = &r->slot[free_slot];
+    f->p = *j->p;
+    f->depth = j->depth;
+    f->step = step;
+    memcpy(&f->its[0], its, width * height * sizeof(uint32_t));
+
+    pthread_mutex_lock(&r->lock);
+    r->ready = free_slot;
+    pthread_mutex_unlock(&r->lock);
+
+    r->setup.notify(r->setup.notify_arg);
+}
+
+static bool job_cancelled(void *arg)
+{
+    job *j = (job *)arg;
+    async_renderer *r = j->r;
+
+    pthread_mutex_lock(&r->lock);
+    const bool cancelled = j->generation != r->generation || r->stopping;
+    pthread_mutex_unlock(&r->lock);
+    return cancelled;
+}
+
+static void job_show(const uint32_t *its, int pitch, int step, void *arg)
+{
+    job *j = (job *)arg;
+
+    if (j->r->setup.show_passes || step == 1)
+        publish(j, its, step);
+}
+
+static void *render_thread(void *arg)
+{
+    async_renderer *r = (async_renderer *)arg;
+    const int width = r->setup.width;
+    const int height = r->setup.height;
+
+    // Placed by the threads which will compute it
+    r->work = alloc_counts(width * height);
+    place_counts(r->work, width, width, height, DEFAULT_TILE_SIZE);
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->pending && !r->stopping)
+            pthread_cond_wait(&r->changed, &r->lock);
+        if (r->stopping)
+            break;
+
+        render_params p = r->request;
+        job j;
+        j.r = r;
+        j.p = &p;
+        j.depth = r->request_depth;
+        j.generation = r->generation;
+        r->pending = false;
+        pthread_mutex_unlock(&r->lock);
+
+        if (r->setup.count != NULL) {
+            if (r->setup.count(&p, j.depth, r->work, width,
+                               job_cancelled, &j, r->setup.count_arg))
+                publish(&j, r->work, 1);
+        } else {
+            render_progressive(&p, r->work, width, r->setup.interval,
+                               job_cancelled, job_show, &j);
+        }
+
+        pthread_mutex_lock(&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    free_counts(r->work, width * height);
+    return NULL;
+}
+
+async_renderer *start_async(const async_setup *setup)
+{
+    async_renderer *r = new async_renderer;
+    const int pixels = setup->width * setup->height;
+
+    r->setup = *setup;
+    for (int i = 0; i < NUM_SLOTS; i++)
+        r->slot[i].its.resize(pixels);
+    r->ready = -1;
+    r->shown = -1;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->changed, NULL);
+    r->pending = false;
+    r->generation = 0;
+    r->stopping = false;
+
+    if (pthread_create(&r->thread, NULL, render_thread, r) != 0) {
+        perror("Failed to start the render thread");
+        exit(EXIT_FAILURE);
+    }
+    return r;
+}
+
+void request_frame(async_renderer *r, const render_params *p, int depth)
+{
+    pthread_mutex_lock(&r->lock);
+    r->request = *p;
+    r->request_depth = depth;
+    r->generation++;
+    r->pending = true;
+    pthread_cond_signal(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+const async_frame *take_frame(async_renderer *r)
+{
+    const async_frame *f = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->ready >= 0) {
+        r->shown = r->ready;
+        r->ready = -1;
+        f = &r->slot[r->shown];
+    }
+    pthread_mutex_unlock(&r->lock);
+    return f;
+}
+
+void stop_async(async_renderer *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->stopping = true;
+    pthread_cond_signal(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->thread, NULL);
+    pthread_cond_destroy(&r->changed);
+    pthread_mutex_destroy(&r->lock);
+    delete r;
+}
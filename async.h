@@ -0,0 +1,82 @@
+/*
+ * async.h
+ *
+ * Rendering on a thread of its own, so that the thread owning the display
+ * only handles events and presents frames. Requests supersede each other:
+ * a render which is no longer wanted is abandoned at the next band of
+ * rows, and a frame which is finished but not yet taken is replaced by a
+ * newer one. Finished frames are kept in three buffers, one being shown,
+ * one ready and one being filled, so that neither thread waits for the
+ * other.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "render.h"
+
+#include "progressive.h"
+
+/*
+ * Computes the counts of a frame (on the render thread) when a front-end
+ * has its own way of doing so. It may poll cancel, and returns false if it
+ * abandoned the frame.
+ */
+typedef bool (*count_function)(const render_params *p, int depth,
+                               uint32_t *its, int pitch,
+                               progress_cancel cancel, void *cancel_arg,
+                               void *arg);
+
+struct async_setup {
+    int width;
+    int height;
+    bool show_passes;       // publish every progressive pass, not only
+                            // finished frames
+    double interval;        // for progress within a pass, in seconds
+    count_function count;   // NULL to render progressively
+    void *count_arg;
+
+    /*
+     * Called on the render thread whenever a frame is published, to wake
+     * up the display thread
+     */
+    void (*notify)(void *arg);
+    void *notify_arg;
+};
+
+/* A published frame */
+struct async_frame {
+    render_params p;
+    int depth;
+    int step;               // progressive pass, 1 once finished
+    std::vector<uint32_t> its;
+};
+
+struct async_renderer;
+
+async_renderer *start_async(const async_setup *setup);
+
+/*
+ * Render p (labelled depth) next, abandoning whatever is being rendered.
+ * p must be of the setup's size.
+ */
+void request_frame(async_renderer *r, const render_params *p, int depth);
+
+/*
+ * The newest frame published since the last call, or NULL. The frame stays
+ * valid until the next call.
+ */
+const async_frame *take_frame(async_renderer *r);
+
+// Abandon any render and stop the thread
+void stop_async(async_renderer *r);
+
+#endif // ASYNC_H
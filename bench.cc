@@ -0,0 +1,523 @@
+/*
+ * bench.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <omp.h> // OpenMP
+#include <x86intrin.h>
+
+#include "bench.h"
+#include "colorize.h"
+#include "gpu.h"
+
+struct viewport {
+    const char *name;
+    const char *center_x;       // NULL for the configured zoom
+    const char *center_y;
+    double size;                // of the shorter side of the frame
+    int max_its;                // 0 for the configured limit
+};
+
+/*
+ * From cheap to expensive: mostly exterior, mostly interior (the bulb test
+ * and cycle detection), boundary detail in double precision, and a zoom
+ * that is only possible with perturbation
+ */
+static const viewport viewports[] = {
+    { "zoom", NULL, NULL, 4.0, 0 },
+    { "whole", "-0.75", "0.0", 3.0, 0 },
+    { "interior", "-0.1", "0.0", 0.5, 0 },
+    { "seahorse", "-0.743643887037151", "0.131825904205330", 2e-9, 2000 },
+    { "deep", "-0.743643887037158704752191506114774",
+      "0.131825904205311970493132056385139", 1e-20, 5000 }
+};
+
+static const char *const mode_names[] = { "tiles", "rows", "subdivide" };
+static const char *const precision_names[] = { "float", "double",
+                                               "perturb" };
+
+struct frame_result {
+    int depth;
+    precision prec;
+    int skipped;        // iterations each pixel took from the series
+    double seconds;
+    uint64_t iterations;
+    int inside;         // pixels which did not escape
+    std::vector<thread_stats> stats;
+};
+
+static uint64_t total_iterations(const uint32_t *its, int n)
+{
+    uint64_t sum = 0;
+
+    for (int i = 0; i < n; i++)
+        sum += its[i] & COUNT_MASK;
+    return sum;
+}
+
+/*
+ * The sum of the counts of the pixels which escaped, which were all
+ * computed, and in inside how many did not escape
+ */
+static uint64_t escaped_iterations(const uint32_t *its, int n, int max_its,
+                                   int *inside)
+{
+    uint64_t sum = 0;
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        const uint32_t c = its[i] & COUNT_MASK;
+
+        if (c < (uint32_t)max_its)
+            sum += c;
+        else
+            count++;
+    }
+    *inside = count;
+    return sum;
+}
+
+/*
+ * Iterations are the sum of the escaping pixels' iteration counts. Points
+ * which did not escape are only counted, as inside: the bulb test and
+ * cycle detection stop most of them early, after iterations nothing
+ * records. Utilisation is the fraction of the frame each thread spent
+ * computing; subdivision does not account its tasks, so has none.
+ * Iterations a deep zoom's pixels start past, by the series
+ * approximation, are counted but not computed.
+ */
+static void print_frame(const frame_result *r, int pixels, bool last)
+{
+    printf("        {\"depth\": %d, \"precision\": \"%s\", \"skipped\": %d, "
+           "\"ms\": %.3f, \"mpix_per_s\": %.3f, \"iterations\": %llu, "
+           "\"inside\": %d, \"giter_per_s\": %.4f, \"utilisation\": [",
+           r->depth, precision_names[r->prec], r->skipped, 1e3 * r->seconds,
+           1e-6 * pixels / r->seconds, (unsigned long long)r->iterations,
+           r->inside, 1e-9 * r->iterations / r->seconds);
+    for (size_t t = 0; t < r->stats.size(); t++) {
+        const thread_stats *s = &r->stats[t];
+
+        printf("%s%.3f", t == 0 ? "" : ", ", s->busy / (s->busy + s->idle));
+    }
+    printf("]}%s\n", last ? "" : ",");
+}
+
+static void bench_viewport(const config *c, gpu_device *gpu,
+                           const viewport *v, bool last)
+{
+    const int width = c->width;
+    const int height = c->height;
+    const double zoom_multiplier = 1.0 / c->zoom_factor;
+    std::vector<uint32_t> its(width * height);
+    std::vector<frame_result> results(c->bench_frames);
+    color_map map;
+    double total_seconds = 0.0;
+    uint64_t total_its = 0;
+
+    kernel_params kp;
+    kp.max_its = v->max_its != 0 ? v->max_its : c->max_its;
+    kp.flags = c->kernel_flags;
+    kp.formula = FORMULA_MANDELBROT;
+    kp.julia_x = 0.0;
+    kp.julia_y = 0.0;
+    const kernel *kern = c->kernel.empty() ? select_kernel()
+                                           : find_kernel(c->kernel.c_str());
+    const fixed_point cx = fixed_point::from_string(
+        v->center_x != NULL ? v->center_x : c->center_x.c_str());
+    const fixed_point cy = fixed_point::from_string(
+        v->center_y != NULL ? v->center_y : c->center_y.c_str());
+    double delta = v->size / (width < height ? width : height);
+
+    for (int i = 0; i < c->bench_frames; i++) {
+        frame_result *r = &results[i];
+        frame f;
+        const double start = omp_get_wtime();
+
+        setup_frame(&f, kern, &kp, cx, cy, delta, delta, width, height);
+        f.gpu = gpu;
+        compute_frame(&f, c->mode, &its[0], width, &r->stats);
+        const double computed = omp_get_wtime();
+        r->iterations = escaped_iterations(&its[0], width * height,
+                                           kp.max_its, &r->inside);
+        const double counted = omp_get_wtime();
+        build_color_map(&map, &c->col, kp.max_its,
+                        (kp.flags & KERNEL_SMOOTH) != 0, &its[0], width,
+                        width, height);
+        colorize(&its[0], width, width, height, &map, &its[0], width);
+
+        r->depth = v->center_x == NULL ? i : 0;
+        r->prec = f.prec;
+        r->skipped = f.prec == PRECISION_PERTURB ? f.pert.ref.orbit.skip - 1
+                                                 : 0;
+        r->seconds = omp_get_wtime() - start - (counted - computed);
+        total_seconds += r->seconds;
+        total_its += r->iterations;
+
+        if (v->center_x == NULL)
+            delta *= zoom_multiplier;
+    }
+
+    const double pixels = (double)width * height * c->bench_frames;
+    printf("    {\"name\": \"%s\", \"max_its\": %d, \"seconds\": %.4f, "
+           "\"mpix_per_s\": %.3f, \"giter_per_s\": %.4f,\n", v->name,
+           kp.max_its, total_seconds, 1e-6 * pixels / total_seconds,
+           1e-9 * total_its / total_seconds);
+    printf("      \"frames\": [\n");
+    for (int i = 0; i < c->bench_frames; i++)
+        print_frame(&results[i], width * height, i == c->bench_frames - 1);
+    printf("      ]}%s\n", last ? "" : ",");
+    fflush(stdout);
+
+    fprintf(stderr, "%-10s %9.2f ms/frame %9.2f Mpix/s %8.3f Giter/s\n",
+            v->name, 1e3 * total_seconds / c->bench_frames,
+            1e-6 * pixels / total_seconds, 1e-9 * total_its / total_seconds);
+}
+
+static bool time_kernels(const config *c);
+
+bool run_bench(const config *c, gpu_device *gpu)
+{
+    const int n = sizeof(viewports) / sizeof(viewports[0]);
+    const kernel *kern = c->kernel.empty() ? select_kernel()
+                                           : find_kernel(c->kernel.c_str());
+
+    printf("{\"kernel\": \"%s\", \"gpu\": \"%s\", \"threads\": %d, "
+           "\"width\": %d, \"height\": %d, \"mode\": \"%s\", "
+           "\"bulbs\": %s, \"periodicity\": %s, \"smooth\": %s, "
+           "\"frames\": %d,\n",
+           kern->name, gpu != NULL ? gpu_name(gpu) : "",
+           omp_get_max_threads(), c->width, c->height, mode_names[c->mode],
+           c->kernel_flags & KERNEL_BULBS ? "true" : "false",
+           c->kernel_flags & KERNEL_PERIODICITY ? "true" : "false",
+           c->kernel_flags & KERNEL_SMOOTH ? "true" : "false",
+           c->bench_frames);
+    printf("  \"viewports\": [\n");
+    for (int i = 0; i < n; i++)
+        bench_viewport(c, gpu, &viewports[i], i == n - 1);
+    printf("  ]%s\n", c->baseline_path.empty() ? "}" : ",");
+    return c->baseline_path.empty() || time_kernels(c);
+}
+
+/*
+ * The check renders each viewport with every supported kernel, flag and
+ * scheduler, and compares the counts with golden counts kept in the tree,
+ * made by the plain loop of the SSE2 kernel row by row. Early-outs,
+ * refilling and the schedulers must give the same counts to the bit;
+ * subdivision, the series approximation and the GPU approximate, and may
+ * differ in CHECK_TOLERANCE of the pixels. The frame is small, and not
+ * square, so that it is quick and aspect and pitch mistakes show. The
+ * zoom viewport is of the default configuration, as the goldens are.
+ */
+const int CHECK_WIDTH = 160;
+const int CHECK_HEIGHT = 120;
+const double CHECK_TOLERANCE = 0.01;
+const double TIMING_SECONDS = 0.1;  // least time of each timing run
+const int TIMING_RUNS = 3;          // of which the fastest is taken
+
+static const char *const kernel_names[] = { "sse2", "avx2", "avx512" };
+
+struct check_variant {
+    const char *name;
+    unsigned flags;
+    render_mode mode;
+    bool exact;
+};
+
+static const unsigned EXACT_FLAGS = KERNEL_DEFAULT_FLAGS & ~KERNEL_SERIES;
+
+static const check_variant variants[] = {
+    { "plain", 0, RENDER_ROWS, true },
+    { "bulbs", KERNEL_BULBS, RENDER_ROWS, true },
+    { "periodicity", KERNEL_PERIODICITY, RENDER_ROWS, true },
+    { "refill", KERNEL_REFILL, RENDER_ROWS, true },
+    { "tiles", EXACT_FLAGS, RENDER_TILES, true },
+    { "smooth", EXACT_FLAGS | KERNEL_SMOOTH, RENDER_TILES, true },
+    { "subdivide", EXACT_FLAGS, RENDER_SUBDIVIDE, false },
+    { "series", KERNEL_DEFAULT_FLAGS, RENDER_TILES, false }
+};
+
+/* The view v shows at the check's size, with flags */
+static void check_frame(frame *f, const viewport *v, const kernel *kern,
+                        unsigned flags)
+{
+    config d;
+    kernel_params kp;
+
+    default_config(&d);
+    kp.max_its = v->max_its != 0 ? v->max_its : d.max_its;
+    kp.flags = flags;
+    kp.formula = FORMULA_MANDELBROT;
+    kp.julia_x = 0.0;
+    kp.julia_y = 0.0;
+    setup_frame(f, kern, &kp,
+                fixed_point::from_string(v->center_x != NULL
+                                         ? v->center_x
+                                         : d.center_x.c_str()),
+                fixed_point::from_string(v->center_y != NULL
+                                         ? v->center_y
+                                         : d.center_y.c_str()),
+                v->size / CHECK_HEIGHT, v->size / CHECK_HEIGHT,
+                CHECK_WIDTH, CHECK_HEIGHT);
+}
+
+/*
+ * The golden counts of v in dir, plain or smooth, as uint32_t in the byte
+ * order of x86 (little endian)
+ */
+static std::string golden_path(const std::string &dir, const viewport *v,
+                               bool smooth)
+{
+    return dir + "/" + v->name + (smooth ? "-smooth" : "") + ".its";
+}
+
+static bool read_golden(const std::string &path, uint32_t *its)
+{
+    const size_t pixels = CHECK_WIDTH * CHECK_HEIGHT;
+    FILE *f = fopen(path.c_str(), "rb");
+
+    if (f == NULL) {
+        perror(path.c_str());
+        return false;
+    }
+    const bool ok = fread(its, sizeof(uint32_t), pixels, f) == pixels &&
+                    fgetc(f) == EOF;
+    fclose(f);
+    if (!ok)
+        fprintf(stderr, "%s is not %dx%d counts\n", path.c_str(),
+                CHECK_WIDTH, CHECK_HEIGHT);
+    return ok;
+}
+
+static void write_golden(const std::string &path, const uint32_t *its)
+{
+    const size_t pixels = CHECK_WIDTH * CHECK_HEIGHT;
+    FILE *f = fopen(path.c_str(), "wb");
+
+    if (f == NULL || fwrite(its, sizeof(uint32_t), pixels, f) != pixels ||
+        fclose(f) != 0) {
+        perror(path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Wrote %s\n", path.c_str());
+}
+
+/* Compare its with golden, reporting the result; false if it fails */
+static bool compare_counts(const viewport *v, const char *kernel,
+                           const char *variant, bool exact,
+                           const uint32_t *its, const uint32_t *golden)
+{
+    const int pixels = CHECK_WIDTH * CHECK_HEIGHT;
+    int differ = 0;
+
+    for (int i = 0; i < pixels; i++)
+        differ += its[i] != golden[i];
+
+    const bool ok = differ <= (exact ? 0 : CHECK_TOLERANCE * pixels);
+    printf("%-10s %-7s %-12s %6d differ  %s\n", v->name, kernel, variant,
+           differ, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+bool run_check(const config *c, gpu_device *gpu)
+{
+    const int n = sizeof(viewports) / sizeof(viewports[0]);
+    const int nv = sizeof(variants) / sizeof(variants[0]);
+    const int pixels = CHECK_WIDTH * CHECK_HEIGHT;
+    std::vector<uint32_t> golden(pixels), golden_smooth(pixels);
+    std::vector<uint32_t> its(pixels);
+    int failed = 0;
+
+    for (int i = 0; i < n; i++) {
+        const viewport *v = &viewports[i];
+        const std::string plain_path = golden_path(c->golden_dir, v, false);
+        const std::string smooth_path = golden_path(c->golden_dir, v, true);
+        frame f;
+
+        if (c->write_golden) {
+            check_frame(&f, v, &kernel_sse2, 0);
+            compute_frame(&f, RENDER_ROWS, &golden[0], CHECK_WIDTH, NULL);
+            write_golden(plain_path, &golden[0]);
+            check_frame(&f, v, &kernel_sse2, KERNEL_SMOOTH);
+            compute_frame(&f, RENDER_ROWS, &golden[0], CHECK_WIDTH, NULL);
+            write_golden(smooth_path, &golden[0]);
+            continue;
+        }
+        if (!read_golden(plain_path, &golden[0]) ||
+            !read_golden(smooth_path, &golden_smooth[0])) {
+            failed++;
+            continue;
+        }
+
+        for (int k = 0; k < 3; k++) {
+            const kernel *kern = find_kernel(kernel_names[k]);
+
+            if (kern == NULL)
+                continue;
+            for (int j = 0; j < nv; j++) {
+                const check_variant *cv = &variants[j];
+                const bool smooth = (cv->flags & KERNEL_SMOOTH) != 0;
+
+                check_frame(&f, v, kern, cv->flags);
+                compute_frame(&f, cv->mode, &its[0], CHECK_WIDTH, NULL);
+                if (!compare_counts(v, kern->name, cv->name, cv->exact,
+                                    &its[0], smooth ? &golden_smooth[0]
+                                                    : &golden[0]))
+                    failed++;
+            }
+        }
+
+        if (gpu != NULL) {
+            check_frame(&f, v, select_kernel(), EXACT_FLAGS);
+            f.gpu = gpu;
+            compute_frame(&f, RENDER_TILES, &its[0], CHECK_WIDTH, NULL);
+            if (!compare_counts(v, "gpu", gpu_name(gpu), false, &its[0],
+                                &golden[0]))
+                failed++;
+        }
+    }
+
+    if (!c->write_golden)
+        printf("%d failed\n", failed);
+    return failed == 0;
+}
+
+/*
+ * Time kern on its own, on one thread, over the plain loop of the check's
+ * frame of v: there are no early-outs, so every iteration counted is
+ * computed. Returns the fastest of TIMING_RUNS in nanoseconds per
+ * iteration, and its cycles (of the time stamp counter) per pixel in
+ * cycles.
+ */
+static double time_kernel(const viewport *v, const kernel *kern,
+                          double *cycles)
+{
+    frame f;
+    std::vector<uint32_t> its(CHECK_WIDTH * CHECK_HEIGHT);
+    double best = 0.0;
+
+    check_frame(&f, v, kern, 0);
+    for (int run = 0; run < TIMING_RUNS; run++) {
+        uint64_t iterations = 0;
+        double seconds = 0.0;
+        unsigned long long ticks = 0;
+        int frames = 0;
+
+        do {
+            const double start = omp_get_wtime();
+            const unsigned long long tsc = __rdtsc();
+
+            for (int hy = 0; hy < CHECK_HEIGHT; hy++)
+                compute_span(&f, 0, hy, CHECK_WIDTH, &its[hy * CHECK_WIDTH]);
+            ticks += __rdtsc() - tsc;
+            seconds += omp_get_wtime() - start;
+            iterations += total_iterations(&its[0],
+                                           CHECK_WIDTH * CHECK_HEIGHT);
+            frames++;
+        } while (seconds < TIMING_SECONDS);
+
+        const double ns = 1e9 * seconds / iterations;
+        if (run == 0 || ns < best) {
+            best = ns;
+            *cycles = (double)ticks /
+                      ((double)frames * CHECK_WIDTH * CHECK_HEIGHT);
+        }
+    }
+    return best;
+}
+
+/*
+ * The baseline is a line of "viewport kernel ns_per_iteration" for each
+ * kernel timed. Returns the time of v with kernel, or 0 if there is none.
+ */
+static double baseline_time(const std::string &path, const char *viewport,
+                            const char *kernel)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    char v[64], k[64];
+    double ns, found = 0.0;
+
+    if (f == NULL)
+        return 0.0;
+    while (found == 0.0 && fscanf(f, "%63s %63s %lf", v, k, &ns) == 3) {
+        if (strcmp(v, viewport) == 0 && strcmp(k, kernel) == 0)
+            found = ns;
+    }
+    fclose(f);
+    return found;
+}
+
+/*
+ * Time every kernel supported on every viewport, adding them to the JSON
+ * as "kernels", and compare them with the baseline at c->baseline_path, or
+ * with c->write_baseline write them there. Returns false if any is more
+ * than c->slowdown slower than its baseline, or has none.
+ */
+static bool time_kernels(const config *c)
+{
+    const int n = sizeof(viewports) / sizeof(viewports[0]);
+    FILE *out = NULL;
+    int failed = 0;
+    bool first = true;
+
+    if (c->write_baseline &&
+        (out = fopen(c->baseline_path.c_str(), "w")) == NULL) {
+        perror(c->baseline_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    printf("  \"kernels\": [\n");
+    for (int i = 0; i < n; i++) {
+        const viewport *v = &viewports[i];
+
+        for (int k = 0; k < 3; k++) {
+            const kernel *kern = find_kernel(kernel_names[k]);
+            double cycles;
+
+            if (kern == NULL)
+                continue;
+            const double ns = time_kernel(v, kern, &cycles);
+            const double base = c->write_baseline
+                                ? 0.0
+                                : baseline_time(c->baseline_path, v->name,
+                                                kern->name);
+            const bool ok = c->write_baseline ||
+                            (base > 0.0 && ns <= base * (1.0 + c->slowdown));
+
+            if (out != NULL)
+                fprintf(out, "%s %s %.4f\n", v->name, kern->name, ns);
+            printf("%s    {\"viewport\": \"%s\", \"kernel\": \"%s\", "
+                   "\"ns_per_iteration\": %.4f, \"cycles_per_pixel\": %.1f, "
+                   "\"baseline\": %.4f, \"ok\": %s}", first ? "" : ",\n",
+                   v->name, kern->name, ns, cycles, base,
+                   ok ? "true" : "false");
+            first = false;
+            fprintf(stderr, "%-10s %-7s %8.3f ns/iteration %10.1f "
+                    "cycles/pixel  %s\n", v->name, kern->name, ns, cycles,
+                    c->write_baseline ? "" : base == 0.0 ? "NO BASELINE"
+                    : ok ? "ok" : "SLOWER");
+            if (!ok)
+                failed++;
+        }
+    }
+    printf("\n  ]}\n");
+
+    if (out != NULL && fclose(out) != 0) {
+        perror(c->baseline_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (failed > 0) {
+        fprintf(stderr, "%d kernel timings missing from the baseline or "
+                "more than %.0f%% slower\n", failed, 100.0 * c->slowdown);
+    }
+    return failed == 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * bench.h
+ *
+ * A repeatable benchmark: a fixed set of viewports, from the whole set to
+ * a perturbation deep zoom, rendered headless with the configured
+ * resolution, kernel and scheduler, or on the GPU. Results are written to
+ * stdout as JSON.
+ *
+ * The same viewports, small and seen as in the default configuration,
+ * check the counts of every kernel, flag and scheduler against golden
+ * counts kept in the tree (make test), and time each kernel against a
+ * baseline kept with them (make bench), for a change to any of them.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "config.h"
+
+/*
+ * Render every viewport for c->bench_frames frames, on gpu where it can
+ * (if not NULL). The zoom viewport follows the configured zoom from depth
+ * 0, the others render the same frame each time.
+ *
+ * With c->baseline_path each kernel supported is then timed by itself on
+ * each viewport, and compared with the timings there, or with
+ * c->write_baseline they are written there. Returns false if any is more
+ * than c->slowdown slower than its baseline, or has none.
+ */
+bool run_bench(const config *c, gpu_device *gpu);
+
+/*
+ * Check every kernel supported, with each of its flags and each scheduler,
+ * and gpu if not NULL, against the golden counts in c->golden_dir, writing
+ * the results to stdout; or with c->write_golden, write the goldens there
+ * from the plain SSE2 kernel. Returns false if any counts differ by more
+ * than allowed, or the goldens cannot be read.
+ */
+bool run_check(const config *c, gpu_device *gpu);
+
+#endif // BENCH_H
@@ -0,0 +1,102 @@
+/*
+ * budget.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <math.h>
+
+#include "kernel.h"
+#include "budget.h"
+
+const int MIN_BUDGET = 64;
+
+/*
+ * Growth of the predicted limit per doubling of the zoom, relative to the
+ * depth 0 limit
+ */
+const double DEPTH_GROWTH = 0.1;
+
+// Share of near misses above which the limit is raised, below which lowered
+const double RAISE_ABOVE = 0.02;
+const double LOWER_BELOW = 0.0025;
+
+const int STEPS_PER_DOUBLING = 4;
+const int MAX_FEEDBACK = 16;     // steps either way
+
+
+void take_census(budget_census *census, const uint32_t *its, int pitch,
+                 int width, int height, int max_its)
+{
+    const uint32_t half = (uint32_t)max_its / 2;
+    int inside = 0, near_limit = 0;
+
+    #pragma omp parallel for default(none), shared(its),\
+                             firstprivate(pitch, width, height, max_its,\
+                                          half),\
+                             reduction(+: inside, near_limit)
+    for (int hy = 0; hy < height; hy++) {
+        const uint32_t *row = its + hy*pitch;
+
+        for (int hx = 0; hx < width; hx++) {
+            const uint32_t n = row[hx] & COUNT_MASK;
+
+            inside += n >= (uint32_t)max_its;
+            near_limit += n >= half && n < (uint32_t)max_its;
+        }
+    }
+
+    census->max_its = max_its;
+    census->pixels = width * height;
+    census->inside = inside;
+    census->near_limit = near_limit;
+}
+
+void init_budget(budget_state *b, int base, int limit)
+{
+    b->base = base;
+    b->limit = limit;
+    b->feedback = 0;
+    b->step = 0;
+}
+
+static double budget_of(const budget_state *b, int step)
+{
+    return b->base * pow(2.0, (double)step / STEPS_PER_DOUBLING);
+}
+
+int next_budget(budget_state *b, double zoom, const budget_census *prev)
+{
+    const double depth = zoom > 1.0 ? log(zoom) / log(2.0) : 0.0;
+    const double predicted = 1.0 + DEPTH_GROWTH * depth;
+    const int target = (int)floor(STEPS_PER_DOUBLING * log(predicted) /
+                                  log(2.0) + 0.5);
+    const double share = (double)prev->near_limit / prev->pixels;
+
+    /*
+     * Only correct once the last correction has been reached, or the
+     * feedback would keep growing while the limit catches up with it
+     */
+    if (b->step == target + b->feedback) {
+        if (share > RAISE_ABOVE && b->feedback < MAX_FEEDBACK)
+            b->feedback++;
+        else if (share < LOWER_BELOW && b->feedback > -MAX_FEEDBACK)
+            b->feedback--;
+    }
+
+    // Move by at most one step, so that frame times vary smoothly
+    int step = b->step;
+    if (target + b->feedback > step && budget_of(b, step) < b->limit)
+        step++;
+    else if (target + b->feedback < step && budget_of(b, step) > MIN_BUDGET)
+        step--;
+    b->step = step;
+
+    double its = budget_of(b, step);
+    its = its < MIN_BUDGET ? MIN_BUDGET : its;
+    its = its > b->limit ? b->limit : its;
+    return (int)(its + 0.5);
+}
@@ -0,0 +1,55 @@
+/*
+ * budget.h
+ *
+ * Adaptive iteration limits for a zoom. A fixed limit is too high for the
+ * shallow frames, where it is spent on interior points, and too low for
+ * the deep ones, where boundary detail needs more iterations to escape.
+ * The limit of each frame is predicted from the depth and corrected by
+ * feedback from the frame before: the share of pixels which escaped in
+ * the top half of the budget, i.e. only just. Many near misses mean points
+ * are being cut off that would escape with more; very few mean the top of
+ * the budget only goes on points which never escape.
+ *
+ * Limits are quantised to quarter powers of two of the depth 0 limit, so
+ * they change every few frames rather than every frame (which would force
+ * an incremental zoom to render a keyframe), and by at most one step at a
+ * time, so that frame times change smoothly.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdint.h>
+
+/* What the counts of a frame say about its iteration limit */
+struct budget_census {
+    int max_its;        // the limit the frame was computed with
+    int pixels;
+    int inside;         // reached the limit
+    int near_limit;     // escaped in the top half of the budget
+};
+
+void take_census(budget_census *census, const uint32_t *its, int pitch,
+                 int width, int height, int max_its);
+
+struct budget_state {
+    int base;           // limit at depth 0
+    int limit;          // never go above this
+    int feedback;       // correction to the depth prediction, in steps
+    int step;           // of the last limit returned
+};
+
+void init_budget(budget_state *b, int base, int limit);
+
+/*
+ * The limit for a frame zoom times deeper than depth 0, given the census
+ * of the previous frame. The first frame is given base.
+ */
+int next_budget(budget_state *b, double zoom, const budget_census *prev);
+
+#endif // BUDGET_H
@@ -0,0 +1,314 @@
+/*
+ * colorize.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <string.h>
+#include <math.h>
+
+// SSE Intrinsics
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+#include <omp.h> // OpenMP
+
+#include "kernel.h"
+#include "colorize.h"
+
+/*
+ * Color Palette. The original table of 40 colours, expanded to 64 entries
+ * by replicating the first 24 so that the colour index is count mod 64.
+ */
+static const uint32_t classic_colors[] = {
+    0xFFB404, 0xF09C04, 0xDC7C04, 0x9C4704, 0x481404, 0xFBB404, 0xB44A04,
+    0xB44604, 0xA45B04, 0x641C04, 0xBF5204, 0x2F0504, 0x8A2704, 0x511B04,
+    0xC05904, 0x3D1B04, 0xD89404, 0x470E04, 0x8E3004, 0xC46604, 0x3A0904,
+    0x842D04, 0x5F0F04, 0x5C1504, 0xA63B04, 0xF4B204, 0xC27904, 0x782904,
+    0x350E04, 0x500F04, 0x170304, 0xF9CC04, 0x611904, 0x7C1E04, 0x973904,
+    0x682404, 0xEFAB04, 0x833904, 0x6F1704, 0x040204,
+    0xFFB404, 0xF09C04, 0xDC7C04, 0x9C4704, 0x481404, 0xFBB404, 0xB44A04,
+    0xB44604, 0xA45B04, 0x641C04, 0xBF5204, 0x2F0504, 0x8A2704, 0x511B04,
+    0xC05904, 0x3D1B04, 0xD89404, 0x470E04, 0x8E3004, 0xC46604, 0x3A0904,
+    0x842D04, 0x5F0F04, 0x5C1504
+};
+
+const int GRADIENT_SIZE = 256;
+
+static uint32_t grey_colors[GRADIENT_SIZE];
+static uint32_t rainbow_colors[GRADIENT_SIZE];
+
+static palette palettes[] = {
+    { "classic", sizeof(classic_colors) / sizeof(classic_colors[0]),
+      classic_colors },
+    { "grey", GRADIENT_SIZE, grey_colors },
+    { "rainbow", GRADIENT_SIZE, rainbow_colors }
+};
+
+static inline uint32_t rgb(double r, double g, double b)
+{
+    return ((uint32_t)(255.0 * r + 0.5) << 16) |
+           ((uint32_t)(255.0 * g + 0.5) << 8) | (uint32_t)(255.0 * b + 0.5);
+}
+
+/*
+ * The gradients go there and back, so that cycling through them has no
+ * seam
+ */
+static void init_palettes()
+{
+    static bool done = false;
+
+    if (done)
+        return;
+    for (int i = 0; i < GRADIENT_SIZE; i++) {
+        const double t = (double)i / GRADIENT_SIZE;
+        const double v = 1.0 - fabs(2.0 * t - 1.0);
+        const double pi = 3.14159265358979323846;
+
+        grey_colors[i] = rgb(0.1 + 0.9 * v, 0.1 + 0.9 * v, 0.1 + 0.9 * v);
+        rainbow_colors[i] = rgb(0.5 + 0.5 * cos(2 * pi * t),
+                                0.5 + 0.5 * cos(2 * pi * (t - 1.0 / 3)),
+                                0.5 + 0.5 * cos(2 * pi * (t - 2.0 / 3)));
+    }
+    done = true;
+}
+
+int num_palettes()
+{
+    return sizeof(palettes) / sizeof(palettes[0]);
+}
+
+const palette *get_palette(int i)
+{
+    init_palettes();
+    return &palettes[i];
+}
+
+const palette *find_palette(const char *name)
+{
+    for (int i = 0; i < num_palettes(); i++) {
+        if (strcmp(name, palettes[i].name) == 0)
+            return get_palette(i);
+    }
+    return NULL;
+}
+
+void build_color_map(color_map *map, const coloring *col, int max_its,
+                     bool smooth, const uint32_t *its, int its_pitch,
+                     int width, int height)
+{
+    const palette *pal = col->pal;
+    const int offset = col->offset % pal->size;
+    const uint32_t mask = smooth ? COUNT_MASK : ~GLITCHED;
+
+    // The highest escaping count, whose next colour a fraction may need
+    uint32_t top = 0;
+    for (int hy = 0; hy < height; hy++) {
+        const uint32_t *row = its + hy * its_pitch;
+
+        for (int hx = 0; hx < width; hx++) {
+            const uint32_t n = row[hx] & mask;
+
+            if (n < (uint32_t)max_its && n > top)
+                top = n;
+        }
+    }
+    const size_t limit = top + 2 < (uint32_t)max_its ? top + 2 : max_its;
+
+    map->limit = (uint32_t)limit;
+    map->max_its = max_its;
+    map->smooth = smooth;
+    map->col = *col;
+    map->lut.resize(limit + 2);
+    uint32_t *lut = &map->lut[0];
+
+    if (!col->histogram) {
+        for (size_t n = 0; n < limit; n++)
+            lut[n] = pal->colors[(n % pal->size + offset) % pal->size];
+    } else {
+        /*
+         * Each count gets the colour at its place in the distribution of
+         * escaping counts, so that every colour covers about as many
+         * pixels whatever the depth and iteration limit
+         */
+        std::vector<uint32_t> histogram(limit + 1, 0);
+        uint64_t escaped = 0;
+
+        for (int hy = 0; hy < height; hy++) {
+            const uint32_t *row = its + hy * its_pitch;
+
+            for (int hx = 0; hx < width; hx++) {
+                const uint32_t n = row[hx] & mask;
+
+                histogram[n < limit ? n : limit]++;
+            }
+        }
+        for (size_t n = 0; n < limit; n++)
+            escaped += histogram[n];
+
+        uint64_t below = 0;
+        for (size_t n = 0; n < limit; n++) {
+            const int index = escaped == 0 ? 0 :
+                              (int)((below * pal->size) / escaped);
+
+            lut[n] = pal->colors[(index + offset) % pal->size];
+            below += histogram[n];
+        }
+    }
+
+    lut[limit] = 0;
+    lut[limit + 1] = 0;
+}
+
+/*
+ * As build_color_map() would have it: histogram colouring has every
+ * escaping count of the frame below n, so n gets the colour after the
+ * last
+ */
+uint32_t color_past(const color_map *map, uint32_t n)
+{
+    const palette *pal = map->col.pal;
+    const int offset = map->col.offset % pal->size;
+
+    if (n >= (uint32_t)map->max_its)
+        return 0;
+    if (map->col.histogram)
+        return pal->colors[offset];
+    return pal->colors[(n % pal->size + offset) % pal->size];
+}
+
+/*
+ * The colours a + (b - a) * f / 128 of four pixels, f being their fraction
+ * bits, in 16 bit lanes of a channel each as in color_of()
+ */
+static inline __m128i blend4(__m128i a, __m128i b, __m128i f)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    // Each pixel's fraction in the lanes of all four of its channels
+    const __m128i f2 = _mm_or_si128(f, _mm_slli_epi32(f, 16));
+    const __m128i f_lo = _mm_unpacklo_epi32(f2, f2);
+    const __m128i f_hi = _mm_unpackhi_epi32(f2, f2);
+
+    const __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+    const __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+    const __m128i d_lo = _mm_sub_epi16(_mm_unpacklo_epi8(b, zero), a_lo);
+    const __m128i d_hi = _mm_sub_epi16(_mm_unpackhi_epi8(b, zero), a_hi);
+
+    return _mm_packus_epi16(
+        _mm_add_epi16(a_lo, _mm_srai_epi16(_mm_mullo_epi16(d_lo, f_lo),
+                                           FRACTION_BITS)),
+        _mm_add_epi16(a_hi, _mm_srai_epi16(_mm_mullo_epi16(d_hi, f_hi),
+                                           FRACTION_BITS)));
+}
+
+/*
+ * Frames of more than this many bytes are written with non-temporal
+ * stores, which send whole lines to memory without first reading them into
+ * the cache. A frame that size is out of the cache by the time its
+ * reader, the display or the writer thread, gets to it, so caching it
+ * would only cost the reads and evict the counts and the table.
+ */
+const size_t STREAM_BYTES = 1 << 20;
+
+/*
+ * The counts are loaded and cleaned four at a time and the colours stored
+ * four at a time; SSE2 has no gather, so the lookups themselves are
+ * scalar, from a table small enough to stay in cache. Only pixels with
+ * fractions need the next colours as well, and blending.
+ *
+ * Streamed stores must be aligned, so the pixels up to the first 16 byte
+ * boundary of a row are done one at a time like those at its end. Rows go
+ * to threads in runs of at least 50, which share a line at most where one
+ * run ends and the next begins.
+ */
+void colorize(const uint32_t *its, int its_pitch, int width, int height,
+              const color_map *map, uint32_t *pixels, int pitch)
+{
+    const uint32_t *lut = &map->lut[0];
+    // Without smooth there are no fractions, only the marks to clear
+    const __m128i count_mask4 = _mm_set1_epi32(map->smooth ? COUNT_MASK
+                                                          : ~GLITCHED);
+    const __m128i fraction_mask4 =
+        _mm_set1_epi32(map->smooth ? (1 << FRACTION_BITS) - 1 : 0);
+    const __m128i limit4 = _mm_set1_epi32(map->limit);
+    const bool stream = (size_t)height * pitch * sizeof(uint32_t) >
+                        STREAM_BYTES;
+
+    #pragma omp parallel default(none), shared(its, pixels, lut, map),\
+                         firstprivate(count_mask4, fraction_mask4,\
+                                      limit4, stream,\
+                                      its_pitch, width, height, pitch)
+    {
+        #pragma omp for schedule(guided, 50) nowait
+        for (int hy = 0; hy < height; hy++) {
+            const uint32_t *row_its = its + hy*its_pitch;
+            uint32_t *row = pixels + hy*pitch;
+            int lead = 0, hx;
+
+            if (stream) {
+                lead = (-(uintptr_t)row & 15) / sizeof(uint32_t);
+                if (lead > width)
+                    lead = width;
+            }
+            for (hx = 0; hx < lead; hx++)
+                row[hx] = color_of(map, row_its[hx]);
+
+            for (; hx + 4 <= width; hx += 4) {
+                __m128i iterations4 = _mm_loadu_si128((__m128i *)
+                                                      (row_its + hx));
+
+                // A pixel left glitched takes the colour of its count
+                const __m128i fractions4 =
+                    _mm_and_si128(_mm_srli_epi32(iterations4,
+                                                 FRACTION_SHIFT),
+                                  fraction_mask4);
+                iterations4 = _mm_and_si128(iterations4, count_mask4);
+
+                // Of the frame's counts only max_its is past the limit
+                const __m128i past4 = _mm_cmpgt_epi32(iterations4,
+                                                      limit4);
+                iterations4 = _mm_or_si128(_mm_andnot_si128(past4,
+                                                            iterations4),
+                                           _mm_and_si128(past4, limit4));
+
+                union {
+                    __m128i v;
+                    uint32_t index[4];
+                } u;
+
+                u.v = iterations4;
+                __m128i colors4 = _mm_setr_epi32(lut[u.index[0]],
+                                                 lut[u.index[1]],
+                                                 lut[u.index[2]],
+                                                 lut[u.index[3]]);
+                if (_mm_movemask_epi8(_mm_cmpeq_epi32(fractions4,
+                                                      _mm_setzero_si128()))
+                    != 0xFFFF) {
+                    colors4 = blend4(colors4,
+                                     _mm_setr_epi32(lut[u.index[0] + 1],
+                                                    lut[u.index[1] + 1],
+                                                    lut[u.index[2] + 1],
+                                                    lut[u.index[3] + 1]),
+                                     fractions4);
+                }
+                if (stream)
+                    _mm_stream_si128((__m128i *)(row + hx), colors4);
+                else
+                    _mm_storeu_si128((__m128i *)(row + hx), colors4);
+            }
+
+            // The last pixels, fewer than four
+            for (; hx < width; hx++)
+                row[hx] = color_of(map, row_its[hx]);
+        }
+
+        // Streamed stores are weakly ordered; have them out before the join
+        if (stream)
+            _mm_sfence();
+    }
+}
@@ -0,0 +1,111 @@
+/*
+ * colorize.h
+ *
+ * Mapping iteration counts to colours. The counts of a frame are left
+ * untouched, so a frame can be recoloured with another palette, cycled or
+ * histogram equalised in one cheap pass, without rendering it again.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef COLORIZE_H
+#define COLORIZE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "kernel.h"
+
+/* Colours which escaping points cycle through, as 0x00RRGGBB */
+struct palette {
+    const char *name;
+    int size;
+    const uint32_t *colors;
+};
+
+// Number of palettes, and the ith (0 is the default)
+int num_palettes();
+const palette *get_palette(int i);
+
+// The palette called name, or NULL
+const palette *find_palette(const char *name);
+
+/* How counts are mapped to a palette */
+struct coloring {
+    const palette *pal;
+    int offset;         // palette cycling: start this many colours later
+    bool histogram;     // spread colours evenly over the escaping pixels
+};
+
+/*
+ * The colour of every count of one frame up to max_its. Points which did
+ * not escape (max_its) are black. Only smooth counts have a fraction (see
+ * FRACTION_SHIFT): they are that far from their colour to the next one's,
+ * so the first escaping counts blend towards black.
+ *
+ * The table stops just past the highest escaping count of the frame
+ * rather than at max_its, with black entries at limit for max_its; the
+ * few counts past it that antialiasing finds are coloured without it.
+ */
+struct color_map {
+    std::vector<uint32_t> lut;          // limit + 2 entries
+    uint32_t limit;                     // the first count not in lut
+    int max_its;
+    bool smooth;                        // decode fractions
+    coloring col;
+};
+
+/*
+ * Build the color map for the counts of a frame (its_pitch entries per
+ * row), at most max_its and with fractions if smooth
+ */
+void build_color_map(color_map *map, const coloring *col, int max_its,
+                     bool smooth, const uint32_t *its, int its_pitch,
+                     int width, int height);
+
+// The colour of count n past map->limit
+uint32_t color_past(const color_map *map, uint32_t n);
+
+// The colour of count n, without fraction or marks
+inline uint32_t count_color(const color_map *map, uint32_t n)
+{
+    return n < map->limit ? map->lut[n] : color_past(map, n);
+}
+
+/*
+ * Map the iteration counts of a width x height frame (its_pitch entries per
+ * row) to 0x00RRGGBB pixels (pitch entries per row). its and pixels may be
+ * the same buffer, provided the pitches are equal. The counts must be
+ * those the map was built for.
+ */
+void colorize(const uint32_t *its, int its_pitch, int width, int height,
+              const color_map *map, uint32_t *pixels, int pitch);
+
+// The colour colorize() gives count c
+inline uint32_t color_of(const color_map *map, uint32_t c)
+{
+    const uint32_t n = c & (map->smooth ? COUNT_MASK : ~GLITCHED);
+    const uint32_t a = count_color(map, n);
+
+    if (!map->smooth)
+        return a;
+    const int f = (c >> FRACTION_SHIFT) & ((1 << FRACTION_BITS) - 1);
+    if (f == 0)
+        return a;
+
+    // Each channel a + (b - a) * f / 128, rounded down
+    const uint32_t b = count_color(map, n + 1);
+    uint32_t rgb = 0;
+    for (int shift = 0; shift < 24; shift += 8) {
+        const int ca = (a >> shift) & 0xFF;
+        const int cb = (b >> shift) & 0xFF;
+
+        rgb |= (uint32_t)(ca + (((cb - ca) * f) >> FRACTION_BITS)) << shift;
+    }
+    return rgb;
+}
+
+#endif // COLORIZE_H
@@ -0,0 +1,548 @@
+/*
+ * config.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "config.h"
+#include "antialias.h"
+
+// Largest frame side accepted, to keep width * height within an int
+const int MAX_RESOLUTION = 32768;
+
+// Posters are only ever in memory a strip at a time
+const int MAX_POSTER_RESOLUTION = 65536;
+
+const int MAX_CONFIG_DEPTH = 8;     // of configuration files reading others
+
+static const char usage_text[] =
+    "usage: %s [options]\n"
+    "\n"
+    "  --width N, --height N   resolution (700 x 700)\n"
+    "  --max-its N             iterations before a point is deemed inside "
+    "(500)\n"
+    "                          at most 16777214, here and for --its-limit\n"
+    "  --adaptive              raise or lower the iterations each frame with\n"
+    "                          the depth and the counts of the frame before\n"
+    "  --its-limit N           at most N iterations with --adaptive (100000)\n"
+    "  --depth N               number of frames to zoom in by (150)\n"
+    "  --zoom F                zoom between each frame (1.07)\n"
+    "  --center-x X            centre of the zoom, as a decimal number of any\n"
+    "  --center-y Y            length (-0.702295281061, +0.350220783400)\n"
+    "  --formula NAME          mandelbrot, julia, cubic (z^3), quartic (z^4)\n"
+    "                          or burning-ship (mandelbrot)\n"
+    "  --julia X,Y             the Julia set of X + iY (-0.8,0.156)\n"
+    "  --config FILE           read options from FILE\n"
+    "\n"
+    "  --kernel NAME           sse2, avx2 or avx512 (the widest supported)\n"
+    "  --no-bulbs              no cardioid and period-2 bulb test\n"
+    "  --no-periodicity        no cycle detection\n"
+    "  --no-refill             vector lanes wait for each other\n"
+    "  --no-series             compute every iteration of deep zoom pixels,\n"
+    "                          without the series approximation\n"
+    "  --smooth                smooth colouring, by the fraction of an\n"
+    "                          iteration each point escaped by\n"
+    "  --backend NAME          cpu, or opencl to compute frames on a GPU\n"
+    "                          where it can (cpu)\n"
+    "  --subdivide | --rows    Mariani-Silver subdivision or row scheduling\n"
+    "                          instead of work-stealing tiles\n"
+    "  --pin cores|nodes       pin compute threads to a core each, or to the\n"
+    "                          cores of a NUMA node, filling nodes in turn\n"
+    "                          (not pinned)\n"
+    "  --palette NAME          classic, grey or rainbow (classic)\n"
+    "  --histogram             histogram colouring: each colour covers about\n"
+    "                          as many pixels\n"
+    "  --cycle N               cycle the palette by N colours each frame\n"
+    "  --aa N                  anti-alias with up to 4 + N x N samples on\n"
+    "                          pixels at edges (2 to 8, headless only)\n"
+    "\n"
+    "  --cache N               tiles cached for navigation (4096; 64x64 "
+    "pixels\n"
+    "                          each), or by --serve\n"
+    "  --progressive           show each frame at 1/8, 1/4, 1/2 and full\n"
+    "                          resolution as it is computed\n"
+    "  --incremental           start each frame from the last one, and only\n"
+    "                          compute what is not flat\n"
+    "  --tolerance N           count difference still deemed flat (0)\n"
+    "  --keyframe N            render every Nth frame in full (16)\n"
+    "  --verify                also render in full and count the errors\n"
+    "\n"
+    "  --stats                 per-thread timings of every frame, or the\n"
+    "                          time of every frame served as a --worker\n"
+    "                          or batch of tiles for --serve\n"
+    "  --profile FILE          write per-tile timings, kernel iterations and\n"
+    "                          lane use, and count histograms to FILE as\n"
+    "                          JSON (builds with make INSTRUMENT=1)\n"
+    "  --trace FILE            the same for chrome://tracing or Perfetto\n"
+    "  --bench                 render the standard viewports and write the\n"
+    "                          timings to stdout as JSON\n"
+    "  --frames N              frames per viewport for --bench (10)\n"
+    "  --baseline FILE         with --bench, also time each kernel alone and\n"
+    "                          fail if any is slower than in FILE by more\n"
+    "                          than --slowdown F of it (0.25)\n"
+    "  --write-baseline        write the timings to FILE instead\n"
+    "  --check                 check the counts of every kernel, flag and\n"
+    "                          scheduler against the golden counts\n"
+    "  --golden DIR            where the golden counts are (golden)\n"
+    "  --write-golden          write them with the plain SSE2 kernel instead\n"
+    "\n"
+    "  --headless              render without a display\n"
+    "  --raw | --y4m           stream rgb24 or YUV4MPEG2 frames to stdout\n"
+    "  --png PATTERN           write files named by the printf pattern\n"
+    "                          (frame%%04d.png)\n"
+    "  The last three imply --headless.\n"
+    "  --poster                render the first frame only, as one image of\n"
+    "                          up to 65536 x 65536 written a strip at a time\n"
+    "                          with --raw or --png (a file name)\n"
+    "  --store DIR             keep the counts of every frame in DIR, and\n"
+    "                          read them back instead of computing them\n"
+    "\n"
+    "  --workers LIST          render the frames on the comma separated\n"
+    "                          host:port workers (implies --headless)\n"
+    "  --worker PORT           be a worker, listening on PORT\n"
+    "  --serve PORT            serve tiles over HTTP on PORT, keeping up to\n"
+    "                          --cache of them (see server.h)\n";
+
+static const char *program_name = "mandelbrot";
+static int config_depth = 0;    // configuration files being read
+
+
+void default_config(config *c)
+{
+    c->width = 700;
+    c->height = 700;
+    c->max_its = 500;
+    c->adaptive = false;
+    c->its_limit = 100000;
+    c->max_depth = 150;
+    c->zoom_factor = 1.07;
+    c->center_x = "-0.702295281061";
+    c->center_y = "+0.350220783400";
+    c->formula = FORMULA_MANDELBROT;
+    c->julia_x = -0.8;
+    c->julia_y = 0.156;
+
+    c->kernel = "";
+    c->kernel_flags = KERNEL_DEFAULT_FLAGS;
+    c->backend = "cpu";
+    c->mode = RENDER_TILES;
+    c->pin = PIN_NONE;
+    c->cache_tiles = 4096;
+    c->progressive = false;
+    c->incremental = false;
+    c->inc.tolerance = 0;
+    c->inc.keyframe = 16;
+    c->inc.verify = false;
+
+    c->col.pal = get_palette(0);
+    c->col.offset = 0;
+    c->col.histogram = false;
+    c->cycle = 0;
+    c->aa_grid = 0;
+
+    c->stats = false;
+    c->profile_path = "";
+    c->trace_path = "";
+    c->bench = false;
+    c->bench_frames = 10;
+    c->baseline_path = "";
+    c->write_baseline = false;
+    c->slowdown = 0.25;
+    c->check = false;
+    c->golden_dir = "golden";
+    c->write_golden = false;
+    c->headless = false;
+    c->output = false;
+    c->poster = false;
+    c->format = OUTPUT_RAW;
+    c->output_path = "";
+    c->store_path = "";
+    c->workers = "";
+    c->worker_port = 0;
+    c->serve_port = 0;
+}
+
+static void usage()
+{
+    fprintf(stderr, usage_text, program_name);
+    exit(EXIT_FAILURE);
+}
+
+static bool parse_int(const char *s, int min, int max, int *v)
+{
+    char *end;
+
+    errno = 0;
+    long l = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || l < min || l > max)
+        return false;
+    *v = (int)l;
+    return true;
+}
+
+// The form fixed_point::from_string() takes: [+-]digits[.digits]
+static bool is_decimal(const char *s)
+{
+    bool digits = false;
+
+    if (*s == '+' || *s == '-')
+        s++;
+    for (; isdigit((unsigned char)*s); s++)
+        digits = true;
+    if (*s == '.') {
+        for (s++; isdigit((unsigned char)*s); s++)
+            digits = true;
+    }
+    return digits && *s == '\0';
+}
+
+/*
+ * Options which take a value. Every other option is a flag, and must not
+ * be given one.
+ */
+static bool takes_value(const char *name)
+{
+    static const char *const names[] = {
+        "width", "height", "max-its", "depth", "zoom", "center-x",
+        "center-y", "config", "kernel", "backend", "png", "frames",
+        "palette", "cycle", "aa", "tolerance", "keyframe",
+        "cache", "its-limit", "workers", "worker", "serve", "store", "profile",
+        "trace", "formula", "julia", "pin", "baseline", "slowdown", "golden"
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Whether s is a printf pattern for one int: one %d, with any flags and
+ * width and precision, and otherwise only %%
+ */
+static bool frame_pattern(const char *s)
+{
+    int numbers = 0;
+
+    for (s = strchr(s, '%'); s != NULL; s = strchr(s + 1, '%')) {
+        if (s[1] == '%') {
+            s++;
+            continue;
+        }
+        s += 1 + strspn(s + 1, "-+ #0");
+        s += strspn(s, "0123456789");
+        if (*s == '.') {
+            s++;
+            s += strspn(s, "0123456789");
+        }
+        if (*s != 'd')
+            return false;
+        numbers++;
+    }
+    return numbers == 1;
+}
+
+/*
+ * Apply option name (without dashes) with value, which is NULL for flags.
+ * Returns false if the option is unknown or the value is invalid.
+ */
+static bool set_option(config *c, const char *name, const char *value)
+{
+    if (strcmp(name, "width") == 0)
+        return parse_int(value, 1, MAX_POSTER_RESOLUTION, &c->width);
+    if (strcmp(name, "height") == 0)
+        return parse_int(value, 1, MAX_POSTER_RESOLUTION, &c->height);
+    if (strcmp(name, "max-its") == 0)
+        return parse_int(value, 1, MAX_ITS, &c->max_its);
+    if (strcmp(name, "its-limit") == 0)
+        return parse_int(value, 1, MAX_ITS, &c->its_limit);
+    if (strcmp(name, "depth") == 0)
+        return parse_int(value, 0, 0x7FFFFFFF, &c->max_depth);
+    if (strcmp(name, "cache") == 0)
+        return parse_int(value, 0, 0x7FFFFFFF, &c->cache_tiles);
+    if (strcmp(name, "tolerance") == 0)
+        return parse_int(value, 0, 0x7FFFFFFF, &c->inc.tolerance);
+    if (strcmp(name, "keyframe") == 0)
+        return parse_int(value, 1, 0x7FFFFFFF, &c->inc.keyframe);
+    if (strcmp(name, "cycle") == 0)
+        return parse_int(value, 0, 0x7FFFFFFF, &c->cycle);
+    if (strcmp(name, "aa") == 0)
+        return parse_int(value, 2, MAX_AA_GRID, &c->aa_grid);
+    if (strcmp(name, "frames") == 0)
+        return parse_int(value, 1, 0x7FFFFFFF, &c->bench_frames);
+    if (strcmp(name, "worker") == 0)
+        return parse_int(value, 1, 65535, &c->worker_port);
+    if (strcmp(name, "serve") == 0)
+        return parse_int(value, 1, 65535, &c->serve_port);
+
+    if (strcmp(name, "slowdown") == 0) {
+        char *end;
+        double f = strtod(value, &end);
+
+        if (end == value || *end != '\0' || !(f >= 0.0))
+            return false;
+        c->slowdown = f;
+        return true;
+    }
+
+    if (strcmp(name, "zoom") == 0) {
+        char *end;
+        double z = strtod(value, &end);
+
+        if (end == value || *end != '\0' || !(z > 0.0))
+            return false;
+        c->zoom_factor = z;
+        return true;
+    }
+
+    if (strcmp(name, "center-x") == 0) {
+        if (!is_decimal(value))
+            return false;
+        c->center_x = value;
+        return true;
+    }
+    if (strcmp(name, "center-y") == 0) {
+        if (!is_decimal(value))
+            return false;
+        c->center_y = value;
+        return true;
+    }
+
+    if (strcmp(name, "config") == 0) {
+        if (config_depth >= MAX_CONFIG_DEPTH) {
+            fprintf(stderr, "%s: configuration files nested too deeply\n",
+                    value);
+            exit(EXIT_FAILURE);
+        }
+        read_config(c, value);
+        return true;
+    }
+
+    if (strcmp(name, "formula") == 0)
+        return find_formula(value, &c->formula);
+
+    if (strcmp(name, "julia") == 0) {
+        char *end;
+        const double x = strtod(value, &end);
+
+        if (end == value || *end != ',')
+            return false;
+        value = end + 1;
+        const double y = strtod(value, &end);
+        if (end == value || *end != '\0')
+            return false;
+        c->formula = FORMULA_JULIA;
+        c->julia_x = x;
+        c->julia_y = y;
+        return true;
+    }
+
+    if (strcmp(name, "pin") == 0)
+        return find_pin_mode(value, &c->pin);
+
+    if (strcmp(name, "palette") == 0) {
+        const palette *pal = find_palette(value);
+
+        if (pal == NULL)
+            return false;
+        c->col.pal = pal;
+        return true;
+    }
+
+    if (strcmp(name, "kernel") == 0) {
+        if (find_kernel(value) == NULL) {
+            fprintf(stderr, "Kernel %s is unknown or not supported by this "
+                    "CPU\n", value);
+            exit(EXIT_FAILURE);
+        }
+        c->kernel = value;
+        return true;
+    }
+
+    if (strcmp(name, "backend") == 0) {
+        if (strcmp(value, "cpu") != 0 && strcmp(value, "opencl") != 0)
+            return false;
+        c->backend = value;
+        return true;
+    }
+
+    if (strcmp(name, "no-bulbs") == 0)
+        c->kernel_flags &= ~KERNEL_BULBS;
+    else if (strcmp(name, "no-periodicity") == 0)
+        c->kernel_flags &= ~KERNEL_PERIODICITY;
+    else if (strcmp(name, "no-refill") == 0)
+        c->kernel_flags &= ~KERNEL_REFILL;
+    else if (strcmp(name, "no-series") == 0)
+        c->kernel_flags &= ~KERNEL_SERIES;
+    else if (strcmp(name, "smooth") == 0)
+        c->kernel_flags |= KERNEL_SMOOTH;
+    else if (strcmp(name, "subdivide") == 0)
+        c->mode = RENDER_SUBDIVIDE;
+    else if (strcmp(name, "rows") == 0)
+        c->mode = RENDER_ROWS;
+    else if (strcmp(name, "progressive") == 0)
+        c->progressive = true;
+    else if (strcmp(name, "adaptive") == 0)
+        c->adaptive = true;
+    else if (strcmp(name, "incremental") == 0)
+        c->incremental = true;
+    else if (strcmp(name, "verify") == 0)
+        c->inc.verify = true;
+    else if (strcmp(name, "histogram") == 0)
+        c->col.histogram = true;
+    else if (strcmp(name, "stats") == 0)
+        c->stats = true;
+    else if (strcmp(name, "bench") == 0)
+        c->bench = true;
+    else if (strcmp(name, "check") == 0)
+        c->check = true;
+    else if (strcmp(name, "write-golden") == 0)
+        c->write_golden = true;
+    else if (strcmp(name, "write-baseline") == 0)
+        c->write_baseline = true;
+    else if (strcmp(name, "baseline") == 0)
+        c->baseline_path = value;
+    else if (strcmp(name, "golden") == 0)
+        c->golden_dir = value;
+    else if (strcmp(name, "headless") == 0)
+        c->headless = true;
+    else if (strcmp(name, "poster") == 0)
+        c->poster = true;
+    else if (strcmp(name, "raw") == 0 || strcmp(name, "y4m") == 0) {
+        c->format = name[0] == 'r' ? OUTPUT_RAW : OUTPUT_Y4M;
+        c->output = true;
+    } else if (strcmp(name, "png") == 0) {
+        c->format = OUTPUT_PNG;
+        c->output_path = value;
+        c->output = true;
+    } else if (strcmp(name, "workers") == 0) {
+        c->workers = value;
+    } else if (strcmp(name, "store") == 0) {
+        c->store_path = value;
+    } else if (strcmp(name, "profile") == 0) {
+        c->profile_path = value;
+    } else if (strcmp(name, "trace") == 0) {
+        c->trace_path = value;
+    } else
+        return false;
+    return true;
+}
+
+void parse_args(config *c, int argc, char *argv[])
+{
+    program_name = argv[0];
+
+    for (int i = 1; i < argc; i++) {
+        const char *name = argv[i];
+        const char *value = NULL;
+
+        if (strncmp(name, "--", 2) != 0)
+            usage();
+        name += 2;
+        if (takes_value(name)) {
+            if (++i == argc)
+                usage();
+            value = argv[i];
+        }
+
+        if (!set_option(c, name, value)) {
+            fprintf(stderr, "Invalid option --%s%s%s\n\n", name,
+                    value != NULL ? " " : "", value != NULL ? value : "");
+            usage();
+        }
+    }
+
+    if ((c->kernel_flags & KERNEL_SMOOTH) && formula_degree(c->formula) != 2) {
+        fprintf(stderr, "--smooth is only for formulas of degree 2\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (c->write_baseline && c->baseline_path.empty()) {
+        fprintf(stderr, "--write-baseline needs --baseline\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (c->output && c->format == OUTPUT_PNG && !c->poster &&
+        !frame_pattern(c->output_path.c_str())) {
+        fprintf(stderr, "--png needs a pattern with one %%d and no other "
+                "%%, other than %%%%\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!c->poster && (c->width > MAX_RESOLUTION ||
+                       c->height > MAX_RESOLUTION)) {
+        fprintf(stderr, "Frames over %d pixels a side need --poster\n",
+                MAX_RESOLUTION);
+        exit(EXIT_FAILURE);
+    }
+    // A poster is never whole, nor has a frame before it
+    if (c->poster && (!c->output || c->format == OUTPUT_Y4M)) {
+        fprintf(stderr, "--poster needs --raw or --png\n");
+        exit(EXIT_FAILURE);
+    }
+    if (c->poster && (c->col.histogram || c->aa_grid != 0 ||
+                      c->incremental || !c->workers.empty())) {
+        fprintf(stderr, "--poster cannot be used with --histogram, --aa, "
+                "--incremental or --workers\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void read_config(config *c, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[4096];
+    int number = 0;
+
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    config_depth++;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+
+        // Strip trailing and leading white space
+        char *end = line + strlen(line);
+        while (end > line && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+        char *name = line;
+        while (isspace((unsigned char)*name))
+            name++;
+        if (*name == '\0' || *name == '#')
+            continue;
+
+        // The name ends at white space or '=', the value follows both
+        char *value = name;
+        while (*value != '\0' && *value != '=' &&
+               !isspace((unsigned char)*value))
+            value++;
+        if (*value != '\0') {
+            *value++ = '\0';
+            while (isspace((unsigned char)*value) || *value == '=')
+                value++;
+        }
+
+        const bool has_value = *value != '\0';
+        if (has_value != takes_value(name) ||
+            !set_option(c, name, has_value ? value : NULL)) {
+            fprintf(stderr, "%s:%d: invalid option %s\n", path, number,
+                    name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    config_depth--;
+
+    fclose(file);
+}
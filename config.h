@@ -0,0 +1,100 @@
+/*
+ * config.h
+ *
+ * Run time settings, from the command line and from configuration files.
+ * A configuration file holds one option per line, named as on the command
+ * line without the leading dashes, with its value (if any) after
+ * whitespace or '='. Blank lines and lines starting with '#' are ignored:
+ *
+ *     # 4K zoom into seahorse valley
+ *     width = 3840
+ *     height = 2160
+ *     center-x = -0.743643887037151
+ *     center-y = +0.131825904205330
+ *     max-its = 2000
+ *
+ * Files given with --config are read when they are reached, so options
+ * after it override the file and options before it are overridden by it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+
+#include "render.h"
+#include "output.h"
+#include "incremental.h"
+#include "placement.h"
+
+struct config {
+    int width;                  // resolution
+    int height;
+    int max_its;                // iterations after which a point is inside
+    bool adaptive;              // max_its is only that of depth 0
+    int its_limit;              // highest adaptive max_its
+    int max_depth;              // frames to zoom in by
+    double zoom_factor;         // zoom between each frame
+    std::string center_x;       // part of the image to zoom in on, in full
+    std::string center_y;
+    formula_type formula;
+    double julia_x;             // c of the Julia set
+    double julia_y;
+
+    std::string kernel;         // empty for the widest the CPU supports
+    unsigned kernel_flags;
+    std::string backend;        // cpu or opencl
+    render_mode mode;
+    pin_mode pin;               // of the compute threads
+    int cache_tiles;            // navigation tile cache capacity
+    bool progressive;           // show frames as they are computed
+    bool incremental;           // zoom incrementally, with inc
+    incremental_params inc;
+
+    coloring col;
+    int cycle;                  // colours to cycle by each frame
+    int aa_grid;                // anti-aliasing samples per side, or 0
+
+    bool stats;
+    std::string profile_path;   // JSON record of every frame, if any
+    std::string trace_path;     // and as a trace
+    bool bench;                 // run the benchmark instead of the zoom
+    int bench_frames;           // per viewport
+    std::string baseline_path;  // kernel timings to --bench against
+    bool write_baseline;        // or to record
+    double slowdown;            // fraction slower than them that fails
+    bool check;                 // check the kernels instead of the zoom
+    std::string golden_dir;     // counts to check against
+    bool write_golden;          // or to record
+    bool headless;
+    bool output;                // stream frames in format
+    output_format format;
+    bool poster;                // one frame, written a strip at a time
+    std::string output_path;    // printf pattern for PNG files
+    std::string store_path;     // directory of stored frames, if any
+
+    std::string workers;        // host:port list to render on, if any
+    int worker_port;            // 0 unless running as a worker
+    int serve_port;             // 0 unless serving tiles
+};
+
+void default_config(config *c);
+
+/*
+ * Apply the command line to c. Prints the usage message and exits on an
+ * unknown option or a bad value.
+ */
+void parse_args(config *c, int argc, char *argv[]);
+
+/*
+ * Apply the options in the file at path to c. Prints a message naming the
+ * line and exits on an error.
+ */
+void read_config(config *c, const char *path);
+
+#endif // CONFIG_H
@@ -0,0 +1,531 @@
+/*
+ * distribute.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <deque>
+#include <map>
+#include <set>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <omp.h> // OpenMP
+
+#include "distribute.h"
+
+const uint32_t JOB_MAGIC = 0x4d4a4f42;      // "MJOB"
+const uint32_t COUNTS_MAGIC = 0x4d435453;   // "MCTS"
+const uint32_t MAX_JOB = 1 << 20;           // bytes of frame description
+const int MAX_PIXELS = 1 << 28;
+
+const int PIPELINE = 2;             // frames in flight per worker
+const int WINDOW = 4;               // frames finished ahead, per frame in flight
+const double CONNECT_TIMEOUT = 2.0; // seconds
+const double RECONNECT_DELAY = 5.0;
+const double GIVE_UP_AFTER = 60.0;  // without any worker
+const double FRAME_TIMEOUT = 30.0;  // least wait for a frame to start coming
+const double SLOWEST_FACTOR = 4.0;  // and at least this times the slowest
+
+
+/*
+ * Every message is a header in network byte order followed by length
+ * bytes: a job's frame description as text, or the counts of frame id as
+ * network order uint32_t
+ */
+struct message_header {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t length;
+};
+
+static bool write_full(int fd, const void *buf, size_t n)
+{
+    const char *p = (const char *)buf;
+
+    while (n > 0) {
+        ssize_t done = send(fd, p, n, MSG_NOSIGNAL);
+
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        p += done;
+        n -= done;
+    }
+    return true;
+}
+
+static bool read_full(int fd, void *buf, size_t n)
+{
+    char *p = (char *)buf;
+
+    while (n > 0) {
+        ssize_t done = recv(fd, p, n, 0);
+
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        p += done;
+        n -= done;
+    }
+    return true;
+}
+
+static bool send_message(int fd, uint32_t magic, uint32_t id,
+                         const void *payload, uint32_t length)
+{
+    message_header h;
+
+    h.magic = htonl(magic);
+    h.id = htonl(id);
+    h.length = htonl(length);
+    return write_full(fd, &h, sizeof(h)) && write_full(fd, payload, length);
+}
+
+static std::string describe_frame(const render_params *p,
+                                  const std::string &center_x,
+                                  const std::string &center_y)
+{
+    char numbers[256];
+
+    // 17 significant digits read back as the same double
+    snprintf(numbers, sizeof(numbers), "%d %d %d %u %d %d %.17g %.17g "
+             "%.17g %.17g ", p->width, p->height, p->kp.max_its, p->kp.flags,
+             (int)p->kp.formula, (int)p->mode, p->kp.julia_x, p->kp.julia_y,
+             p->delta_x, p->delta_y);
+    return numbers + center_x + " " + center_y;
+}
+
+static bool parse_frame(const std::string &s, render_params *p)
+{
+    int formula, mode, used = 0;
+
+    if (sscanf(s.c_str(), "%d %d %d %u %d %d %lf %lf %lf %lf %n", &p->width,
+               &p->height, &p->kp.max_its, &p->kp.flags, &formula, &mode,
+               &p->kp.julia_x, &p->kp.julia_y, &p->delta_x, &p->delta_y,
+               &used) != 10 || used == 0)
+        return false;
+    if (p->width < 1 || p->height < 1 ||
+        p->height > MAX_PIXELS / p->width || p->kp.max_its < 1 ||
+        p->kp.max_its > MAX_ITS ||
+        formula < FORMULA_MANDELBROT || formula > FORMULA_BURNING_SHIP ||
+        mode < RENDER_TILES || mode > RENDER_SUBDIVIDE)
+        return false;
+
+    const size_t space = s.find(' ', used);
+    if (space == std::string::npos)
+        return false;
+
+    p->kern = select_kernel();
+    p->kp.formula = (formula_type)formula;
+    p->mode = (render_mode)mode;
+    p->gpu = NULL;
+    p->store = NULL;
+    p->center_x = fixed_point::from_string(s.substr(used, space - used)
+                                           .c_str());
+    p->center_y = fixed_point::from_string(s.c_str() + space + 1);
+    p->col.pal = get_palette(0);
+    p->col.offset = 0;
+    p->col.histogram = false;
+    return true;
+}
+
+/*
+ * Answer the jobs of one coordinator until it hangs up, with the time of
+ * each if stats
+ */
+static void serve(int fd, gpu_device *gpu, bool stats)
+{
+    std::vector<uint32_t> its;
+    std::string job;
+    message_header h;
+
+    while (read_full(fd, &h, sizeof(h))) {
+        const uint32_t id = ntohl(h.id);
+        const uint32_t length = ntohl(h.length);
+        render_params p;
+
+        if (ntohl(h.magic) != JOB_MAGIC || length > MAX_JOB) {
+            fprintf(stderr, "Bad job from coordinator\n");
+            return;
+        }
+        job.resize(length);
+        if (length > 0 && !read_full(fd, &job[0], length))
+            return;
+        if (!parse_frame(job, &p)) {
+            fprintf(stderr, "Bad frame description: %s\n", job.c_str());
+            return;
+        }
+
+        const double start = omp_get_wtime();
+        const int pixels = p.width * p.height;
+
+        its.resize(pixels);
+        p.gpu = gpu;
+        render_iterations(&p, &its[0], p.width, NULL);
+        for (int i = 0; i < pixels; i++)
+            its[i] = htonl(its[i]);
+        if (!send_message(fd, COUNTS_MAGIC, id, &its[0],
+                          pixels * sizeof(uint32_t)))
+            return;
+        if (stats) {
+            fprintf(stderr, "frame %u: %dx%d in %.3f s\n", id, p.width,
+                    p.height, omp_get_wtime() - start);
+        }
+    }
+}
+
+void run_worker(int port, gpu_device *gpu, bool stats)
+{
+    const int server = socket(AF_INET, SOCK_STREAM, 0);
+    const int on = 1;
+    sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (server < 0 ||
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(server, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server, 4) < 0) {
+        perror("Failed to listen for coordinators");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Worker listening on port %d\n", port);
+
+    for (;;) {
+        const int fd = accept(server, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno != EINTR)
+                perror("Failed to accept coordinator");
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        serve(fd, gpu, stats);
+        close(fd);
+    }
+}
+
+
+/* The coordinator's side of a worker */
+struct worker_link {
+    std::string host;
+    std::string port;
+    int fd;                     // -1 while down
+    std::deque<int> sent;       // frames in flight, in the order sent
+    double retry_at;            // when to connect again
+    double heard;               // last sign of progress on sent.front()
+
+    // The message being received
+    message_header header;
+    size_t got;
+    std::vector<uint32_t> counts;
+};
+
+/*
+ * Connect without blocking for longer than CONNECT_TIMEOUT, which a host
+ * that has gone away could otherwise make minutes
+ */
+static int connect_to(const std::string &host, const std::string &port)
+{
+    addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return -1;
+
+    int fd = -1;
+    for (addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        const int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+        bool ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        if (!ok && errno == EINPROGRESS) {
+            pollfd pfd;
+            int error = 0;
+            socklen_t len = sizeof(error);
+
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            ok = poll(&pfd, 1, (int)(1e3 * CONNECT_TIMEOUT)) == 1 &&
+                 getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 &&
+                 error == 0;
+        }
+
+        if (ok) {
+            const int on = 1;
+
+            fcntl(fd, F_SETFL, flags);
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        } else {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void parse_workers(const std::string &list,
+                          std::vector<worker_link> *links)
+{
+    size_t start = 0;
+
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+
+        const std::string item = list.substr(start, end - start);
+        const size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0 ||
+            colon + 1 == item.size()) {
+            fprintf(stderr, "Workers must be given as host:port, not %s\n",
+                    item.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        worker_link l;
+        l.host = item.substr(0, colon);
+        l.port = item.substr(colon + 1);
+        l.fd = -1;
+        l.retry_at = 0.0;
+        l.heard = 0.0;
+        l.got = 0;
+        links->push_back(l);
+        start = end + 1;
+    }
+}
+
+/* Close the link and give its frames back to be sent elsewhere */
+static void fail_link(worker_link *l, std::set<int> *unsent)
+{
+    fprintf(stderr, "Lost worker %s:%s, %d frames to resend\n",
+            l->host.c_str(), l->port.c_str(), (int)l->sent.size());
+    close(l->fd);
+    l->fd = -1;
+    l->retry_at = omp_get_wtime() + RECONNECT_DELAY;
+    l->got = 0;
+    unsent->insert(l->sent.begin(), l->sent.end());
+    l->sent.clear();
+}
+
+/*
+ * Receive what has arrived on l. Returns false if the worker has failed,
+ * and sets *finished when a frame's counts are complete, leaving them in
+ * l->counts. *slowest is raised to the time a frame took to start
+ * arriving, from when it became the next due.
+ */
+static bool receive(worker_link *l,
+                    const std::vector<render_params> &frames, int *finished,
+                    double *slowest)
+{
+    const double now = omp_get_wtime();
+    const size_t header_size = sizeof(message_header);
+    char *dest;
+    size_t want;
+
+    *finished = -1;
+    if (l->got < header_size) {
+        dest = (char *)&l->header + l->got;
+        want = header_size - l->got;
+    } else {
+        dest = (char *)&l->counts[0] + (l->got - header_size);
+        want = l->counts.size() * sizeof(uint32_t) - (l->got - header_size);
+    }
+
+    ssize_t n = recv(l->fd, dest, want, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return true;
+    if (n <= 0)
+        return false;
+    l->got += n;
+    if (l->got == (size_t)n && now - l->heard > *slowest)
+        *slowest = now - l->heard;
+    l->heard = now;
+
+    if (l->got == header_size) {
+        // Frames come back in the order they were sent
+        const uint32_t id = ntohl(l->header.id);
+
+        if (ntohl(l->header.magic) != COUNTS_MAGIC || l->sent.empty() ||
+            id != (uint32_t)l->sent.front())
+            return false;
+
+        const render_params &p = frames[id];
+        const size_t pixels = (size_t)p.width * p.height;
+        if (ntohl(l->header.length) != pixels * sizeof(uint32_t))
+            return false;
+        l->counts.resize(pixels);
+    }
+
+    if (l->got > header_size &&
+        l->got == header_size + l->counts.size() * sizeof(uint32_t)) {
+        for (size_t i = 0; i < l->counts.size(); i++)
+            l->counts[i] = ntohl(l->counts[i]);
+        *finished = l->sent.front();
+        l->sent.pop_front();
+        l->got = 0;
+    }
+    return true;
+}
+
+void render_remote(const std::string &workers, const std::string &center_x,
+                   const std::string &center_y,
+                   const std::vector<render_params> &frames, remote_done done,
+                   void *arg)
+{
+    std::vector<worker_link> links;
+    std::set<int> unsent;       // given back by failed workers
+    std::map<int, std::vector<uint32_t> > finished;
+    const int num_frames = (int)frames.size();
+    int next = 0;               // first frame never sent
+    int written = 0;            // frames passed to done
+    double last_worker = omp_get_wtime();
+    double slowest = 0.0;       // that any frame took to start arriving
+
+    parse_workers(workers, &links);
+    const int window = WINDOW * PIPELINE * (int)links.size();
+
+    while (written < num_frames) {
+        const double now = omp_get_wtime();
+        std::vector<pollfd> fds;
+        std::vector<worker_link *> polled;
+
+        for (size_t i = 0; i < links.size(); i++) {
+            worker_link *l = &links[i];
+
+            if (l->fd < 0 && now >= l->retry_at) {
+                l->fd = connect_to(l->host, l->port);
+                if (l->fd < 0) {
+                    l->retry_at = now + RECONNECT_DELAY;
+                    continue;
+                }
+                fprintf(stderr, "Connected to worker %s:%s\n",
+                        l->host.c_str(), l->port.c_str());
+            }
+            if (l->fd < 0)
+                continue;
+
+            // Keep the worker busy, without running too far ahead of done
+            while ((int)l->sent.size() < PIPELINE) {
+                int f;
+
+                if (!unsent.empty())
+                    f = *unsent.begin();
+                else if (next < num_frames && next < written + window)
+                    f = next;
+                else
+                    break;
+
+                const std::string job = describe_frame(&frames[f], center_x,
+                                                       center_y);
+                if (!send_message(l->fd, JOB_MAGIC, f, job.data(),
+                                  job.size())) {
+                    fail_link(l, &unsent);
+                    break;
+                }
+                if (f == next)
+                    next++;
+                else
+                    unsent.erase(f);
+                if (l->sent.empty())
+                    l->heard = now;
+                l->sent.push_back(f);
+            }
+            if (l->fd < 0)
+                continue;
+
+            /*
+             * A worker that has hung or gone away without closing the
+             * connection may not be noticed by TCP for hours
+             */
+            const double timeout = fmax(FRAME_TIMEOUT,
+                                        SLOWEST_FACTOR * slowest);
+            if (!l->sent.empty() && now - l->heard > timeout) {
+                fprintf(stderr, "Worker %s:%s silent for %.0f s\n",
+                        l->host.c_str(), l->port.c_str(), now - l->heard);
+                fail_link(l, &unsent);
+                continue;
+            }
+
+            pollfd pfd;
+            pfd.fd = l->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            polled.push_back(l);
+        }
+
+        if (polled.empty()) {
+            if (now - last_worker > GIVE_UP_AFTER) {
+                fprintf(stderr, "No worker reachable for %.0f s\n",
+                        GIVE_UP_AFTER);
+                exit(EXIT_FAILURE);
+            }
+            usleep(100000);
+            continue;
+        }
+        last_worker = now;
+
+        if (poll(&fds[0], fds.size(), 1000) < 0 && errno != EINTR) {
+            perror("Failed to wait for workers");
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            worker_link *l = polled[i];
+            int f;
+
+            if (fds[i].revents == 0)
+                continue;
+            if (!receive(l, frames, &f, &slowest)) {
+                fail_link(l, &unsent);
+                continue;
+            }
+            if (f >= 0) {
+                finished[f].swap(l->counts);
+                l->heard = omp_get_wtime();
+            }
+        }
+
+        // Pass on, in order, whatever has come in
+        while (!finished.empty() && finished.begin()->first == written) {
+            std::map<int, std::vector<uint32_t> >::iterator it =
+                finished.begin();
+
+            done(&frames[written], written, &it->second[0], arg);
+            finished.erase(it);
+            written++;
+        }
+    }
+
+    for (size_t i = 0; i < links.size(); i++) {
+        if (links[i].fd >= 0)
+            close(links[i].fd);
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * distribute.h
+ *
+ * Rendering a zoom on other machines. Workers listen on a TCP port and
+ * compute the counts of whichever frames they are sent; a coordinator
+ * hands the frames of the zoom out to its workers, a few at a time each so
+ * that a worker never waits for its next frame, and passes the counts on
+ * in order. Frames sent to a worker which fails, or which goes quiet for
+ * much longer than any frame has taken, are sent to another, and the
+ * failed worker is reconnected to after a while.
+ *
+ * A frame is sent as the parameters that describe it (with the centre as
+ * given, in full), so workers need no configuration of their own and may
+ * use whatever kernel their CPU supports, or their GPU: every kernel gives
+ * the same counts.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef DISTRIBUTE_H
+#define DISTRIBUTE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "render.h"
+
+/*
+ * Serve frames to coordinators on port, one connection at a time, forever,
+ * computing them on gpu where it can, and with stats reporting the time of
+ * each
+ */
+void run_worker(int port, gpu_device *gpu, bool stats);
+
+/* Called with the counts of frames[i], in order of i */
+typedef void (*remote_done)(const render_params *p, int i,
+                            const uint32_t *its, void *arg);
+
+/*
+ * Compute the counts of frames on the workers in the comma separated list
+ * of host:port. center_x and center_y are those of every frame, as
+ * decimal numbers. Exits if no worker can be reached for long.
+ */
+void render_remote(const std::string &workers, const std::string &center_x,
+                   const std::string &center_y,
+                   const std::vector<render_params> &frames, remote_done done,
+                   void *arg);
+
+#endif // DISTRIBUTE_H
@@ -0,0 +1,224 @@
+/*
+ * fixedpoint.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fixedpoint.h"
+
+const double LIMB_BASE = 4294967296.0;  // 2^32
+const int GUARD_BITS = 64;
+
+
+fixed_point::fixed_point(int limbs)
+    : limb(limbs < 2 ? 2 : limbs, 0)
+{
+}
+
+fixed_point fixed_point::from_string(const char *s)
+{
+    bool minus = false;
+
+    if (*s == '+' || *s == '-')
+        minus = (*s++ == '-');
+
+    uint32_t integer = 0;
+    while (*s >= '0' && *s <= '9')
+        integer = integer * 10 + (*s++ - '0');
+
+    const char *digits = "";
+    int num_digits = 0;
+    if (*s == '.') {
+        digits = ++s;
+        while (digits[num_digits] >= '0' && digits[num_digits] <= '9')
+            num_digits++;
+    }
+
+    // log2(10) < 3.33 bits per digit, plus one limb to absorb rounding
+    fixed_point r(2 + (num_digits * 333 / 100 + 31) / 32);
+    const int n = r.limbs();
+
+    /*
+     * Horner's rule from the last digit: f = (d + f) / 10, with d placed in
+     * the integer limb so one long division handles both
+     */
+    for (int k = num_digits - 1; k >= 0; k--) {
+        uint64_t rem = 0;
+
+        r.limb[n - 1] = digits[k] - '0';
+        for (int i = n - 1; i >= 0; i--) {
+            uint64_t cur = (rem << 32) | r.limb[i];
+            r.limb[i] = (uint32_t)(cur / 10);
+            rem = cur % 10;
+        }
+    }
+
+    r.limb[n - 1] = integer;
+    if (minus)
+        r.negate();
+    return r;
+}
+
+fixed_point fixed_point::from_double(double d, int limbs)
+{
+    fixed_point r(limbs);
+    const int n = r.limbs();
+    double x = fabs(d);
+
+    /*
+     * Peel off 32 bits at a time. Multiplying by 2^32 and subtracting the
+     * integer part are both exact, so no bits are lost
+     */
+    double integer = floor(x);
+    r.limb[n - 1] = (uint32_t)integer;
+    x -= integer;
+    for (int i = n - 2; i >= 0 && x != 0.0; i--) {
+        x *= LIMB_BASE;
+        integer = floor(x);
+        r.limb[i] = (uint32_t)integer;
+        x -= integer;
+    }
+
+    if (d < 0)
+        r.negate();
+    return r;
+}
+
+std::string fixed_point::to_hex() const
+{
+    std::string s;
+    char digits[16];
+    int low = 0;
+
+    while (low < limbs() - 1 && limb[low] == 0)
+        low++;
+    for (int i = limbs() - 1; i >= low; i--) {
+        snprintf(digits, sizeof(digits), i == limbs() - 1 ? "%08x." : "%08x",
+                 limb[i]);
+        s += digits;
+    }
+    return s;
+}
+
+double fixed_point::to_double() const
+{
+    /*
+     * Convert the magnitude, otherwise small negative numbers would be
+     * the difference of two nearly equal terms
+     */
+    if (negative()) {
+        fixed_point m = *this;
+        m.negate();
+        return -m.to_double();
+    }
+
+    const int n = limbs();
+    int top = n - 1;
+    while (top > 0 && limb[top] == 0)
+        top--;
+
+    // Three limbs cover the 53 bits of a double
+    double r = 0.0;
+    for (int i = top; i >= 0 && i > top - 3; i--)
+        r += ldexp((double)limb[i], 32 * (i - (n - 1)));
+    return r;
+}
+
+fixed_point fixed_point::resized(int limbs) const
+{
+    fixed_point r(limbs);
+    const int n = limbs < 2 ? 2 : limbs;
+    const int m = this->limbs();
+
+    // Align the integer limbs, then drop or zero-fill fraction limbs
+    for (int i = 1; i <= n && i <= m; i++)
+        r.limb[n - i] = limb[m - i];
+    return r;
+}
+
+void fixed_point::negate()
+{
+    uint64_t carry = 1;
+
+    for (size_t i = 0; i < limb.size(); i++) {
+        uint64_t cur = (uint64_t)(uint32_t)~limb[i] + carry;
+        limb[i] = (uint32_t)cur;
+        carry = cur >> 32;
+    }
+}
+
+fixed_point fixed_point::operator+(const fixed_point &b) const
+{
+    fixed_point r(limbs());
+    uint64_t carry = 0;
+
+    for (size_t i = 0; i < limb.size(); i++) {
+        uint64_t cur = (uint64_t)limb[i] + b.limb[i] + carry;
+        r.limb[i] = (uint32_t)cur;
+        carry = cur >> 32;
+    }
+    return r;
+}
+
+fixed_point fixed_point::operator-(const fixed_point &b) const
+{
+    fixed_point nb = b;
+
+    nb.negate();
+    return *this + nb;
+}
+
+fixed_point fixed_point::operator*(const fixed_point &b) const
+{
+    const int n = limbs();
+    fixed_point ma = *this;
+    fixed_point mb = b;
+    const bool minus = ma.negative() != mb.negative();
+
+    if (ma.negative())
+        ma.negate();
+    if (mb.negative())
+        mb.negate();
+
+    /*
+     * Schoolbook multiplication of the magnitudes. The product has
+     * 2(n - 1) fraction limbs, of which the top n - 1 are kept
+     */
+    std::vector<uint32_t> p(2 * n, 0);
+    for (int i = 0; i < n; i++) {
+        uint64_t carry = 0;
+
+        if (ma.limb[i] == 0)
+            continue;
+        for (int j = 0; j < n; j++) {
+            uint64_t cur = (uint64_t)ma.limb[i] * mb.limb[j] + p[i + j] +
+                           carry;
+            p[i + j] = (uint32_t)cur;
+            carry = cur >> 32;
+        }
+        p[i + n] = (uint32_t)carry;
+    }
+
+    fixed_point r(n);
+    memcpy(&r.limb[0], &p[n - 1], n * sizeof(uint32_t));
+    if (minus)
+        r.negate();
+    return r;
+}
+
+
+int fixed_point_limbs(double scale)
+{
+    int exponent;
+
+    frexp(scale, &exponent);
+    const int fraction_bits = (exponent < 0 ? -exponent : 0) + GUARD_BITS;
+    return 1 + (fraction_bits + 31) / 32;
+}
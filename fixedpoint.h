@@ -0,0 +1,65 @@
+/*
+ * fixedpoint.h
+ *
+ * Arbitrary precision fixed point numbers, just enough of them to iterate
+ * a perturbation reference orbit. A number has one 32 bit integer limb and
+ * any number of 32 bit fraction limbs, and is stored in two's complement.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef FIXEDPOINT_H
+#define FIXEDPOINT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class fixed_point {
+public:
+    explicit fixed_point(int limbs = 2);
+
+    /*
+     * Parse a decimal number of the form [+-]digits[.digits], with enough
+     * limbs to hold every digit given
+     */
+    static fixed_point from_string(const char *s);
+
+    // Exact conversion (up to the precision of limbs)
+    static fixed_point from_double(double d, int limbs);
+
+    double to_double() const;
+
+    /*
+     * The exact value in hex, integer limb first, without trailing zero
+     * limbs: equal values give equal strings whatever their limbs
+     */
+    std::string to_hex() const;
+
+    int limbs() const { return (int)limb.size(); }
+
+    // Same value with more or fewer fraction limbs
+    fixed_point resized(int limbs) const;
+
+    fixed_point operator+(const fixed_point &b) const;
+    fixed_point operator-(const fixed_point &b) const;
+    fixed_point operator*(const fixed_point &b) const;
+
+private:
+    // Least significant limb first, the last one is the integer part
+    std::vector<uint32_t> limb;
+
+    bool negative() const { return (int32_t)limb.back() < 0; }
+    void negate();
+};
+
+/*
+ * Number of limbs needed to resolve points scale apart, with enough guard
+ * bits for the errors picked up over a long orbit
+ */
+int fixed_point_limbs(double scale);
+
+#endif // FIXEDPOINT_H
@@ -0,0 +1,512 @@
+/*
+ * gpu.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "gpu.h"
+
+/*
+ * The parts of the OpenCL 1.1 API used here, declared as in CL/cl.h so
+ * that neither the headers nor the library are needed to build
+ */
+typedef int32_t cl_int;
+typedef uint32_t cl_uint;
+typedef uint64_t cl_ulong;
+typedef cl_ulong cl_bitfield;
+typedef cl_bitfield cl_device_type;
+typedef cl_bitfield cl_mem_flags;
+typedef cl_bitfield cl_command_queue_properties;
+typedef cl_uint cl_bool;
+typedef cl_uint cl_device_info;
+typedef cl_uint cl_program_build_info;
+typedef intptr_t cl_context_properties;
+
+typedef struct _cl_platform_id *cl_platform_id;
+typedef struct _cl_device_id *cl_device_id;
+typedef struct _cl_context *cl_context;
+typedef struct _cl_command_queue *cl_command_queue;
+typedef struct _cl_mem *cl_mem;
+typedef struct _cl_program *cl_program;
+typedef struct _cl_kernel *cl_kernel;
+typedef struct _cl_event *cl_event;
+
+const cl_int CL_SUCCESS = 0;
+const cl_bool CL_TRUE = 1;
+const cl_device_type CL_DEVICE_TYPE_GPU = 1 << 2;
+const cl_device_type CL_DEVICE_TYPE_ALL = 0xFFFFFFFF;
+const cl_device_info CL_DEVICE_NAME = 0x102B;
+const cl_device_info CL_DEVICE_EXTENSIONS = 0x1030;
+const cl_program_build_info CL_PROGRAM_BUILD_LOG = 0x1183;
+const cl_context_properties CL_CONTEXT_PLATFORM = 0x1084;
+const cl_mem_flags CL_MEM_WRITE_ONLY = 1 << 1;
+const cl_mem_flags CL_MEM_READ_ONLY = 1 << 2;
+
+struct opencl_api {
+    cl_int (*GetPlatformIDs)(cl_uint, cl_platform_id *, cl_uint *);
+    cl_int (*GetDeviceIDs)(cl_platform_id, cl_device_type, cl_uint,
+                           cl_device_id *, cl_uint *);
+    cl_int (*GetDeviceInfo)(cl_device_id, cl_device_info, size_t, void *,
+                            size_t *);
+    cl_context (*CreateContext)(const cl_context_properties *, cl_uint,
+                                const cl_device_id *,
+                                void (*)(const char *, const void *, size_t,
+                                         void *),
+                                void *, cl_int *);
+    cl_command_queue (*CreateCommandQueue)(cl_context, cl_device_id,
+                                           cl_command_queue_properties,
+                                           cl_int *);
+    cl_program (*CreateProgramWithSource)(cl_context, cl_uint,
+                                          const char **, const size_t *,
+                                          cl_int *);
+    cl_int (*BuildProgram)(cl_program, cl_uint, const cl_device_id *,
+                           const char *, void (*)(cl_program, void *),
+                           void *);
+    cl_int (*GetProgramBuildInfo)(cl_program, cl_device_id,
+                                  cl_program_build_info, size_t, void *,
+                                  size_t *);
+    cl_kernel (*CreateKernel)(cl_program, const char *, cl_int *);
+    cl_mem (*CreateBuffer)(cl_context, cl_mem_flags, size_t, void *,
+                           cl_int *);
+    cl_int (*SetKernelArg)(cl_kernel, cl_uint, size_t, const void *);
+    cl_int (*EnqueueWriteBuffer)(cl_command_queue, cl_mem, cl_bool, size_t,
+                                 size_t, const void *, cl_uint,
+                                 const cl_event *, cl_event *);
+    cl_int (*EnqueueNDRangeKernel)(cl_command_queue, cl_kernel, cl_uint,
+                                   const size_t *, const size_t *,
+                                   const size_t *, cl_uint, const cl_event *,
+                                   cl_event *);
+    cl_int (*EnqueueReadBufferRect)(cl_command_queue, cl_mem, cl_bool,
+                                    const size_t *, const size_t *,
+                                    const size_t *, size_t, size_t, size_t,
+                                    size_t, void *, cl_uint,
+                                    const cl_event *, cl_event *);
+    cl_int (*ReleaseMemObject)(cl_mem);
+    cl_int (*ReleaseKernel)(cl_kernel);
+    cl_int (*ReleaseProgram)(cl_program);
+    cl_int (*ReleaseCommandQueue)(cl_command_queue);
+    cl_int (*ReleaseContext)(cl_context);
+};
+
+/*
+ * The escape-time loop of member() in kernel_impl.h for one point: the
+ * same operations in the same order, with the constants converted to the
+ * point's type so that a float frame is computed entirely in float. The
+ * body is compiled once for float and, where the device has it, once for
+ * double. x is computed as by the CPU kernels' ramp, and the y of each row
+ * is given by the host. With flag 8 (KERNEL_SMOOTH) the fraction is
+ * added as by fraction(), with log2_1p() a macro so that both bodies have
+ * it.
+ */
+static const char device_header[] =
+    "#pragma OPENCL FP_CONTRACT OFF\n"
+    "#ifdef HAVE_FP64\n"
+    "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+    "#endif\n"
+    "#define LOG2_1P(t) (((((((REAL)0.03215845 * (t) +\\\n"
+    "                         (REAL)-0.13606275) * (t) +\\\n"
+    "                         (REAL)0.28947478) * (t) +\\\n"
+    "                        (REAL)-0.49190896) * (t) +\\\n"
+    "                       (REAL)0.99949556) * (t)) * (REAL)1.44269504)\n";
+
+static const char device_body[] =
+    "__kernel void NAME(REAL x0, REAL dx, __global const REAL *row_y,\n"
+    "                   int max_its, int flags, __global uint *its)\n"
+    "{\n"
+    "    const int i = get_global_id(0);\n"
+    "    const int j = get_global_id(1);\n"
+    "    const REAL cx = (REAL)i * dx + x0;\n"
+    "    const REAL cy = row_y[j];\n"
+    "    const REAL dist_limit = (REAL)4.0;\n"
+    "    REAL x = cx, y = cy;\n"
+    "    REAL x_sq = x * x, y_sq = y * y;\n"
+    "    REAL saved_x = x, saved_y = y;\n"
+    "    int next_save = 1;\n"
+    "    int count = 0;\n"
+    "    bool not_escape = x_sq + y_sq < dist_limit;\n"
+    "\n"
+    "    if ((flags & 1) != 0) {\n"
+    "        const REAL quarter = (REAL)0.25;\n"
+    "        const REAL xq = cx - quarter;\n"
+    "        const REAL q = xq * xq + y_sq;\n"
+    "        const REAL x1 = cx + (REAL)1.0;\n"
+    "\n"
+    "        if (q * (q + xq) < quarter * y_sq ||\n"
+    "            x1 * x1 + y_sq < (REAL)0.0625) {\n"
+    "            count = max_its;\n"
+    "            not_escape = false;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    for (int n = 0; n < max_its && not_escape; n++) {\n"
+    "        count++;\n"
+    "        y = x * y;\n"
+    "        y = y + y;\n"
+    "        y = y + cy;\n"
+    "        x = x_sq - y_sq;\n"
+    "        x = x + cx;\n"
+    "        x_sq = x * x;\n"
+    "        y_sq = y * y;\n"
+    "        not_escape = x_sq + y_sq < dist_limit;\n"
+    "\n"
+    "        if ((flags & 2) != 0) {\n"
+    "            if (not_escape && x == saved_x && y == saved_y) {\n"
+    "                count = max_its;\n"
+    "                not_escape = false;\n"
+    "            }\n"
+    "            if (n == next_save) {\n"
+    "                saved_x = x;\n"
+    "                saved_y = y;\n"
+    "                next_save *= 2;\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    // The loop stops at the first z outside the radius, if any\n"
+    "    const REAL dist = x_sq + y_sq;\n"
+    "    if ((flags & 8) != 0 && !(dist < dist_limit) &&\n"
+    "        dist < (REAL)16.0) {\n"
+    "        const bool low = dist < (REAL)8.0;\n"
+    "        const REAL e = low ? (REAL)2.0 : (REAL)3.0;\n"
+    "        const REAL t = dist * (low ? (REAL)0.25 : (REAL)0.125) -\n"
+    "                       (REAL)1.0;\n"
+    "        const REAL l = e + LOG2_1P(t);\n"
+    "        const REAL u = l * (REAL)0.5 - (REAL)1.0;\n"
+    "        const REAL f = (REAL)1.0 - LOG2_1P(u);\n"
+    "\n"
+    "        count += (int)(f * (REAL)127.0) << 24;\n"
+    "    }\n"
+    "\n"
+    "    its[j * get_global_size(0) + i] = count;\n"
+    "}\n";
+
+struct gpu_device {
+    void *library;
+    opencl_api cl;
+    std::string name;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel_f;
+    cl_kernel kernel_d;         // NULL without double support
+    cl_mem its;                 // kept from frame to frame
+    size_t its_size;
+    cl_mem row_y;
+    size_t row_y_size;
+    std::vector<char> y;        // host copy of row_y
+    bool failed;
+    pthread_mutex_t lock;       // one frame at a time
+};
+
+static bool load_api(gpu_device *g)
+{
+    struct symbol {
+        const char *name;
+        void **slot;
+    };
+    opencl_api *cl = &g->cl;
+    const symbol symbols[] = {
+        { "clGetPlatformIDs", (void **)&cl->GetPlatformIDs },
+        { "clGetDeviceIDs", (void **)&cl->GetDeviceIDs },
+        { "clGetDeviceInfo", (void **)&cl->GetDeviceInfo },
+        { "clCreateContext", (void **)&cl->CreateContext },
+        { "clCreateCommandQueue", (void **)&cl->CreateCommandQueue },
+        { "clCreateProgramWithSource",
+          (void **)&cl->CreateProgramWithSource },
+        { "clBuildProgram", (void **)&cl->BuildProgram },
+        { "clGetProgramBuildInfo", (void **)&cl->GetProgramBuildInfo },
+        { "clCreateKernel", (void **)&cl->CreateKernel },
+        { "clCreateBuffer", (void **)&cl->CreateBuffer },
+        { "clSetKernelArg", (void **)&cl->SetKernelArg },
+        { "clEnqueueWriteBuffer", (void **)&cl->EnqueueWriteBuffer },
+        { "clEnqueueNDRangeKernel", (void **)&cl->EnqueueNDRangeKernel },
+        { "clEnqueueReadBufferRect", (void **)&cl->EnqueueReadBufferRect },
+        { "clReleaseMemObject", (void **)&cl->ReleaseMemObject },
+        { "clReleaseKernel", (void **)&cl->ReleaseKernel },
+        { "clReleaseProgram", (void **)&cl->ReleaseProgram },
+        { "clReleaseCommandQueue", (void **)&cl->ReleaseCommandQueue },
+        { "clReleaseContext", (void **)&cl->ReleaseContext }
+    };
+
+    g->library = dlopen("libOpenCL.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (g->library == NULL)
+        g->library = dlopen("libOpenCL.so", RTLD_NOW | RTLD_LOCAL);
+    if (g->library == NULL) {
+        fprintf(stderr, "OpenCL: %s\n", dlerror());
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(symbols) / sizeof(symbols[0]); i++) {
+        *symbols[i].slot = dlsym(g->library, symbols[i].name);
+        if (*symbols[i].slot == NULL) {
+            fprintf(stderr, "OpenCL: no %s\n", symbols[i].name);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The first GPU of any platform, or failing that the first device */
+static bool find_device(gpu_device *g, cl_platform_id *platform,
+                        cl_device_id *device)
+{
+    const cl_device_type types[] = { CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL };
+    cl_uint n = 0;
+
+    if (g->cl.GetPlatformIDs(0, NULL, &n) != CL_SUCCESS || n == 0) {
+        fprintf(stderr, "OpenCL: no platforms\n");
+        return false;
+    }
+
+    std::vector<cl_platform_id> platforms(n);
+    g->cl.GetPlatformIDs(n, &platforms[0], NULL);
+    for (int t = 0; t < 2; t++) {
+        for (cl_uint i = 0; i < n; i++) {
+            cl_uint found = 0;
+
+            if (g->cl.GetDeviceIDs(platforms[i], types[t], 1, device,
+                                   &found) == CL_SUCCESS && found > 0) {
+                *platform = platforms[i];
+                return true;
+            }
+        }
+    }
+    fprintf(stderr, "OpenCL: no devices\n");
+    return false;
+}
+
+static std::string device_string(gpu_device *g, cl_device_id device,
+                                 cl_device_info what)
+{
+    size_t size = 0;
+
+    if (g->cl.GetDeviceInfo(device, what, 0, NULL, &size) != CL_SUCCESS ||
+        size == 0)
+        return "";
+
+    std::vector<char> s(size);
+    g->cl.GetDeviceInfo(device, what, size, &s[0], NULL);
+    return std::string(&s[0]);
+}
+
+static bool build_program(gpu_device *g, cl_device_id device, bool fp64)
+{
+    std::string source = device_header;
+    cl_int err;
+
+    source += "#define REAL float\n#define NAME mandel_float\n";
+    source += device_body;
+    if (fp64) {
+        source += "#undef REAL\n#undef NAME\n";
+        source += "#define REAL double\n#define NAME mandel_double\n";
+        source += device_body;
+    }
+
+    const char *text = source.c_str();
+    g->program = g->cl.CreateProgramWithSource(g->context, 1, &text, NULL,
+                                               &err);
+    if (err != CL_SUCCESS)
+        return false;
+    if (g->cl.BuildProgram(g->program, 1, &device,
+                           fp64 ? "-DHAVE_FP64" : "", NULL,
+                           NULL) != CL_SUCCESS) {
+        char log[4096] = "";
+
+        g->cl.GetProgramBuildInfo(g->program, device, CL_PROGRAM_BUILD_LOG,
+                                  sizeof(log) - 1, log, NULL);
+        fprintf(stderr, "OpenCL: failed to build the kernel:\n%s\n", log);
+        return false;
+    }
+
+    g->kernel_f = g->cl.CreateKernel(g->program, "mandel_float", &err);
+    if (err != CL_SUCCESS)
+        return false;
+    if (fp64) {
+        g->kernel_d = g->cl.CreateKernel(g->program, "mandel_double", &err);
+        if (err != CL_SUCCESS)
+            return false;
+    }
+    return true;
+}
+
+gpu_device *open_gpu()
+{
+    gpu_device *g = new gpu_device;
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_int err;
+
+    memset(&g->cl, 0, sizeof(g->cl));
+    g->library = NULL;
+    g->context = NULL;
+    g->queue = NULL;
+    g->program = NULL;
+    g->kernel_f = NULL;
+    g->kernel_d = NULL;
+    g->its = NULL;
+    g->its_size = 0;
+    g->row_y = NULL;
+    g->row_y_size = 0;
+    g->failed = false;
+    pthread_mutex_init(&g->lock, NULL);
+    if (!load_api(g) || !find_device(g, &platform, &device)) {
+        close_gpu(g);
+        return NULL;
+    }
+    g->name = device_string(g, device, CL_DEVICE_NAME);
+
+    const cl_context_properties props[] = {
+        CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0
+    };
+    g->context = g->cl.CreateContext(props, 1, &device, NULL, NULL, &err);
+    if (err == CL_SUCCESS)
+        g->queue = g->cl.CreateCommandQueue(g->context, device, 0, &err);
+    if (err != CL_SUCCESS ||
+        !build_program(g, device,
+                       device_string(g, device, CL_DEVICE_EXTENSIONS)
+                       .find("cl_khr_fp64") != std::string::npos)) {
+        fprintf(stderr, "OpenCL: failed to set up %s\n", g->name.c_str());
+        close_gpu(g);
+        return NULL;
+    }
+
+    fprintf(stderr, "Rendering on %s%s\n", g->name.c_str(),
+            g->kernel_d == NULL ? " (float only)" : "");
+    return g;
+}
+
+void close_gpu(gpu_device *g)
+{
+    if (g == NULL)
+        return;
+    if (g->its != NULL)
+        g->cl.ReleaseMemObject(g->its);
+    if (g->row_y != NULL)
+        g->cl.ReleaseMemObject(g->row_y);
+    if (g->kernel_f != NULL)
+        g->cl.ReleaseKernel(g->kernel_f);
+    if (g->kernel_d != NULL)
+        g->cl.ReleaseKernel(g->kernel_d);
+    if (g->program != NULL)
+        g->cl.ReleaseProgram(g->program);
+    if (g->queue != NULL)
+        g->cl.ReleaseCommandQueue(g->queue);
+    if (g->context != NULL)
+        g->cl.ReleaseContext(g->context);
+    if (g->library != NULL)
+        dlclose(g->library);
+    pthread_mutex_destroy(&g->lock);
+    delete g;
+}
+
+const char *gpu_name(const gpu_device *g)
+{
+    return g->name.c_str();
+}
+
+/* Make buf hold at least size bytes, keeping it if it already does */
+static bool reserve(gpu_device *g, cl_mem *buf, size_t *capacity,
+                    size_t size, cl_mem_flags flags)
+{
+    cl_int err;
+
+    if (*buf != NULL && *capacity >= size)
+        return true;
+    if (*buf != NULL)
+        g->cl.ReleaseMemObject(*buf);
+    *buf = g->cl.CreateBuffer(g->context, flags, size, NULL, &err);
+    *capacity = err == CL_SUCCESS ? size : 0;
+    if (err != CL_SUCCESS)
+        *buf = NULL;
+    return err == CL_SUCCESS;
+}
+
+/* y of each row, converted as compute_block() does */
+template <class real>
+static size_t fill_rows(gpu_device *g, const frame *f)
+{
+    const size_t size = f->height * sizeof(real);
+
+    g->y.resize(size);
+    real *y = (real *)&g->y[0];
+    for (int hy = 0; hy < f->height; hy++)
+        y[hy] = (real)(f->y_base + hy*f->delta_y);
+    return size;
+}
+
+static bool run_frame(gpu_device *g, const frame *f, uint32_t *its,
+                      int pitch)
+{
+    const bool single = f->prec == PRECISION_FLOAT;
+    cl_kernel kernel = single ? g->kernel_f : g->kernel_d;
+    const size_t y_size = single ? fill_rows<float>(g, f)
+                                 : fill_rows<double>(g, f);
+    const size_t row = f->width * sizeof(uint32_t);
+    const float x0_f = (float)f->x_base;
+    const float dx_f = (float)f->delta_x;
+    const cl_int max_its = f->kp.max_its;
+    const cl_int flags = f->kp.flags;
+    const size_t global[2] = { (size_t)f->width, (size_t)f->height };
+    const size_t origin[3] = { 0, 0, 0 };
+    const size_t region[3] = { row, (size_t)f->height, 1 };
+
+    if (!reserve(g, &g->its, &g->its_size, row * f->height,
+                 CL_MEM_WRITE_ONLY) ||
+        !reserve(g, &g->row_y, &g->row_y_size, y_size, CL_MEM_READ_ONLY))
+        return false;
+
+    cl_int err = g->cl.EnqueueWriteBuffer(g->queue, g->row_y, CL_TRUE, 0,
+                                          y_size, &g->y[0], 0, NULL, NULL);
+    if (single) {
+        err |= g->cl.SetKernelArg(kernel, 0, sizeof(float), &x0_f);
+        err |= g->cl.SetKernelArg(kernel, 1, sizeof(float), &dx_f);
+    } else {
+        err |= g->cl.SetKernelArg(kernel, 0, sizeof(double), &f->x_base);
+        err |= g->cl.SetKernelArg(kernel, 1, sizeof(double), &f->delta_x);
+    }
+    err |= g->cl.SetKernelArg(kernel, 2, sizeof(cl_mem), &g->row_y);
+    err |= g->cl.SetKernelArg(kernel, 3, sizeof(cl_int), &max_its);
+    err |= g->cl.SetKernelArg(kernel, 4, sizeof(cl_int), &flags);
+    err |= g->cl.SetKernelArg(kernel, 5, sizeof(cl_mem), &g->its);
+    if (err != CL_SUCCESS)
+        return false;
+
+    // The blocking read waits for the kernel, in queue order
+    return g->cl.EnqueueNDRangeKernel(g->queue, kernel, 2, NULL, global,
+                                      NULL, 0, NULL, NULL) == CL_SUCCESS &&
+           g->cl.EnqueueReadBufferRect(g->queue, g->its, CL_TRUE, origin,
+                                       origin, region, row, 0,
+                                       pitch * sizeof(uint32_t), 0, its, 0,
+                                       NULL, NULL) == CL_SUCCESS;
+}
+
+bool gpu_compute_frame(gpu_device *g, const frame *f, uint32_t *its,
+                       int pitch)
+{
+    bool done = false;
+
+    if (f->prec == PRECISION_PERTURB || f->kp.formula != FORMULA_MANDELBROT ||
+        (f->prec == PRECISION_DOUBLE && g->kernel_d == NULL))
+        return false;
+
+    pthread_mutex_lock(&g->lock);
+    if (!g->failed) {
+        done = run_frame(g, f, its, pitch);
+        if (!done) {
+            fprintf(stderr, "OpenCL: %s failed, rendering on the CPU\n",
+                    g->name.c_str());
+            g->failed = true;
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return done;
+}
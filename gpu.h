@@ -0,0 +1,49 @@
+/*
+ * gpu.h
+ *
+ * Computing frames on a GPU through OpenCL. The OpenCL library is loaded
+ * when a device is opened rather than linked, so the program runs (on the
+ * CPU) where there is none. The device kernel is the escape-time loop of
+ * kernel_impl.h written out for one point, with contraction off and the
+ * same coordinates, so it gives the same counts as the CPU kernels.
+ *
+ * Only the direct precisions of the Mandelbrot set are computed on the
+ * device, and double only where the device supports it; perturbation, with
+ * its reference orbit on the host and glitch correction, and the other
+ * formulas stay on the CPU. Device buffers are
+ * kept from frame to frame and only grow.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef GPU_H
+#define GPU_H
+
+#include <stdint.h>
+
+#include "render.h"
+
+struct gpu_device;
+
+/*
+ * Open the first OpenCL GPU found (or any other OpenCL device if there is
+ * no GPU). Prints why and returns NULL if there is none.
+ */
+gpu_device *open_gpu();
+void close_gpu(gpu_device *g);
+
+const char *gpu_name(const gpu_device *g);
+
+/*
+ * Compute the counts of f into its (pitch entries per row) on the device.
+ * Returns false, with its untouched, if the frame's precision cannot be
+ * computed there or the device has failed; the caller computes the frame
+ * on the CPU instead. A device which fails once is not used again.
+ */
+bool gpu_compute_frame(gpu_device *g, const frame *f, uint32_t *its,
+                       int pitch);
+
+#endif // GPU_H
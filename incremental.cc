@@ -0,0 +1,217 @@
+/*
+ * incremental.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <omp.h> // OpenMP
+
+#include "incremental.h"
+
+/*
+ * Marks a pixel of the new frame as still to be computed. Counts never
+ * reach it: they are at most max_its, which is at most MAX_ITS, with a
+ * fraction or GLITCHED above. Fractions differ from pixel to pixel, so
+ * with them only the pixels inside are found flat.
+ */
+const uint32_t UNKNOWN = 0x7FFFFFFFu;
+
+
+void init_incremental(incremental_state *s)
+{
+    s->valid = false;
+    s->since_keyframe = 0;
+}
+
+static bool compatible(const render_params *a, const render_params *b)
+{
+    return a->width == b->width && a->height == b->height &&
+           a->kern == b->kern && a->kp.max_its == b->kp.max_its &&
+           a->kp.flags == b->kp.flags && a->kp.formula == b->kp.formula &&
+           a->kp.julia_x == b->kp.julia_x && a->kp.julia_y == b->kp.julia_y;
+}
+
+/*
+ * Where pixel 0 and pixel spacing of the new frame fall along one axis of
+ * the old one, in old pixels. Pixel h is at centre + (h - size/2)*delta.
+ */
+static void axis_map(const fixed_point &center, const fixed_point &prev_center,
+                     double delta, double prev_delta, int size, double *start,
+                     double *step)
+{
+    // Subtract in full; the centres can differ by less than a double ulp
+    const int limbs = center.limbs() > prev_center.limbs() ?
+                      center.limbs() : prev_center.limbs();
+    const double shift = (center.resized(limbs) -
+                          prev_center.resized(limbs)).to_double();
+
+    *step = delta / prev_delta;
+    *start = (0.5 * size) * (1.0 - *step) + shift / prev_delta;
+}
+
+/*
+ * Resample the previous frame into its, with UNKNOWN wherever the 3x3
+ * neighbourhood of the nearest old pixel is not flat to within tolerance
+ * or runs off the old frame. Returns the number of pixels reused.
+ */
+static int resample(const incremental_state *s, const render_params *p,
+                    int tolerance, uint32_t *its, int pitch)
+{
+    const int width = p->width;
+    const int height = p->height;
+    const uint32_t *prev = &s->its[0];
+    double x_start, x_step, y_start, y_step;
+    std::vector<int> column(width);
+    int *sxs = &column[0];
+    int reused = 0;
+
+    axis_map(p->center_x, s->prev.center_x, p->delta_x, s->prev.delta_x,
+             width, &x_start, &x_step);
+    axis_map(p->center_y, s->prev.center_y, p->delta_y, s->prev.delta_y,
+             height, &y_start, &y_step);
+
+    // Nearest old column of every new one
+    for (int hx = 0; hx < width; hx++)
+        sxs[hx] = (int)floor(x_start + hx*x_step + 0.5);
+
+    #pragma omp parallel for default(none), shared(prev, its, sxs),\
+                             firstprivate(width, height, pitch, tolerance,\
+                                          y_start, y_step),\
+                             reduction(+: reused), schedule(guided, 50)
+    for (int hy = 0; hy < height; hy++) {
+        uint32_t *row = its + hy*pitch;
+        const int sy = (int)floor(y_start + hy*y_step + 0.5);
+
+        for (int hx = 0; hx < width; hx++) {
+            const int sx = sxs[hx];
+
+            row[hx] = UNKNOWN;
+            if (sx < 1 || sx > width - 2 || sy < 1 || sy > height - 2)
+                continue;
+
+            const uint32_t *c = prev + sy*width + sx;
+            uint32_t lo = c[0], hi = c[0];
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    const uint32_t v = c[dy*width + dx];
+
+                    lo = v < lo ? v : lo;
+                    hi = v > hi ? v : hi;
+                }
+            }
+            if (hi - lo <= (uint32_t)tolerance) {
+                row[hx] = c[0];
+                reused++;
+            }
+        }
+    }
+
+    return reused;
+}
+
+/*
+ * Compute the UNKNOWN pixels. They are gathered a row at a time and handed
+ * to the points kernels, so that scattered pixels near boundaries still
+ * fill whole vectors.
+ */
+static void fill_unknown(const frame *f, uint32_t *its, int pitch)
+{
+    const int width = f->width;
+    const int height = f->height;
+
+    #pragma omp parallel default(none), shared(f, its),\
+                         firstprivate(width, height, pitch)
+    {
+        std::vector<int> xs(width), ys(width);
+        std::vector<uint32_t> counts(width);
+
+        #pragma omp for schedule(guided, 10)
+        for (int hy = 0; hy < height; hy++) {
+            uint32_t *row = its + hy*pitch;
+            int n = 0;
+
+            for (int hx = 0; hx < width; hx++) {
+                if (row[hx] == UNKNOWN) {
+                    xs[n] = hx;
+                    ys[n] = hy;
+                    n++;
+                }
+            }
+            if (n == 0)
+                continue;
+
+            compute_pixels(f, &xs[0], &ys[0], n, &counts[0]);
+            for (int i = 0; i < n; i++)
+                row[xs[i]] = counts[i];
+        }
+    }
+
+    if (f->prec == PRECISION_PERTURB) {
+        correct_glitches(&f->pert, f->kern, &f->kp, width, height, its,
+                         pitch);
+    }
+}
+
+// Keep the counts of the frame (now without any GLITCHED marks) for the next
+static void remember(incremental_state *s, const render_params *p,
+                     const uint32_t *its, int pitch)
+{
+    s->valid = true;
+    s->prev = *p;
+    s->its.resize(p->width * p->height);
+    for (int hy = 0; hy < p->height; hy++) {
+        memcpy(&s->its[hy * p->width], its + hy*pitch,
+               p->width * sizeof(uint32_t));
+    }
+}
+
+void render_incremental(incremental_state *s, const incremental_params *ip,
+                        const render_params *p, uint32_t *its, int pitch,
+                        incremental_stats *stats)
+{
+    const int pixels = p->width * p->height;
+
+    stats->errors = 0;
+    stats->keyframe = !s->valid || !compatible(&s->prev, p) ||
+                      ++s->since_keyframe >= ip->keyframe;
+
+    if (stats->keyframe) {
+        render_iterations(p, its, pitch, NULL);
+        s->since_keyframe = 0;
+        stats->computed = pixels;
+        stats->reused = 0;
+        remember(s, p, its, pitch);
+        return;
+    }
+
+    frame f;
+    setup_frame(&f, p->kern, &p->kp, p->center_x, p->center_y, p->delta_x,
+                p->delta_y, p->width, p->height);
+    stats->reused = resample(s, p, ip->tolerance, its, pitch);
+    stats->computed = pixels - stats->reused;
+    fill_unknown(&f, its, pitch);
+
+    if (ip->verify) {
+        std::vector<uint32_t> exact(pixels);
+
+        compute_frame(&f, p->mode, &exact[0], p->width, NULL);
+        for (int hy = 0; hy < p->height; hy++) {
+            uint32_t *row = its + hy*pitch;
+
+            for (int hx = 0; hx < p->width; hx++) {
+                if (row[hx] != exact[hy * p->width + hx]) {
+                    row[hx] = exact[hy * p->width + hx];
+                    stats->errors++;
+                }
+            }
+        }
+    }
+
+    remember(s, p, its, pitch);
+}
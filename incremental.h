@@ -0,0 +1,64 @@
+/*
+ * incremental.h
+ *
+ * Incremental zooming. Successive frames of a zoom cover mostly the same
+ * part of the plane, so each new frame starts as a resampling of the last
+ * one. A pixel keeps its resampled count if the previous frame is flat
+ * around it, and is computed otherwise: at the new edges, and near the
+ * boundaries between counts. Guesses compound from frame to frame, so a
+ * frame is rendered in full every so often.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "render.h"
+
+struct incremental_params {
+    /*
+     * The quality knob: a pixel is reused if the counts of the 3x3
+     * neighbourhood it falls in differ by at most this much. 0 reuses only
+     * perfectly flat areas.
+     */
+    int tolerance;
+    int keyframe;       // render every keyframe-th frame in full (1: all)
+    bool verify;        // also render in full, count errors, keep the exact
+};
+
+/* How the last frame was made */
+struct incremental_stats {
+    bool keyframe;
+    int computed;       // pixels computed
+    int reused;         // pixels taken from the previous frame
+    int errors;         // reused pixels that were wrong (verify only)
+};
+
+/* The previous frame, and when to render in full next */
+struct incremental_state {
+    bool valid;
+    render_params prev;
+    std::vector<uint32_t> its;
+    int since_keyframe;
+};
+
+void init_incremental(incremental_state *s);
+
+/*
+ * Compute the counts of the frame described by p into its (pitch entries
+ * per row), from the previous frame given to s where possible. A frame of
+ * a different size or with different kernel parameters is rendered in
+ * full.
+ */
+void render_incremental(incremental_state *s, const incremental_params *ip,
+                        const render_params *p, uint32_t *its, int pitch,
+                        incremental_stats *stats);
+
+#endif // INCREMENTAL_H
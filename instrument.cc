@@ -0,0 +1,330 @@
+/*
+ * instrument.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+#include <pthread.h>
+
+#include "instrument.h"
+
+/*
+ * Bucket 0 holds the pixels with a count of 0, bucket b those counting
+ * from 2^(b-1) to 2^b - 1
+ */
+const int HISTOGRAM_BUCKETS = 25;
+
+struct tile_record {
+    int thread;
+    int x, y, w, h;
+    double start;       // seconds since recording started
+    double end;
+    kernel_counters k;  // executed for the tile
+};
+
+struct frame_record {
+    const char *kernel;
+    int width;
+    int height;
+    int max_its;
+    render_mode mode;
+    precision prec;
+    double start;
+    double end;
+    uint64_t histogram[HISTOGRAM_BUCKETS];
+    uint64_t at_limit;
+    std::vector<tile_record> tiles;
+};
+
+static const char *const mode_names[] = { "tiles", "rows", "subdivide" };
+static const char *const precision_names[] = { "float", "double",
+                                               "perturb" };
+
+static bool on = false;
+static std::string profile_path;    // or empty
+static std::string trace_path;
+static double origin;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<frame_record> frames;
+static bool frame_open = false;     // the last of frames still gets tiles
+
+
+bool recording()
+{
+    return INSTRUMENTED && on;
+}
+
+void begin_frame_record(const frame *f, render_mode mode)
+{
+    frame_record r;
+
+    r.kernel = f->kern->name;
+    r.width = f->width;
+    r.height = f->height;
+    r.max_its = f->kp.max_its;
+    r.mode = mode;
+    r.prec = f->prec;
+    r.start = omp_get_wtime() - origin;
+    r.end = r.start;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        r.histogram[b] = 0;
+    r.at_limit = 0;
+
+    pthread_mutex_lock(&lock);
+    frames.push_back(r);
+    frame_open = true;
+    pthread_mutex_unlock(&lock);
+}
+
+void record_tile(int thread, int x, int y, int w, int h, double start,
+                 double end, const kernel_counters *before)
+{
+    const kernel_counters after = read_counters();
+    tile_record t;
+
+    t.thread = thread;
+    t.x = x;
+    t.y = y;
+    t.w = w;
+    t.h = h;
+    t.start = start - origin;
+    t.end = end - origin;
+    t.k.steps = after.steps - before->steps;
+    t.k.slots = after.slots - before->slots;
+    t.k.lanes = after.lanes - before->lanes;
+
+    pthread_mutex_lock(&lock);
+    if (frame_open)
+        frames.back().tiles.push_back(t);
+    pthread_mutex_unlock(&lock);
+}
+
+void end_frame_record(const frame *f, const uint32_t *its, int pitch)
+{
+    uint64_t histogram[HISTOGRAM_BUCKETS] = { 0 };
+    uint64_t at_limit = 0;
+    const uint32_t max_its = f->kp.max_its;
+
+    for (int hy = 0; hy < f->height; hy++) {
+        const uint32_t *row = its + hy*pitch;
+
+        for (int hx = 0; hx < f->width; hx++) {
+            const uint32_t count = row[hx] & COUNT_MASK;
+
+            if (count >= max_its)
+                at_limit++;
+            else
+                histogram[count == 0 ? 0 : 32 - __builtin_clz(count)]++;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    frame_record *r = &frames.back();
+    r->end = omp_get_wtime() - origin;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        r->histogram[b] = histogram[b];
+    r->at_limit = at_limit;
+    frame_open = false;
+    pthread_mutex_unlock(&lock);
+}
+
+static kernel_counters frame_counters(const frame_record *r)
+{
+    kernel_counters k = { 0, 0, 0 };
+
+    for (size_t i = 0; i < r->tiles.size(); i++) {
+        k.steps += r->tiles[i].k.steps;
+        k.slots += r->tiles[i].k.slots;
+        k.lanes += r->tiles[i].k.lanes;
+    }
+    return k;
+}
+
+// Busy lanes as a fraction, or null if no lanes were counted
+static void print_utilisation(FILE *f, const kernel_counters *k)
+{
+    if (k->slots == 0)
+        fprintf(f, "null");
+    else
+        fprintf(f, "%.4f", (double)k->lanes / k->slots);
+}
+
+static FILE *create(const char *path)
+{
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL)
+        perror(path);
+    return f;
+}
+
+static void finish(FILE *f, const char *path)
+{
+    const bool failed = ferror(f) != 0;
+
+    if (fclose(f) != 0 || failed)
+        perror(path);
+}
+
+static void write_profile(const char *path)
+{
+    FILE *f = create(path);
+
+    if (f == NULL)
+        return;
+
+    pthread_mutex_lock(&lock);
+    fprintf(f, "{\"frames\": [\n");
+    for (size_t i = 0; i < frames.size(); i++) {
+        const frame_record *r = &frames[i];
+        const kernel_counters k = frame_counters(r);
+        const double pixels = (double)r->width * r->height;
+
+        fprintf(f, "  {\"frame\": %d, \"kernel\": \"%s\", \"width\": %d, "
+                "\"height\": %d, \"max_its\": %d, \"mode\": \"%s\", "
+                "\"precision\": \"%s\", \"ms\": %.3f,\n", (int)i, r->kernel,
+                r->width, r->height, r->max_its, mode_names[r->mode],
+                precision_names[r->prec], 1e3 * (r->end - r->start));
+        fprintf(f, "   \"steps\": %llu, \"iterations\": %llu, "
+                "\"lane_utilisation\": ", (unsigned long long)k.steps,
+                (unsigned long long)k.lanes);
+        print_utilisation(f, &k);
+        fprintf(f, ", \"at_limit\": %.4f,\n   \"histogram\": [",
+                r->at_limit / pixels);
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            fprintf(f, "%s%llu", b == 0 ? "" : ", ",
+                    (unsigned long long)r->histogram[b]);
+        }
+
+        // Each thread's share of the tiles, then the tiles themselves
+        std::vector<double> busy;
+        std::vector<int> count;
+        for (size_t t = 0; t < r->tiles.size(); t++) {
+            const tile_record *tr = &r->tiles[t];
+
+            if ((int)busy.size() <= tr->thread) {
+                busy.resize(tr->thread + 1, 0.0);
+                count.resize(tr->thread + 1, 0);
+            }
+            busy[tr->thread] += tr->end - tr->start;
+            count[tr->thread]++;
+        }
+        fprintf(f, "],\n   \"threads\": [");
+        for (size_t t = 0; t < busy.size(); t++) {
+            fprintf(f, "%s{\"busy_ms\": %.3f, \"tiles\": %d}",
+                    t == 0 ? "" : ", ", 1e3 * busy[t], count[t]);
+        }
+        fprintf(f, "],\n   \"tiles\": [");
+        for (size_t t = 0; t < r->tiles.size(); t++) {
+            const tile_record *tr = &r->tiles[t];
+
+            fprintf(f, "%s\n    {\"thread\": %d, \"x\": %d, \"y\": %d, "
+                    "\"w\": %d, \"h\": %d, \"start_ms\": %.3f, "
+                    "\"ms\": %.3f, \"steps\": %llu, \"iterations\": %llu, "
+                    "\"lane_utilisation\": ", t == 0 ? "" : ",",
+                    tr->thread, tr->x, tr->y, tr->w, tr->h,
+                    1e3 * (tr->start - r->start),
+                    1e3 * (tr->end - tr->start),
+                    (unsigned long long)tr->k.steps,
+                    (unsigned long long)tr->k.lanes);
+            print_utilisation(f, &tr->k);
+            fprintf(f, "}");
+        }
+        fprintf(f, "]}%s\n", i + 1 < frames.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    pthread_mutex_unlock(&lock);
+
+    finish(f, path);
+}
+
+/*
+ * Frames on a track of their own and tiles on one per thread, all as
+ * complete ("X") events timed in microseconds
+ */
+static void write_trace(const char *path)
+{
+    FILE *f = create(path);
+    int threads = 0;
+
+    if (f == NULL)
+        return;
+
+    pthread_mutex_lock(&lock);
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(f, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": 0, \"args\": {\"name\": \"frames\"}}");
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        const frame_record *r = &frames[i];
+        const kernel_counters k = frame_counters(r);
+
+        fprintf(f, ",\n  {\"name\": \"frame %d\", \"cat\": \"frame\", "
+                "\"ph\": \"X\", \"pid\": 1, \"tid\": 0, \"ts\": %.1f, "
+                "\"dur\": %.1f, \"args\": {\"kernel\": \"%s\", "
+                "\"mode\": \"%s\", \"precision\": \"%s\", \"max_its\": %d, "
+                "\"iterations\": %llu, \"lane_utilisation\": ", (int)i,
+                1e6 * r->start, 1e6 * (r->end - r->start), r->kernel,
+                mode_names[r->mode], precision_names[r->prec], r->max_its,
+                (unsigned long long)k.lanes);
+        print_utilisation(f, &k);
+        fprintf(f, ", \"at_limit\": %.4f}}",
+                r->at_limit / ((double)r->width * r->height));
+
+        for (size_t t = 0; t < r->tiles.size(); t++) {
+            const tile_record *tr = &r->tiles[t];
+
+            if (tr->thread >= threads)
+                threads = tr->thread + 1;
+            fprintf(f, ",\n  {\"name\": \"tile %d,%d\", \"cat\": \"tile\", "
+                    "\"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.1f, "
+                    "\"dur\": %.1f, \"args\": {\"frame\": %d, "
+                    "\"iterations\": %llu, \"lane_utilisation\": ",
+                    tr->x, tr->y, tr->thread + 1, 1e6 * tr->start,
+                    1e6 * (tr->end - tr->start), (int)i,
+                    (unsigned long long)tr->k.lanes);
+            print_utilisation(f, &tr->k);
+            fprintf(f, "}}");
+        }
+    }
+
+    for (int t = 0; t < threads; t++) {
+        fprintf(f, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": "
+                "\"thread %d\"}}", t + 1, t);
+    }
+    fprintf(f, "\n]}\n");
+    pthread_mutex_unlock(&lock);
+
+    finish(f, path);
+}
+
+static void write_record()
+{
+    if (!profile_path.empty())
+        write_profile(profile_path.c_str());
+    if (!trace_path.empty())
+        write_trace(trace_path.c_str());
+}
+
+void start_recording(const char *profile, const char *trace)
+{
+    if (!INSTRUMENTED) {
+        fprintf(stderr, "Recording needs a build with make INSTRUMENT=1\n");
+        exit(EXIT_FAILURE);
+    }
+    profile_path = profile != NULL ? profile : "";
+    trace_path = trace != NULL ? trace : "";
+    origin = omp_get_wtime();
+    on = true;
+    atexit(write_record);
+}
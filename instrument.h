@@ -0,0 +1,62 @@
+/*
+ * instrument.h
+ *
+ * Recording where the time of each frame goes, to choose between the
+ * schedulers and the early-outs: the wall time of every tile (or row) and
+ * the thread it ran on, how many iterations the kernels executed for it
+ * and how many of the vector lanes were busy doing so, and a histogram of
+ * the frame's counts with the fraction which reached the iteration limit.
+ * The record is written as JSON, or in the Trace Event format read by
+ * chrome://tracing and Perfetto.
+ *
+ * Counting in the kernels' innermost loops costs time of its own, so all
+ * of this is compiled in only with -DINSTRUMENT (make INSTRUMENT=1).
+ * Otherwise kernel_probe is empty and recording cannot be started.
+ *
+ * Frames are recorded by compute_frame(), which must then not be computing
+ * two frames at once. Frames covered by subdivision or computed on the GPU
+ * have no tiles, so no kernel counts; their histogram is still taken.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdint.h>
+
+#include "render.h"
+
+#ifdef INSTRUMENT
+const bool INSTRUMENTED = true;
+#else
+const bool INSTRUMENTED = false;
+#endif
+
+/*
+ * Record every frame computed from now on, and at exit write the record
+ * to profile as JSON and to trace as a trace (either may be NULL).
+ * Exits if not INSTRUMENTED.
+ */
+void start_recording(const char *profile, const char *trace);
+
+bool recording();
+
+/* Open the record of f, covered with mode */
+void begin_frame_record(const frame *f, render_mode mode);
+
+/*
+ * Add the w x h tile at (x, y), which the calling thread (thread of the
+ * team) computed from start to end (omp_get_wtime() seconds), having read
+ * its kernel counters as before beforehand
+ */
+void record_tile(int thread, int x, int y, int w, int h, double start,
+                 double end, const kernel_counters *before);
+
+/* Close the record of f, taking the histogram of its counts its */
+void end_frame_record(const frame *f, const uint32_t *its, int pitch);
+
+#endif // INSTRUMENT_H
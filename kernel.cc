@@ -0,0 +1,96 @@
+/*
+ * kernel.cc
+ *
+ * Runtime selection of the escape-time kernel
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "kernel.h"
+
+/* Widest first, so select_kernel() takes the first one supported */
+static const kernel *const kernels[] = {
+    &kernel_avx512,
+    &kernel_avx2,
+    &kernel_sse2
+};
+static const int NUM_KERNELS = sizeof(kernels) / sizeof(kernels[0]);
+
+static const char *const formula_names[] = {
+    "mandelbrot", "julia", "cubic", "quartic", "burning-ship"
+};
+static const int NUM_FORMULAS = sizeof(formula_names) /
+                                sizeof(formula_names[0]);
+
+#ifdef INSTRUMENT
+__thread kernel_counters thread_counters;
+#endif
+
+/*
+ * __builtin_cpu_supports queries CPUID (and, for AVX and above, XGETBV to
+ * make sure the OS saves the wider registers)
+ */
+static bool supported(const kernel *k)
+{
+    __builtin_cpu_init();
+
+    if (k == &kernel_avx512)
+        return __builtin_cpu_supports("avx512f");
+    if (k == &kernel_avx2)
+        return __builtin_cpu_supports("avx2");
+    return true;
+}
+
+const kernel *select_kernel()
+{
+    for (int i = 0; i < NUM_KERNELS; i++) {
+        if (supported(kernels[i]))
+            return kernels[i];
+    }
+    return kernels[NUM_KERNELS - 1];
+}
+
+const kernel *find_kernel(const char *name)
+{
+    for (int i = 0; i < NUM_KERNELS; i++) {
+        if (strcmp(kernels[i]->name, name) == 0)
+            return supported(kernels[i]) ? kernels[i] : NULL;
+    }
+    return NULL;
+}
+
+kernel_counters read_counters()
+{
+#ifdef INSTRUMENT
+    return thread_counters;
+#else
+    kernel_counters k = { 0, 0, 0 };
+    return k;
+#endif
+}
+
+const char *formula_name(formula_type formula)
+{
+    return formula_names[formula];
+}
+
+bool find_formula(const char *name, formula_type *formula)
+{
+    for (int i = 0; i < NUM_FORMULAS; i++) {
+        if (strcmp(formula_names[i], name) == 0) {
+            *formula = (formula_type)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+int formula_degree(formula_type formula)
+{
+    return formula == FORMULA_CUBIC ? 3 : formula == FORMULA_QUARTIC ? 4 : 2;
+}
@@ -0,0 +1,253 @@
+/*
+ * kernel.h
+ *
+ * Escape-time kernels. The same algorithm is compiled once per instruction
+ * set (SSE2, AVX2, AVX-512), each in its own translation unit with the
+ * matching compiler flags, and the widest one the CPU supports is picked at
+ * startup.
+ *
+ * @author ciphron <ciphron@ciphron.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stdint.h>
+
+/*
+ * Early-outs for points inside the set, and lane refilling: a vector lane
+ * takes the next point as soon as its own is done, rather than idling
+ * until every lane is. All are exact and on by default, and can be turned
+ * off to measure the plain escape-time loop.
+ *
+ * KERNEL_SERIES lets perturbed points start part of the way through the
+ * reference orbit, from a series in their offset (see reference_orbit).
+ * It is not exact, but is on by default, as it is only used as far as it
+ * is known to be accurate to a fraction of a pixel.
+ *
+ * KERNEL_SMOOTH has escaping points carry the fraction of an iteration
+ * by which they escaped (see FRACTION_SHIFT), for colouring without
+ * bands. It is off by default.
+ */
+enum {
+    KERNEL_BULBS = 1,           // main cardioid and period-2 bulb test
+    KERNEL_PERIODICITY = 2,     // Brent cycle detection inside the loop
+    KERNEL_REFILL = 4,          // refill lanes (direct kernels only)
+    KERNEL_SMOOTH = 8,          // fractional counts
+    KERNEL_SERIES = 16          // series approximation (perturbation only)
+};
+const unsigned KERNEL_DEFAULT_FLAGS = KERNEL_BULBS | KERNEL_PERIODICITY |
+                                      KERNEL_REFILL | KERNEL_SERIES;
+
+/*
+ * With KERNEL_SMOOTH, bits 24 to 30 of a count give how far past the count
+ * the point's normalised iteration count is, from 0 to 127 for 0 to 1:
+ * 2 - log2(log2 |z|^2) for the first z outside the escape radius. The
+ * count itself is then the bits in COUNT_MASK, and max_its must be less
+ * than that.
+ */
+const int FRACTION_SHIFT = 24;
+const int FRACTION_BITS = 7;
+const uint32_t COUNT_MASK = (1u << FRACTION_SHIFT) - 1;
+
+/*
+ * The most iterations of any frame, with fractions or not, so that a count
+ * can always be told from its fraction and from the marks kept in the top
+ * bits (GLITCHED, and those of incremental.cc)
+ */
+const int MAX_ITS = (int)COUNT_MASK - 1;
+
+/*
+ * The iteration, z' = f(z) + c. For the Julia set c is the fixed
+ * kernel_params::julia and the point is the z it starts from, for the
+ * others the point is c and z starts from c. All but the multibrots are
+ * of degree 2, and only those can be given fractions; only the
+ * Mandelbrot set has the bulbs, and is perturbed for deep zooms.
+ */
+enum formula_type {
+    FORMULA_MANDELBROT,         // z^2 + c
+    FORMULA_JULIA,              // z^2 + julia
+    FORMULA_CUBIC,              // z^3 + c
+    FORMULA_QUARTIC,            // z^4 + c
+    FORMULA_BURNING_SHIP        // (|Re z| + i |Im z|)^2 + c
+};
+
+struct kernel_params {
+    int max_its;        // iterations after which a point is deemed inside
+    unsigned flags;     // KERNEL_* (direct kernels only)
+    formula_type formula;       // direct kernels only
+    double julia_x;     // with FORMULA_JULIA
+    double julia_y;
+};
+
+/* mandelbrot, julia, cubic, quartic or burning-ship */
+const char *formula_name(formula_type formula);
+
+/* Set *formula to the one named, or return false if there is none */
+bool find_formula(const char *name, formula_type *formula);
+
+// The degree of f(z)
+int formula_degree(formula_type formula);
+
+/*
+ * Compute the number of iterations executed for the n points
+ * (x0 + i*dx, y), first <= i < first + n, and store them in its[0..n-1]. A
+ * point which does not escape within kp->max_its iterations is given
+ * kp->max_its. The coordinate of point i depends only on i, so a pixel
+ * comes out the same whichever span it is computed as part of.
+ */
+typedef void (*row_kernel)(float x0, float dx, float y, int first, int n,
+                           const kernel_params *kp, uint32_t *its);
+typedef void (*row_kernel_d)(double x0, double dx, double y, int first,
+                             int n, const kernel_params *kp, uint32_t *its);
+
+/*
+ * As row_kernel, for the w x h points (x0 + i*dx, y[j]), first <= i <
+ * first + w and 0 <= j < h, with the count of (i, j) stored in
+ * its[j*pitch + i - first]. With KERNEL_REFILL the whole block streams
+ * through the lanes, so a block keeps them busier than its rows would.
+ */
+typedef void (*block_kernel)(float x0, float dx, const float *y, int first,
+                             int w, int h, const kernel_params *kp,
+                             uint32_t *its, int pitch);
+typedef void (*block_kernel_d)(double x0, double dx, const double *y,
+                               int first, int w, int h,
+                               const kernel_params *kp, uint32_t *its,
+                               int pitch);
+
+/* As row_kernel, for the n arbitrary points (x[i], y[i]) */
+typedef void (*points_kernel)(const float *x, const float *y, int n,
+                              const kernel_params *kp, uint32_t *its);
+typedef void (*points_kernel_d)(const double *x, const double *y, int n,
+                                const kernel_params *kp, uint32_t *its);
+
+/*
+ * Reference orbit for perturbation rendering: Z_k = x[k] + i*y[k] for
+ * 1 <= k <= length, where Z_1 = C is the reference point. It is computed in
+ * high precision and rounded to double. length is less than max_its + 1
+ * only if the reference point escapes.
+ *
+ * Points start at step skip, where their delta from Z_skip is taken to be
+ * A*dc + B*dc^2 + C*dc^3 for their delta dc from C, rather than at step 1
+ * with dc itself. The coefficients are in the units of the deltas: A is
+ * (ax, ay) and so on. With skip 1 they are 1, 0 and 0.
+ */
+struct reference_orbit {
+    const double *x;
+    const double *y;
+    const double *tol;  // glitch tolerance for step k: 1e-6 * |Z_k|^2
+    int length;
+    double scale;       // pixel deltas are given in units of scale
+    int skip;           // first step computed, at most length - 1
+    double ax, ay;
+    double bx, by;
+    double cx, cy;
+};
+
+/*
+ * Set on a perturbation result when the point could not be computed
+ * accurately relative to the reference (Pauldelbrot's criterion, or the
+ * reference escaped first) and must be redone with another reference
+ */
+const uint32_t GLITCHED = 0x80000000u;
+
+/*
+ * Perturbation kernels. Points are given as offsets from the reference
+ * point in units of ref->scale, either as a row (x0 + i*dx, y) or as a list
+ * (x[i], y[i]). Results are as for row_kernel, possibly with GLITCHED set.
+ */
+typedef void (*perturb_row_kernel)(const reference_orbit *ref, double x0,
+                                   double dx, double y, int first, int n,
+                                   const kernel_params *kp, uint32_t *its);
+typedef void (*perturb_points_kernel)(const reference_orbit *ref,
+                                      const double *x, const double *y,
+                                      int n, const kernel_params *kp,
+                                      uint32_t *its);
+
+struct kernel {
+    const char *name;
+    int width;          // number of points handled per float vector
+    row_kernel row;
+    row_kernel_d row_d;
+    block_kernel block;
+    block_kernel_d block_d;
+    points_kernel points;
+    points_kernel_d points_d;
+    perturb_row_kernel perturb_row;
+    perturb_points_kernel perturb_points;
+};
+
+// Defined in kernel_<isa>.cc
+extern const kernel kernel_sse2;
+extern const kernel kernel_avx2;
+extern const kernel kernel_avx512;
+
+/*
+ * What the kernels have executed, when built with -DINSTRUMENT (see
+ * instrument.h): vector loop iterations, the lanes of those, and how many
+ * of the lanes were iterating a point rather than idling. Without it the
+ * counters are not kept and stay zero.
+ */
+struct kernel_counters {
+    uint64_t steps;
+    uint64_t slots;     // steps times the vector width
+    uint64_t lanes;
+};
+
+#ifdef INSTRUMENT
+// Of the calling thread, since it started
+extern __thread kernel_counters thread_counters;
+#endif
+
+/*
+ * Counts the loop of one kernel call in registers, adding to the thread's
+ * counters once done. Without INSTRUMENT it does nothing, and compiles to
+ * nothing.
+ */
+struct kernel_probe {
+#ifdef INSTRUMENT
+    uint64_t steps;
+    uint64_t lanes;
+
+    kernel_probe() : steps(0), lanes(0) {}
+
+    // An iteration, with the lanes set in bits iterating
+    void step(int bits)
+    {
+        steps++;
+        lanes += __builtin_popcount(bits);
+    }
+
+    void done(int width)
+    {
+        thread_counters.steps += steps;
+        thread_counters.slots += steps * width;
+        thread_counters.lanes += lanes;
+    }
+#else
+    void step(int) {}
+    void done(int) {}
+#endif
+};
+
+/* The calling thread's counters */
+kernel_counters read_counters();
+
+/*
+ * Return the widest kernel supported by the CPU we are running on
+ * (determined through CPUID)
+ */
+const kernel *select_kernel();
+
+/*
+ * Return the kernel with the given name (sse2, avx2, avx512) or NULL if it
+ * is unknown or not supported by this CPU
+ */
+const kernel *find_kernel(const char *name);
+
+#endif // KERNEL_H
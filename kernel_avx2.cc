@@ -0,0 +1,241 @@
+/*
+ * kernel_avx2.cc
+ *
+ * AVX2 instantiations of the escape-time kernels (8 floats or 4 doubles per
+ * vector). Compiled with -mavx2, only called when CPUID reports AVX2.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#include "kernel.h"
+
+namespace {
+
+struct avx2 {
+    enum { WIDTH = 8 };
+
+    typedef float real;
+    typedef __m256 vf;
+    typedef __m256i vi;
+    typedef __m256 mask;
+
+    static inline vf set1(float f) { return _mm256_set1_ps(f); }
+    static inline vf load(const float *p) { return _mm256_loadu_ps(p); }
+
+    static inline vf ramp(float x0, float dx, int i)
+    {
+        vf idx8 = _mm256_add_ps(_mm256_set1_ps((float)i),
+                                _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f,
+                                               4.0f, 5.0f, 6.0f, 7.0f));
+        return _mm256_add_ps(_mm256_mul_ps(idx8, _mm256_set1_ps(dx)),
+                             _mm256_set1_ps(x0));
+    }
+
+    static inline vf add(vf a, vf b) { return _mm256_add_ps(a, b); }
+    static inline vf sub(vf a, vf b) { return _mm256_sub_ps(a, b); }
+    static inline vf mul(vf a, vf b) { return _mm256_mul_ps(a, b); }
+    static inline vf abs(vf a)
+    {
+        return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+    }
+
+    static inline mask lt(vf a, vf b)
+    {
+        return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+    }
+    static inline mask eq(vf a, vf b)
+    {
+        return _mm256_cmp_ps(a, b, _CMP_EQ_OQ);
+    }
+    static inline mask mask_and(mask a, mask b) { return _mm256_and_ps(a, b); }
+    static inline mask mask_or(mask a, mask b) { return _mm256_or_ps(a, b); }
+    static inline mask mask_andnot(mask a, mask b)
+    {
+        return _mm256_andnot_ps(a, b);
+    }
+    static inline mask none() { return _mm256_setzero_ps(); }
+    static inline int bits(mask m) { return _mm256_movemask_ps(m); }
+    static inline bool any(mask m) { return _mm256_movemask_ps(m) != 0; }
+
+    static inline vi zero_i() { return _mm256_setzero_si256(); }
+
+    // As with SSE2, subtracting an all-ones lane adds 1
+    static inline vi inc(vi v, mask m)
+    {
+        return _mm256_sub_epi32(v, _mm256_castps_si256(m));
+    }
+
+    static inline vi fill(vi v, mask m, int i)
+    {
+        return _mm256_blendv_epi8(v, _mm256_set1_epi32(i),
+                                  _mm256_castps_si256(m));
+    }
+
+    static inline vf select(mask m, vf a, vf b)
+    {
+        return _mm256_blendv_ps(b, a, m);
+    }
+    static inline vi to_int(vf v) { return _mm256_cvttps_epi32(v); }
+    static inline vi add_i(vi a, vi b) { return _mm256_add_epi32(a, b); }
+    static inline vi shl_i(vi v, int n) { return _mm256_slli_epi32(v, n); }
+
+    static inline void store(uint32_t *p, vi v)
+    {
+        _mm256_storeu_si256((__m256i *)p, v);
+    }
+
+    static inline void store_real(float *p, vf v) { _mm256_storeu_ps(p, v); }
+};
+
+
+/* Double precision, 4 points per vector with 64 bit iteration counters */
+struct avx2_d {
+    enum { WIDTH = 4 };
+
+    typedef double real;
+    typedef __m256d vf;
+    typedef __m256i vi;
+    typedef __m256d mask;
+
+    static inline vf set1(double f) { return _mm256_set1_pd(f); }
+    static inline vf load(const double *p) { return _mm256_loadu_pd(p); }
+
+    static inline vf ramp(double x0, double dx, int i)
+    {
+        vf idx4 = _mm256_add_pd(_mm256_set1_pd((double)i),
+                                _mm256_setr_pd(0.0, 1.0, 2.0, 3.0));
+        return _mm256_add_pd(_mm256_mul_pd(idx4, _mm256_set1_pd(dx)),
+                             _mm256_set1_pd(x0));
+    }
+
+    static inline vf add(vf a, vf b) { return _mm256_add_pd(a, b); }
+    static inline vf sub(vf a, vf b) { return _mm256_sub_pd(a, b); }
+    static inline vf mul(vf a, vf b) { return _mm256_mul_pd(a, b); }
+    static inline vf abs(vf a)
+    {
+        return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+    }
+
+    static inline mask lt(vf a, vf b)
+    {
+        return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+    }
+    static inline mask eq(vf a, vf b)
+    {
+        return _mm256_cmp_pd(a, b, _CMP_EQ_OQ);
+    }
+    static inline mask mask_and(mask a, mask b) { return _mm256_and_pd(a, b); }
+    static inline mask mask_or(mask a, mask b) { return _mm256_or_pd(a, b); }
+    static inline mask mask_andnot(mask a, mask b)
+    {
+        return _mm256_andnot_pd(a, b);
+    }
+    static inline mask none() { return _mm256_setzero_pd(); }
+    static inline int bits(mask m) { return _mm256_movemask_pd(m); }
+    static inline bool any(mask m) { return _mm256_movemask_pd(m) != 0; }
+
+    static inline vi zero_i() { return _mm256_setzero_si256(); }
+
+    static inline vi inc(vi v, mask m)
+    {
+        return _mm256_sub_epi64(v, _mm256_castpd_si256(m));
+    }
+
+    static inline vi fill(vi v, mask m, int i)
+    {
+        return _mm256_blendv_epi8(v, _mm256_set1_epi64x(i),
+                                  _mm256_castpd_si256(m));
+    }
+
+    static inline vf select(mask m, vf a, vf b)
+    {
+        return _mm256_blendv_pd(b, a, m);
+    }
+    static inline vi to_int(vf v)
+    {
+        return _mm256_cvtepi32_epi64(_mm256_cvttpd_epi32(v));
+    }
+    static inline vi add_i(vi a, vi b) { return _mm256_add_epi64(a, b); }
+    static inline vi shl_i(vi v, int n) { return _mm256_slli_epi64(v, n); }
+
+    // Keep the low half of each counter
+    static inline void store(uint32_t *p, vi v)
+    {
+        const __m256i low = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+
+        _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(
+                             _mm256_permutevar8x32_epi32(v, low)));
+    }
+
+    static inline void store_real(double *p, vf v) { _mm256_storeu_pd(p, v); }
+};
+
+} // namespace
+
+#include "kernel_impl.h"
+
+static void row_avx2(float x0, float dx, float y, int first, int n,
+                     const kernel_params *kp, uint32_t *its)
+{
+    mandel_row<avx2>(x0, dx, y, first, n, kp, its);
+}
+
+static void row_d_avx2(double x0, double dx, double y, int first, int n,
+                       const kernel_params *kp, uint32_t *its)
+{
+    mandel_row<avx2_d>(x0, dx, y, first, n, kp, its);
+}
+
+static void block_avx2(float x0, float dx, const float *y, int first,
+                       int w, int h, const kernel_params *kp,
+                       uint32_t *its, int pitch)
+{
+    mandel_block<avx2>(x0, dx, y, first, w, h, kp, its, pitch);
+}
+
+static void block_d_avx2(double x0, double dx, const double *y,
+                         int first, int w, int h, const kernel_params *kp,
+                         uint32_t *its, int pitch)
+{
+    mandel_block<avx2_d>(x0, dx, y, first, w, h, kp, its, pitch);
+}
+
+static void points_avx2(const float *x, const float *y, int n,
+                        const kernel_params *kp, uint32_t *its)
+{
+    mandel_points<avx2>(x, y, n, kp, its);
+}
+
+static void points_d_avx2(const double *x, const double *y, int n,
+                          const kernel_params *kp, uint32_t *its)
+{
+    mandel_points<avx2_d>(x, y, n, kp, its);
+}
+
+static void perturb_row_avx2(const reference_orbit *ref, double x0, double dx,
+                             double y, int first, int n,
+                             const kernel_params *kp, uint32_t *its)
+{
+    perturb_row<avx2_d>(ref, x0, dx, y, first, n, kp, its);
+}
+
+static void perturb_points_avx2(const reference_orbit *ref, const double *x,
+                                const double *y, int n,
+                                const kernel_params *kp, uint32_t *its)
+{
+    perturb_points<avx2_d>(ref, x, y, n, kp, its);
+}
+
+const kernel kernel_avx2 = {
+    "avx2", avx2::WIDTH,
+    row_avx2, row_d_avx2, block_avx2, block_d_avx2,
+    points_avx2, points_d_avx2,
+    perturb_row_avx2, perturb_points_avx2
+};
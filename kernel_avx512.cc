@@ -0,0 +1,253 @@
+/*
+ * kernel_avx512.cc
+ *
+ * AVX-512 instantiations of the escape-time kernels (16 floats or 8 doubles
+ * per vector). Compiled with -mavx512f, only called when CPUID reports
+ * AVX-512F. Unlike SSE2/AVX2, comparisons produce a k-register bit mask
+ * rather than a vector.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#include "kernel.h"
+
+namespace {
+
+struct avx512 {
+    enum { WIDTH = 16 };
+
+    typedef float real;
+    typedef __m512 vf;
+    typedef __m512i vi;
+    typedef __mmask16 mask;
+
+    static inline vf set1(float f) { return _mm512_set1_ps(f); }
+    static inline vf load(const float *p) { return _mm512_loadu_ps(p); }
+
+    static inline vf ramp(float x0, float dx, int i)
+    {
+        vf idx16 = _mm512_add_ps(_mm512_set1_ps((float)i),
+                                 _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f,
+                                                4.0f, 5.0f, 6.0f, 7.0f,
+                                                8.0f, 9.0f, 10.0f, 11.0f,
+                                                12.0f, 13.0f, 14.0f, 15.0f));
+        return _mm512_add_ps(_mm512_mul_ps(idx16, _mm512_set1_ps(dx)),
+                             _mm512_set1_ps(x0));
+    }
+
+    static inline vf add(vf a, vf b) { return _mm512_add_ps(a, b); }
+    static inline vf sub(vf a, vf b) { return _mm512_sub_ps(a, b); }
+    static inline vf mul(vf a, vf b) { return _mm512_mul_ps(a, b); }
+    // AVX-512F has no floating point and, so the sign is cleared as ints
+    static inline vf abs(vf a)
+    {
+        return _mm512_castsi512_ps(_mm512_and_epi32(_mm512_castps_si512(a),
+                                   _mm512_set1_epi32(0x7FFFFFFF)));
+    }
+
+    static inline mask lt(vf a, vf b)
+    {
+        return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+    }
+    static inline mask eq(vf a, vf b)
+    {
+        return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ);
+    }
+    static inline mask mask_and(mask a, mask b) { return a & b; }
+    static inline mask mask_or(mask a, mask b) { return a | b; }
+    static inline mask mask_andnot(mask a, mask b) { return ~a & b; }
+    static inline mask none() { return 0; }
+    static inline int bits(mask m) { return m; }
+    static inline bool any(mask m) { return m != 0; }
+
+    static inline vi zero_i() { return _mm512_setzero_si512(); }
+
+    static inline vi inc(vi v, mask m)
+    {
+        return _mm512_mask_add_epi32(v, m, v, _mm512_set1_epi32(1));
+    }
+
+    static inline vi fill(vi v, mask m, int i)
+    {
+        return _mm512_mask_mov_epi32(v, m, _mm512_set1_epi32(i));
+    }
+
+    static inline vf select(mask m, vf a, vf b)
+    {
+        return _mm512_mask_blend_ps(m, b, a);
+    }
+    /*
+     * The zero-masking forms, as the plain ones merge into an undefined
+     * vector, which GCC warns of
+     */
+    static inline vi to_int(vf v)
+    {
+        return _mm512_maskz_cvttps_epi32(0xFFFF, v);
+    }
+    static inline vi add_i(vi a, vi b) { return _mm512_add_epi32(a, b); }
+    static inline vi shl_i(vi v, int n)
+    {
+        return _mm512_maskz_slli_epi32(0xFFFF, v, n);
+    }
+
+    static inline void store(uint32_t *p, vi v)
+    {
+        _mm512_storeu_si512(p, v);
+    }
+
+    static inline void store_real(float *p, vf v) { _mm512_storeu_ps(p, v); }
+};
+
+
+/* Double precision, 8 points per vector with 64 bit iteration counters */
+struct avx512_d {
+    enum { WIDTH = 8 };
+
+    typedef double real;
+    typedef __m512d vf;
+    typedef __m512i vi;
+    typedef __mmask8 mask;
+
+    static inline vf set1(double f) { return _mm512_set1_pd(f); }
+    static inline vf load(const double *p) { return _mm512_loadu_pd(p); }
+
+    static inline vf ramp(double x0, double dx, int i)
+    {
+        vf idx8 = _mm512_add_pd(_mm512_set1_pd((double)i),
+                                _mm512_setr_pd(0.0, 1.0, 2.0, 3.0,
+                                               4.0, 5.0, 6.0, 7.0));
+        return _mm512_add_pd(_mm512_mul_pd(idx8, _mm512_set1_pd(dx)),
+                             _mm512_set1_pd(x0));
+    }
+
+    static inline vf add(vf a, vf b) { return _mm512_add_pd(a, b); }
+    static inline vf sub(vf a, vf b) { return _mm512_sub_pd(a, b); }
+    static inline vf mul(vf a, vf b) { return _mm512_mul_pd(a, b); }
+    static inline vf abs(vf a)
+    {
+        return _mm512_castsi512_pd(_mm512_and_epi64(_mm512_castpd_si512(a),
+                                   _mm512_set1_epi64(0x7FFFFFFFFFFFFFFFLL)));
+    }
+
+    static inline mask lt(vf a, vf b)
+    {
+        return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);
+    }
+    static inline mask eq(vf a, vf b)
+    {
+        return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ);
+    }
+    static inline mask mask_and(mask a, mask b) { return a & b; }
+    static inline mask mask_or(mask a, mask b) { return a | b; }
+    static inline mask mask_andnot(mask a, mask b) { return ~a & b; }
+    static inline mask none() { return 0; }
+    static inline int bits(mask m) { return m; }
+    static inline bool any(mask m) { return m != 0; }
+
+    static inline vi zero_i() { return _mm512_setzero_si512(); }
+
+    static inline vi inc(vi v, mask m)
+    {
+        return _mm512_mask_add_epi64(v, m, v, _mm512_set1_epi64(1));
+    }
+
+    static inline vi fill(vi v, mask m, int i)
+    {
+        return _mm512_mask_mov_epi64(v, m, _mm512_set1_epi64(i));
+    }
+
+    static inline vf select(mask m, vf a, vf b)
+    {
+        return _mm512_mask_blend_pd(m, b, a);
+    }
+    // Zero-masking as for avx512
+    static inline vi to_int(vf v)
+    {
+        return _mm512_maskz_cvtepi32_epi64(0xFF,
+                                           _mm512_maskz_cvttpd_epi32(0xFF,
+                                                                     v));
+    }
+    static inline vi add_i(vi a, vi b) { return _mm512_add_epi64(a, b); }
+    static inline vi shl_i(vi v, int n)
+    {
+        return _mm512_maskz_slli_epi64(0xFF, v, n);
+    }
+
+    // Keep the low half of each counter
+    static inline void store(uint32_t *p, vi v)
+    {
+        _mm512_mask_cvtepi64_storeu_epi32(p, 0xFF, v);
+    }
+
+    static inline void store_real(double *p, vf v) { _mm512_storeu_pd(p, v); }
+};
+
+} // namespace
+
+#include "kernel_impl.h"
+
+static void row_avx512(float x0, float dx, float y, int first, int n,
+                       const kernel_params *kp, uint32_t *its)
+{
+    mandel_row<avx512>(x0, dx, y, first, n, kp, its);
+}
+
+static void row_d_avx512(double x0, double dx, double y, int first, int n,
+                         const kernel_params *kp, uint32_t *its)
+{
+    mandel_row<avx512_d>(x0, dx, y, first, n, kp, its);
+}
+
+static void block_avx512(float x0, float dx, const float *y, int first,
+                         int w, int h, const kernel_params *kp,
+                         uint32_t *its, int pitch)
+{
+    mandel_block<avx512>(x0, dx, y, first, w, h, kp, its, pitch);
+}
+
+static void block_d_avx512(double x0, double dx, const double *y,
+                           int first, int w, int h, const kernel_params *kp,
+                           uint32_t *its, int pitch)
+{
+    mandel_block<avx512_d>(x0, dx, y, first, w, h, kp, its, pitch);
+}
+
+static void points_avx512(const float *x, const float *y, int n,
+                          const kernel_params *kp, uint32_t *its)
+{
+    mandel_points<avx512>(x, y, n, kp, its);
+}
+
+static void points_d_avx512(const double *x, const double *y, int n,
+                            const kernel_params *kp, uint32_t *its)
+{
+    mandel_points<avx512_d>(x, y, n, kp, its);
+}
+
+static void perturb_row_avx512(const reference_orbit *ref, double x0,
+                               double dx, double y, int first, int n,
+                               const kernel_params *kp, uint32_t *its)
+{
+    perturb_row<avx512_d>(ref, x0, dx, y, first, n, kp, its);
+}
+
+static void perturb_points_avx512(const reference_orbit *ref, const double *x,
+                                  const double *y, int n,
+                                  const kernel_params *kp, uint32_t *its)
+{
+    perturb_points<avx512_d>(ref, x, y, n, kp, its);
+}
+
+const kernel kernel_avx512 = {
+    "avx512", avx512::WIDTH,
+    row_avx512, row_d_avx512, block_avx512, block_d_avx512,
+    points_avx512, points_d_avx512,
+    perturb_row_avx512, perturb_points_avx512
+};
@@ -0,0 +1,1173 @@
+/*
+ * kernel_impl.h
+ *
+ * The escape-time algorithm written once against a small set of vector
+ * operations. Each kernel_<isa>.cc defines a traits struct V providing those
+ * operations for its instruction set and then includes this file, which
+ * instantiates the kernel with the translation unit's compiler flags, once
+ * for each formula.
+ *
+ * Everything here lives in an unnamed namespace so that a function compiled
+ * with, say, -mavx512f can never be picked by the linker to satisfy a call
+ * from code that must run on a plain SSE2 machine.
+ *
+ * V must provide:
+ *   WIDTH                      number of lanes
+ *   real                       lane type (float or double)
+ *   vf, vi, mask               real vector, int vector and lane mask types
+ *   set1(f), ramp(x0, dx, i)   broadcast, and x0 + (i + lane) * dx
+ *   load(p)                    unaligned load of WIDTH reals
+ *   add, sub, mul, abs         real arithmetic
+ *   lt(a, b), eq(a, b)         lane mask of a < b, a == b
+ *   mask_and, mask_or          mask combination
+ *   mask_andnot(a, b)          lanes set in b but not in a
+ *   none(), bits(m), any(m)    empty mask, mask as an int bitfield, and test
+ *   zero_i(), inc(v, m)        int vector of zeros, add 1 where m is set
+ *   fill(v, m, i)              v with the lanes set in m replaced by i
+ *   select(m, a, b)            a in the lanes set in m and b in the others
+ *   to_int(v)                  reals truncated to int vector lanes
+ *   add_i(a, b), shl_i(v, n)   int vector addition and left shift
+ *   store(p, v)                unaligned store of WIDTH uint32_t
+ *   store_real(p, v)           unaligned store of WIDTH reals
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef KERNEL_IMPL_H
+#define KERNEL_IMPL_H
+
+#include <string.h>
+
+namespace {
+
+/*
+ * Lanes whose point lies inside the main cardioid or the period-2 bulb.
+ * Such points never escape, so they can be given max_its without
+ * iterating at all.
+ */
+template <class V>
+inline typename V::mask in_main_bulbs(typename V::vf cx, typename V::vf cy)
+{
+    const typename V::vf quarter = V::set1(0.25);
+    const typename V::vf y_sq = V::mul(cy, cy);
+
+    // q = (x - 1/4)^2 + y^2, inside the cardioid if q*(q + x - 1/4) < y^2/4
+    typename V::vf xq = V::sub(cx, quarter);
+    typename V::vf q = V::add(V::mul(xq, xq), y_sq);
+    typename V::mask cardioid = V::lt(V::mul(q, V::add(q, xq)),
+                                      V::mul(quarter, y_sq));
+
+    // (x + 1)^2 + y^2 < 1/16
+    typename V::vf x1 = V::add(cx, V::set1(1.0));
+    typename V::mask bulb = V::lt(V::add(V::mul(x1, x1), y_sq),
+                                  V::set1(0.0625));
+
+    return V::mask_or(cardioid, bulb);
+}
+
+/*
+ * log2(1 + t) for 0 <= t <= 1, from the fifth degree polynomial for
+ * ln(1 + t) of Abramowitz and Stegun 4.1.43 (error at most 1e-5). The GPU
+ * evaluates it the same way.
+ */
+template <class V>
+inline typename V::vf log2_1p(typename V::vf t)
+{
+    typename V::vf p = V::set1(0.03215845);
+
+    p = V::add(V::mul(p, t), V::set1(-0.13606275));
+    p = V::add(V::mul(p, t), V::set1(0.28947478));
+    p = V::add(V::mul(p, t), V::set1(-0.49190896));
+    p = V::add(V::mul(p, t), V::set1(0.99949556));
+    return V::mul(V::mul(p, t), V::set1(1.44269504));
+}
+
+/*
+ * The fraction bits (see FRACTION_SHIFT in kernel.h) of points whose |z|^2
+ * was dist when they escaped. The fraction falls to 0 as dist reaches 16,
+ * and is 0 beyond that and for points which have not escaped (dist < 4).
+ */
+template <class V>
+inline typename V::vi fraction(typename V::vf dist)
+{
+    // log2 dist = e + log2(1 + t) with 0 <= t < 1, for 4 <= dist < 16
+    const typename V::mask low = V::lt(dist, V::set1(8.0));
+    const typename V::vf e = V::select(low, V::set1(2.0), V::set1(3.0));
+    const typename V::vf t = V::sub(V::mul(dist,
+                                           V::select(low, V::set1(0.25),
+                                                     V::set1(0.125))),
+                                    V::set1(1.0));
+    const typename V::vf l = V::add(e, log2_1p<V>(t));
+
+    // and as 2 <= l < 4, log2 l = 1 + log2(1 + u) with 0 <= u < 1
+    const typename V::vf u = V::sub(V::mul(l, V::set1(0.5)), V::set1(1.0));
+    const typename V::vf f = V::sub(V::set1(1.0), log2_1p<V>(u));
+
+    const typename V::mask escaped = V::mask_andnot(V::lt(dist,
+                                                          V::set1(4.0)),
+                                                    V::lt(dist,
+                                                          V::set1(16.0)));
+    const typename V::vf scaled = V::mul(f, V::set1((1 << FRACTION_BITS) -
+                                                    1));
+
+    return V::shl_i(V::to_int(V::select(escaped, scaled, V::set1(0.0))),
+                    FRACTION_SHIFT);
+}
+
+/*
+ * The formulas the loops are specialised for (see formula_type in
+ * kernel.h). step() advances z = x + iy by one iteration given c, x^2 and
+ * y^2, and updates x^2 and y^2 to match. c(p) is the c of the point p,
+ * BULBS says whether in_main_bulbs applies and DEGREE is that of f(z).
+ */
+template <class V>
+struct mandelbrot_formula {
+    typedef typename V::vf vf;
+
+    static const bool BULBS = true;
+    static const int DEGREE = 2;
+
+    explicit mandelbrot_formula(const kernel_params *) {}
+
+    vf c_x(vf px) const { return px; }
+    vf c_y(vf py) const { return py; }
+
+    static inline void step(vf &x, vf &y, vf &x_sq, vf &y_sq, vf cx, vf cy)
+    {
+        y = V::mul(x, y);       // x * y
+        y = V::add(y, y);       // (x * y) + (x * y) = 2*x*y
+        y = V::add(y, cy);      // 2*x*y + cy
+
+        x = V::sub(x_sq, y_sq); // x*x - y*y
+        x = V::add(x, cx);      // (x*x - y*y) + cx
+
+        x_sq = V::mul(x, x);    // x * x
+        y_sq = V::mul(y, y);    // y * y
+    }
+};
+
+// The same iteration, with c fixed and z starting from the point
+template <class V>
+struct julia_formula : mandelbrot_formula<V> {
+    typedef typename V::vf vf;
+
+    static const bool BULBS = false;
+
+    vf cx, cy;
+
+    explicit julia_formula(const kernel_params *kp)
+        : mandelbrot_formula<V>(kp), cx(V::set1(kp->julia_x)),
+          cy(V::set1(kp->julia_y)) {}
+
+    vf c_x(vf) const { return cx; }
+    vf c_y(vf) const { return cy; }
+};
+
+// z^3 = x (x^2 - 3y^2) + i y (3x^2 - y^2)
+template <class V>
+struct cubic_formula : mandelbrot_formula<V> {
+    typedef typename V::vf vf;
+
+    static const bool BULBS = false;
+    static const int DEGREE = 3;
+
+    explicit cubic_formula(const kernel_params *kp)
+        : mandelbrot_formula<V>(kp) {}
+
+    static inline void step(vf &x, vf &y, vf &x_sq, vf &y_sq, vf cx, vf cy)
+    {
+        const vf three = V::set1(3.0);
+        const vf nx = V::mul(x, V::sub(x_sq, V::mul(three, y_sq)));
+
+        y = V::add(V::mul(y, V::sub(V::mul(three, x_sq), y_sq)), cy);
+        x = V::add(nx, cx);
+
+        x_sq = V::mul(x, x);
+        y_sq = V::mul(y, y);
+    }
+};
+
+// z^4 = (z^2)^2, with z^2 = a + ib
+template <class V>
+struct quartic_formula : mandelbrot_formula<V> {
+    typedef typename V::vf vf;
+
+    static const bool BULBS = false;
+    static const int DEGREE = 4;
+
+    explicit quartic_formula(const kernel_params *kp)
+        : mandelbrot_formula<V>(kp) {}
+
+    static inline void step(vf &x, vf &y, vf &x_sq, vf &y_sq, vf cx, vf cy)
+    {
+        const vf a = V::sub(x_sq, y_sq);
+        vf b = V::mul(x, y);
+
+        b = V::add(b, b);
+        const vf ab = V::mul(a, b);
+        y = V::add(V::add(ab, ab), cy);
+        x = V::add(V::sub(V::mul(a, a), V::mul(b, b)), cx);
+
+        x_sq = V::mul(x, x);
+        y_sq = V::mul(y, y);
+    }
+};
+
+// As the Mandelbrot set, with 2|xy| for 2xy
+template <class V>
+struct burning_ship_formula : mandelbrot_formula<V> {
+    typedef typename V::vf vf;
+
+    static const bool BULBS = false;
+
+    explicit burning_ship_formula(const kernel_params *kp)
+        : mandelbrot_formula<V>(kp) {}
+
+    static inline void step(vf &x, vf &y, vf &x_sq, vf &y_sq, vf cx, vf cy)
+    {
+        y = V::abs(V::mul(x, y));
+        y = V::add(y, y);
+        y = V::add(y, cy);
+
+        x = V::sub(x_sq, y_sq);
+        x = V::add(x, cx);
+
+        x_sq = V::mul(x, x);
+        y_sq = V::mul(y, y);
+    }
+};
+
+/*
+ * Determine concurrently whether V::WIDTH points are members of the
+ * mandelbrot set by checking whether they exceed a distance limit within a
+ * bounded number of iterations. A packed integer vector is returned
+ * containing the number of iterations executed for each point (in the
+ * corresponding position).
+ *
+ * The points are iterated with the formula f. BULBS and PERIODICITY
+ * enable the interior early-outs, and SMOOTH the fraction bits (see
+ * kernel.h). They are template parameters so that the loop carries no test
+ * for them when they are off, nor any for the formula.
+ */
+template <class V, class F, bool BULBS, bool PERIODICITY, bool SMOOTH>
+inline typename V::vi member(const F &f, typename V::vf px,
+                             typename V::vf py, int max_its)
+{
+    const typename V::vf dist_limit = V::set1(4.0);
+    const typename V::vf cx = f.c_x(px);
+    const typename V::vf cy = f.c_y(py);
+
+    typename V::vf x = px;
+    typename V::vf y = py;
+    typename V::vf x_sq = V::mul(x, x);
+    typename V::vf y_sq = V::mul(y, y);
+    typename V::vi iterations = V::zero_i();
+
+    // Lanes set in not_escape have neither escaped nor run out of iterations
+    typename V::vf escape_dist = V::add(x_sq, y_sq);
+    typename V::mask not_escape = V::lt(escape_dist, dist_limit);
+
+    if (BULBS) {
+        typename V::mask interior = in_main_bulbs<V>(cx, cy);
+
+        iterations = V::fill(iterations, interior, max_its);
+        not_escape = V::mask_andnot(interior, not_escape);
+    }
+
+    /*
+     * Brent's cycle detection: z is compared with a saved point, which is
+     * moved on to the current z whenever n reaches the next power of two,
+     * so any cycle is caught within twice its period (plus the time taken
+     * to reach it). The comparison is exact, so a lane is only retired if
+     * iterating it further would repeat the same values forever, and the
+     * result is the same as without the check.
+     */
+    typename V::vf saved_x = x;
+    typename V::vf saved_y = y;
+    int next_save = 1;
+    kernel_probe probe;
+
+    /*
+     * Every lane that is still in not_escape has executed exactly n
+     * iterations, so the iteration limit can be checked on the scalar loop
+     * counter instead of on each lane.
+     */
+    for (int n = 0; n < max_its && V::any(not_escape); n++) {
+        probe.step(V::bits(not_escape));
+        iterations = V::inc(iterations, not_escape);
+        F::step(x, y, x_sq, y_sq, cx, cy);
+
+        // (x*x + y*y) < 4 (limit), keeping x*x + y*y of the lanes running
+        const typename V::vf dist = V::add(x_sq, y_sq);
+        if (SMOOTH)
+            escape_dist = V::select(not_escape, dist, escape_dist);
+        not_escape = V::mask_and(not_escape, V::lt(dist, dist_limit));
+
+        if (PERIODICITY) {
+            typename V::mask cycle = V::mask_and(not_escape,
+                                                 V::mask_and(
+                                                     V::eq(x, saved_x),
+                                                     V::eq(y, saved_y)));
+            if (V::any(cycle)) {
+                iterations = V::fill(iterations, cycle, max_its);
+                not_escape = V::mask_andnot(cycle, not_escape);
+            }
+
+            if (n == next_save) {
+                saved_x = x;
+                saved_y = y;
+                next_save *= 2;
+            }
+        }
+    }
+
+    probe.done(V::WIDTH);
+    if (SMOOTH)
+        iterations = V::add_i(iterations, fraction<V>(escape_dist));
+    return iterations;
+}
+
+/*
+ * Compute the points first..first+n-1 of a row, V::WIDTH at a time. The
+ * last vector is computed in full and only the points that belong to the
+ * span are kept, so n need not be a multiple of the vector width.
+ */
+template <class V, class F, bool BULBS, bool PERIODICITY, bool SMOOTH>
+inline void mandel_row(const F &f, typename V::real x0, typename V::real dx,
+                       typename V::real y, int first, int n, int max_its,
+                       uint32_t *its)
+{
+    const typename V::vf py = V::set1(y);
+    int i;
+
+    for (i = 0; i + V::WIDTH <= n; i += V::WIDTH) {
+        V::store(its + i,
+                 member<V, F, BULBS, PERIODICITY, SMOOTH>(f,
+                                                          V::ramp(x0, dx,
+                                                                  first + i),
+                                                          py, max_its));
+    }
+
+    if (i < n) {
+        uint32_t tail[V::WIDTH];
+
+        V::store(tail,
+                 member<V, F, BULBS, PERIODICITY, SMOOTH>(f,
+                                                          V::ramp(x0, dx,
+                                                                  first + i),
+                                                          py, max_its));
+        memcpy(its + i, tail, (n - i) * sizeof(uint32_t));
+    }
+}
+
+/*
+ * Compute n arbitrary points. The last vector is padded by repeating the
+ * first point.
+ */
+template <class V, class F, bool BULBS, bool PERIODICITY, bool SMOOTH>
+inline void mandel_points(const F &f, const typename V::real *x,
+                          const typename V::real *y, int n, int max_its,
+                          uint32_t *its)
+{
+    int i;
+
+    for (i = 0; i + V::WIDTH <= n; i += V::WIDTH) {
+        V::store(its + i,
+                 member<V, F, BULBS, PERIODICITY, SMOOTH>(f, V::load(x + i),
+                                                          V::load(y + i),
+                                                          max_its));
+    }
+
+    if (i < n) {
+        typename V::real tail_x[V::WIDTH], tail_y[V::WIDTH];
+        uint32_t tail[V::WIDTH];
+
+        for (int j = 0; j < V::WIDTH; j++) {
+            tail_x[j] = x[i + (i + j < n ? j : 0)];
+            tail_y[j] = y[i + (i + j < n ? j : 0)];
+        }
+
+        V::store(tail,
+                 member<V, F, BULBS, PERIODICITY, SMOOTH>(f,
+                                                          V::load(tail_x),
+                                                          V::load(tail_y),
+                                                          max_its));
+        memcpy(its + i, tail, (n - i) * sizeof(uint32_t));
+    }
+}
+
+/*
+ * Sources of points for mandel_stream. next(cx, cy, out) loads the next
+ * vector of points and where their counts go, and returns how many of its
+ * lanes are points (0 at the end).
+ */
+template <class V>
+struct block_source {
+    typename V::real x0, dx;
+    const typename V::real *y;
+    int first, width, height;
+    uint32_t *its;
+    int pitch;
+    int row, col;       // next point
+
+    // Along the rows, as in mandel_row
+    int next(typename V::vf *cx, typename V::vf *cy, uint32_t **out)
+    {
+        if (row == height)
+            return 0;
+
+        const int m = width - col < V::WIDTH ? width - col : V::WIDTH;
+
+        *cx = V::ramp(x0, dx, first + col);
+        *cy = V::set1(y[row]);
+        *out = its + row*pitch + col;
+        col += m;
+        if (col == width) {
+            row++;
+            col = 0;
+        }
+        return m;
+    }
+};
+
+template <class V>
+struct points_source {
+    const typename V::real *x, *y;
+    int n;
+    uint32_t *its;
+    int i;              // next point
+
+    // The last vector is padded by repeating its first point
+    int next(typename V::vf *cx, typename V::vf *cy, uint32_t **out)
+    {
+        const int m = n - i < V::WIDTH ? n - i : V::WIDTH;
+
+        if (m == V::WIDTH) {
+            *cx = V::load(x + i);
+            *cy = V::load(y + i);
+        } else if (m > 0) {
+            typename V::real tail_x[V::WIDTH], tail_y[V::WIDTH];
+
+            for (int j = 0; j < V::WIDTH; j++) {
+                tail_x[j] = x[i + (j < m ? j : 0)];
+                tail_y[j] = y[i + (j < m ? j : 0)];
+            }
+            *cx = V::load(tail_x);
+            *cy = V::load(tail_y);
+        }
+        *out = its + i;
+        i += m;
+        return m;
+    }
+};
+
+/*
+ * Iterations a vector of points is run for together, as by member, before
+ * the points still running are handed to lanes of their own. Most points
+ * escape within a few iterations of their neighbours, and for those the
+ * bookkeeping of a lane each would cost more than the idle lanes do.
+ */
+const int SHARED_ITS = 128;
+
+/*
+ * The lane loop checks for finished lanes every REFILL_CHECK iterations,
+ * and stops to refill them once there are REFILL_LANES of them: each stop
+ * passes every lane through memory
+ */
+const int REFILL_CHECK = 8;
+const int REFILL_LANES = 4;
+
+// Bits set in b, for masks of up to 16 lanes
+inline int lanes_set(int b)
+{
+    static const unsigned char nibble[16] = {
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+    };
+
+    return nibble[b & 15] + nibble[(b >> 4) & 15] + nibble[(b >> 8) & 15] +
+           nibble[(b >> 12) & 15];
+}
+
+// A point handed on to a lane, with everything needed to go on iterating it
+template <class real>
+struct straggler {
+    real cx, cy, x, y, saved_x, saved_y;
+    int count, next_save;
+    uint32_t *out;
+};
+
+/*
+ * Compute the points of src with the vector lanes kept busy. Each vector
+ * of points is first iterated as by member for up to SHARED_ITS
+ * iterations. Points still running then are queued, and iterated in lanes
+ * which are refilled from the queue as soon as their point is done, so
+ * that one slow point does not hold up the V::WIDTH - 1 others as it would
+ * in member (for, say, max_its iterations of a point inside).
+ *
+ * Lanes are at different iterations, so Brent's saved point is moved on
+ * per lane while the lane loop is stopped. Cycle detection is exact
+ * whenever the point is saved, so the counts are those of member. A point
+ * queued has not escaped, so its escaping |z|^2 is taken in its lane.
+ */
+template <class V, class F, bool BULBS, bool PERIODICITY, bool SMOOTH,
+          class S>
+inline void mandel_stream(S *src, const F &f, int max_its)
+{
+    typedef typename V::real real;
+    const int W = V::WIDTH;
+    const typename V::vf dist_limit = V::set1(4.0);
+
+    // At most W - 1 waiting when another vector is started
+    straggler<real> queue[2 * W];
+    int queued = 0;
+
+    // Lane state while the lane loop is stopped; idle lanes are outside 2
+    real cx[W], cy[W], x[W], y[W], saved_x[W], saved_y[W];
+    uint32_t count[W], steps[W], fractions[W];
+    uint32_t *out[W];
+    int next_save[W];
+    int busy = 0;
+    bool more = true;
+    kernel_probe probe;
+
+    for (int j = 0; j < W; j++)
+        out[j] = NULL;
+
+    for (;;) {
+        // Iterate vectors of points together until the idle lanes can be fed
+        while (more && queued < W - busy) {
+            typename V::vf vpx = dist_limit, vpy = dist_limit;
+            uint32_t *o;
+            const int m = src->next(&vpx, &vpy, &o);
+
+            if (m == 0) {
+                more = false;
+                break;
+            }
+
+            // As in member
+            const typename V::vf vcx = f.c_x(vpx);
+            const typename V::vf vcy = f.c_y(vpy);
+            typename V::vf vx = vpx;
+            typename V::vf vy = vpy;
+            typename V::vf x_sq = V::mul(vx, vx);
+            typename V::vf y_sq = V::mul(vy, vy);
+            typename V::vi iterations = V::zero_i();
+            typename V::vf escape_dist = V::add(x_sq, y_sq);
+            typename V::mask not_escape = V::lt(escape_dist, dist_limit);
+
+            if (BULBS) {
+                typename V::mask interior = in_main_bulbs<V>(vcx, vcy);
+
+                iterations = V::fill(iterations, interior, max_its);
+                not_escape = V::mask_andnot(interior, not_escape);
+            }
+
+            typename V::vf vsaved_x = vx;
+            typename V::vf vsaved_y = vy;
+            const int shared = max_its < SHARED_ITS ? max_its : SHARED_ITS;
+            int save = 1;
+            int n;
+
+            for (n = 0; n < shared && V::any(not_escape); n++) {
+                probe.step(V::bits(not_escape));
+                iterations = V::inc(iterations, not_escape);
+                F::step(vx, vy, x_sq, y_sq, vcx, vcy);
+
+                const typename V::vf dist = V::add(x_sq, y_sq);
+                if (SMOOTH)
+                    escape_dist = V::select(not_escape, dist, escape_dist);
+                not_escape = V::mask_and(not_escape,
+                                         V::lt(dist, dist_limit));
+
+                if (PERIODICITY) {
+                    typename V::mask cycle =
+                        V::mask_and(not_escape,
+                                    V::mask_and(V::eq(vx, vsaved_x),
+                                                V::eq(vy, vsaved_y)));
+                    if (V::any(cycle)) {
+                        iterations = V::fill(iterations, cycle, max_its);
+                        not_escape = V::mask_andnot(cycle, not_escape);
+                    }
+
+                    if (n == save) {
+                        vsaved_x = vx;
+                        vsaved_y = vy;
+                        save *= 2;
+                    }
+                }
+            }
+
+            uint32_t tail[W];
+
+            if (SMOOTH)
+                iterations = V::add_i(iterations,
+                                      fraction<V>(escape_dist));
+            V::store(tail, iterations);
+            memcpy(o, tail, m * sizeof(uint32_t));
+
+            const int running = n < max_its ? V::bits(not_escape) : 0;
+            if (running == 0)
+                continue;
+
+            real lx[W], ly[W], lcx[W], lcy[W], lsx[W], lsy[W];
+
+            V::store_real(lx, vx);
+            V::store_real(ly, vy);
+            V::store_real(lcx, vcx);
+            V::store_real(lcy, vcy);
+            V::store_real(lsx, vsaved_x);
+            V::store_real(lsy, vsaved_y);
+            for (int i = 0; i < m; i++) {
+                if (!(running & (1 << i)))
+                    continue;
+
+                straggler<real> *s = &queue[queued++];
+                s->cx = lcx[i];
+                s->cy = lcy[i];
+                s->x = lx[i];
+                s->y = ly[i];
+                s->saved_x = lsx[i];
+                s->saved_y = lsy[i];
+                s->count = n;
+                s->next_save = save + 1;
+                s->out = o + i;
+            }
+        }
+
+        for (int j = 0; j < W && queued > 0; j++) {
+            if (out[j] != NULL)
+                continue;
+
+            const straggler<real> *s = &queue[--queued];
+            cx[j] = s->cx;
+            cy[j] = s->cy;
+            x[j] = s->x;
+            y[j] = s->y;
+            saved_x[j] = s->saved_x;
+            saved_y[j] = s->saved_y;
+            count[j] = s->count;
+            next_save[j] = s->next_save;
+            out[j] = s->out;
+            busy++;
+        }
+
+        if (busy == 0)
+            break;
+
+        /*
+         * Iterations until a lane reaches max_its, or until every lane is
+         * due to save
+         */
+        int run = max_its, due = 0;
+        for (int j = 0; j < W; j++) {
+            if (out[j] == NULL) {
+                cx[j] = x[j] = cy[j] = y[j] = 2.0;
+                continue;
+            }
+            if (max_its - (int)count[j] < run)
+                run = max_its - count[j];
+            if (next_save[j] - (int)count[j] > due)
+                due = next_save[j] - count[j];
+        }
+        if (PERIODICITY && due < run)
+            run = due;
+        const int wait = busy < REFILL_LANES ? busy : REFILL_LANES;
+
+        const typename V::vf vcx = V::load(cx);
+        const typename V::vf vcy = V::load(cy);
+        typename V::vf vx = V::load(x);
+        typename V::vf vy = V::load(y);
+        typename V::vf x_sq = V::mul(vx, vx);
+        typename V::vf y_sq = V::mul(vy, vy);
+        typename V::vf vsaved_x = V::load(saved_x);
+        typename V::vf vsaved_y = V::load(saved_y);
+        typename V::vi iterations = V::zero_i();
+        typename V::vf escape_dist = V::add(x_sq, y_sq);
+        typename V::mask not_escape = V::lt(escape_dist, dist_limit);
+        typename V::mask cycled = V::none();
+        const int live = V::bits(not_escape);
+
+        // As in member, until a lane is done and there is work to refill it
+        for (int k = 1; k <= run; k++) {
+            probe.step(V::bits(not_escape));
+            iterations = V::inc(iterations, not_escape);
+            F::step(vx, vy, x_sq, y_sq, vcx, vcy);
+
+            const typename V::vf dist = V::add(x_sq, y_sq);
+            if (SMOOTH)
+                escape_dist = V::select(not_escape, dist, escape_dist);
+            not_escape = V::mask_and(not_escape, V::lt(dist, dist_limit));
+
+            if (PERIODICITY) {
+                typename V::mask cycle = V::mask_and(not_escape,
+                                                     V::mask_and(
+                                                         V::eq(vx, vsaved_x),
+                                                         V::eq(vy, vsaved_y)));
+                cycled = V::mask_or(cycled, cycle);
+                not_escape = V::mask_andnot(cycle, not_escape);
+            }
+
+            const int now = V::bits(not_escape);
+            if (now != live &&
+                (now == 0 || (k % REFILL_CHECK == 0 && (more || queued > 0) &&
+                              lanes_set(live & ~now) >= wait)))
+                break;
+        }
+
+        V::store(steps, iterations);
+        if (SMOOTH)
+            V::store(fractions, fraction<V>(escape_dist));
+        V::store_real(x, vx);
+        V::store_real(y, vy);
+        const int running = V::bits(not_escape);
+        const int cycle_bits = V::bits(cycled);
+
+        for (int j = 0; j < W; j++) {
+            if (out[j] == NULL)
+                continue;
+
+            count[j] += steps[j];
+            if (cycle_bits & (1 << j)) {
+                *out[j] = max_its;
+            } else if (!(running & (1 << j)) || (int)count[j] >= max_its) {
+                *out[j] = SMOOTH ? count[j] + fractions[j] : count[j];
+            } else {
+                /*
+                 * Lanes half way to their save take it now as well, so
+                 * that they do not each stop the loop
+                 */
+                if (PERIODICITY && 2 * (int)count[j] >= next_save[j]) {
+                    saved_x[j] = x[j];
+                    saved_y[j] = y[j];
+                    next_save[j] = 2 * count[j];
+                }
+                continue;
+            }
+            out[j] = NULL;
+            busy--;
+        }
+    }
+    probe.done(W);
+}
+
+/*
+ * Entry points: turn the formula and the flags into template arguments,
+ * and stream the points through the lanes unless refilling is off. The
+ * bulbs are only tested for formulas they apply to, and fractions only
+ * computed for those of degree 2.
+ */
+template <class V, class F, bool SMOOTH, class S>
+inline void stream_early_outs(S *src, const kernel_params *kp)
+{
+    const F f(kp);
+    const bool bulbs = (kp->flags & KERNEL_BULBS) != 0;
+    const bool periodicity = (kp->flags & KERNEL_PERIODICITY) != 0;
+    const int max_its = kp->max_its;
+
+    if (bulbs && periodicity)
+        mandel_stream<V, F, F::BULBS, true, SMOOTH>(src, f, max_its);
+    else if (bulbs)
+        mandel_stream<V, F, F::BULBS, false, SMOOTH>(src, f, max_its);
+    else if (periodicity)
+        mandel_stream<V, F, false, true, SMOOTH>(src, f, max_its);
+    else
+        mandel_stream<V, F, false, false, SMOOTH>(src, f, max_its);
+}
+
+template <class V, class F, class S>
+inline void stream_formula(S *src, const kernel_params *kp)
+{
+    if (kp->flags & KERNEL_SMOOTH)
+        stream_early_outs<V, F, F::DEGREE == 2>(src, kp);
+    else
+        stream_early_outs<V, F, false>(src, kp);
+}
+
+template <class V, class S>
+inline void mandel_stream(S *src, const kernel_params *kp)
+{
+    switch (kp->formula) {
+    case FORMULA_MANDELBROT:
+        stream_formula<V, mandelbrot_formula<V> >(src, kp);
+        break;
+    case FORMULA_JULIA:
+        stream_formula<V, julia_formula<V> >(src, kp);
+        break;
+    case FORMULA_CUBIC:
+        stream_formula<V, cubic_formula<V> >(src, kp);
+        break;
+    case FORMULA_QUARTIC:
+        stream_formula<V, quartic_formula<V> >(src, kp);
+        break;
+    case FORMULA_BURNING_SHIP:
+        stream_formula<V, burning_ship_formula<V> >(src, kp);
+        break;
+    }
+}
+
+template <class V, class F, bool SMOOTH>
+inline void block_early_outs(typename V::real x0, typename V::real dx,
+                             const typename V::real *y, int first, int w,
+                             int h, const kernel_params *kp, uint32_t *its,
+                             int pitch)
+{
+    const F f(kp);
+    const bool bulbs = (kp->flags & KERNEL_BULBS) != 0;
+    const bool periodicity = (kp->flags & KERNEL_PERIODICITY) != 0;
+    const int max_its = kp->max_its;
+
+    for (int j = 0; j < h; j++) {
+        uint32_t *row = its + j*pitch;
+
+        if (bulbs && periodicity)
+            mandel_row<V, F, F::BULBS, true, SMOOTH>(f, x0, dx, y[j], first,
+                                                     w, max_its, row);
+        else if (bulbs)
+            mandel_row<V, F, F::BULBS, false, SMOOTH>(f, x0, dx, y[j], first,
+                                                      w, max_its, row);
+        else if (periodicity)
+            mandel_row<V, F, false, true, SMOOTH>(f, x0, dx, y[j], first, w,
+                                                  max_its, row);
+        else
+            mandel_row<V, F, false, false, SMOOTH>(f, x0, dx, y[j], first, w,
+                                                   max_its, row);
+    }
+}
+
+template <class V, class F>
+inline void block_formula(typename V::real x0, typename V::real dx,
+                          const typename V::real *y, int first, int w, int h,
+                          const kernel_params *kp, uint32_t *its, int pitch)
+{
+    if (kp->flags & KERNEL_SMOOTH)
+        block_early_outs<V, F, F::DEGREE == 2>(x0, dx, y, first, w, h, kp,
+                                               its, pitch);
+    else
+        block_early_outs<V, F, false>(x0, dx, y, first, w, h, kp, its,
+                                      pitch);
+}
+
+template <class V, class F, bool SMOOTH>
+inline void points_early_outs(const typename V::real *x,
+                              const typename V::real *y, int n,
+                              const kernel_params *kp, uint32_t *its)
+{
+    const F f(kp);
+    const bool bulbs = (kp->flags & KERNEL_BULBS) != 0;
+    const bool periodicity = (kp->flags & KERNEL_PERIODICITY) != 0;
+    const int max_its = kp->max_its;
+
+    if (bulbs && periodicity)
+        mandel_points<V, F, F::BULBS, true, SMOOTH>(f, x, y, n, max_its,
+                                                    its);
+    else if (bulbs)
+        mandel_points<V, F, F::BULBS, false, SMOOTH>(f, x, y, n, max_its,
+                                                     its);
+    else if (periodicity)
+        mandel_points<V, F, false, true, SMOOTH>(f, x, y, n, max_its, its);
+    else
+        mandel_points<V, F, false, false, SMOOTH>(f, x, y, n, max_its, its);
+}
+
+template <class V, class F>
+inline void points_formula(const typename V::real *x,
+                           const typename V::real *y, int n,
+                           const kernel_params *kp, uint32_t *its)
+{
+    if (kp->flags & KERNEL_SMOOTH)
+        points_early_outs<V, F, F::DEGREE == 2>(x, y, n, kp, its);
+    else
+        points_early_outs<V, F, false>(x, y, n, kp, its);
+}
+
+template <class V>
+inline void mandel_block(typename V::real x0, typename V::real dx,
+                         const typename V::real *y, int first, int w, int h,
+                         const kernel_params *kp, uint32_t *its, int pitch)
+{
+    if (kp->flags & KERNEL_REFILL) {
+        block_source<V> src;
+
+        src.x0 = x0;
+        src.dx = dx;
+        src.y = y;
+        src.first = first;
+        src.width = w;
+        src.height = w > 0 ? h : 0;
+        src.its = its;
+        src.pitch = pitch;
+        src.row = 0;
+        src.col = 0;
+        mandel_stream<V>(&src, kp);
+        return;
+    }
+
+    switch (kp->formula) {
+    case FORMULA_MANDELBROT:
+        block_formula<V, mandelbrot_formula<V> >(x0, dx, y, first, w, h, kp,
+                                                 its, pitch);
+        break;
+    case FORMULA_JULIA:
+        block_formula<V, julia_formula<V> >(x0, dx, y, first, w, h, kp, its,
+                                            pitch);
+        break;
+    case FORMULA_CUBIC:
+        block_formula<V, cubic_formula<V> >(x0, dx, y, first, w, h, kp, its,
+                                            pitch);
+        break;
+    case FORMULA_QUARTIC:
+        block_formula<V, quartic_formula<V> >(x0, dx, y, first, w, h, kp,
+                                              its, pitch);
+        break;
+    case FORMULA_BURNING_SHIP:
+        block_formula<V, burning_ship_formula<V> >(x0, dx, y, first, w, h,
+                                                   kp, its, pitch);
+        break;
+    }
+}
+
+template <class V>
+inline void mandel_row(typename V::real x0, typename V::real dx,
+                       typename V::real y, int first, int n,
+                       const kernel_params *kp, uint32_t *its)
+{
+    mandel_block<V>(x0, dx, &y, first, n, 1, kp, its, n);
+}
+
+template <class V>
+inline void mandel_points(const typename V::real *x,
+                          const typename V::real *y, int n,
+                          const kernel_params *kp, uint32_t *its)
+{
+    if (kp->flags & KERNEL_REFILL) {
+        points_source<V> src;
+
+        src.x = x;
+        src.y = y;
+        src.n = n;
+        src.its = its;
+        src.i = 0;
+        mandel_stream<V>(&src, kp);
+        return;
+    }
+
+    switch (kp->formula) {
+    case FORMULA_MANDELBROT:
+        points_formula<V, mandelbrot_formula<V> >(x, y, n, kp, its);
+        break;
+    case FORMULA_JULIA:
+        points_formula<V, julia_formula<V> >(x, y, n, kp, its);
+        break;
+    case FORMULA_CUBIC:
+        points_formula<V, cubic_formula<V> >(x, y, n, kp, its);
+        break;
+    case FORMULA_QUARTIC:
+        points_formula<V, quartic_formula<V> >(x, y, n, kp, its);
+        break;
+    case FORMULA_BURNING_SHIP:
+        points_formula<V, burning_ship_formula<V> >(x, y, n, kp, its);
+        break;
+    }
+}
+
+/*
+ * Perturbation: with z = Z + dz and c = C + dc, where Z is the reference
+ * orbit of C,
+ *
+ *     dz' = 2*Z*dz + dz^2 + dc
+ *
+ * The deltas are kept in units of s = ref->scale (so they stay far from the
+ * bottom of the double exponent range however deep the zoom), which gives
+ *
+ *     dz' = 2*Z*dz + s*dz^2 + dc,   z = Z + s*dz
+ *
+ * All lanes step through the reference orbit together. A lane whose |z|
+ * becomes much smaller than |Z| has lost its precision, and one that is
+ * still running when the reference escapes has no more orbit to follow;
+ * both are marked in glitched and stop. Neither has escaped, so neither
+ * gets a fraction with SMOOTH.
+ *
+ * Lanes start at step ref->skip, from the series for dz there, as if they
+ * had already taken skip - 1 iterations.
+ */
+template <class V, bool SMOOTH>
+inline typename V::vi perturb_member(const reference_orbit *ref,
+                                     typename V::vf dcx, typename V::vf dcy,
+                                     int max_its, typename V::mask *glitched)
+{
+    const typename V::vf dist_limit = V::set1(4.0);
+    const typename V::vf s = V::set1(ref->scale);
+
+    typename V::vf a = dcx;     // dz_1 = dc
+    typename V::vf b = dcy;
+    typename V::vi iterations = V::zero_i();
+    int k = 1;
+
+    if (ref->skip > 1) {
+        // dz_skip = ((C*dc + B)*dc + A)*dc
+        const typename V::vf cx = V::set1(ref->cx);
+        const typename V::vf cy = V::set1(ref->cy);
+        typename V::vf tx = V::add(V::sub(V::mul(cx, dcx), V::mul(cy, dcy)),
+                                   V::set1(ref->bx));
+        typename V::vf ty = V::add(V::add(V::mul(cx, dcy), V::mul(cy, dcx)),
+                                   V::set1(ref->by));
+        const typename V::vf ux = V::add(V::sub(V::mul(tx, dcx),
+                                                V::mul(ty, dcy)),
+                                         V::set1(ref->ax));
+        const typename V::vf uy = V::add(V::add(V::mul(tx, dcy),
+                                                V::mul(ty, dcx)),
+                                         V::set1(ref->ay));
+
+        a = V::sub(V::mul(ux, dcx), V::mul(uy, dcy));
+        b = V::add(V::mul(ux, dcy), V::mul(uy, dcx));
+        k = ref->skip;
+        // In every lane
+        iterations = V::fill(iterations, V::lt(V::set1(0.0), V::set1(1.0)),
+                             k - 1);
+    }
+
+    typename V::vf sa = V::mul(s, a);
+    typename V::vf sb = V::mul(s, b);
+    typename V::vf zx = V::add(V::set1(ref->x[k]), sa);
+    typename V::vf zy = V::add(V::set1(ref->y[k]), sb);
+
+    typename V::vf escape_dist = V::add(V::mul(zx, zx), V::mul(zy, zy));
+    typename V::mask not_escape = V::lt(escape_dist, dist_limit);
+    *glitched = V::none();
+    kernel_probe probe;
+
+    for (int n = k - 1; n < max_its && V::any(not_escape); n++) {
+        if (k >= ref->length) {
+            // The reference escaped before these points did
+            *glitched = V::mask_or(*glitched, not_escape);
+            break;
+        }
+
+        probe.step(V::bits(not_escape));
+        iterations = V::inc(iterations, not_escape);
+
+        const typename V::vf ref_x = V::set1(ref->x[k]);
+        const typename V::vf ref_y = V::set1(ref->y[k]);
+
+        // 2*Z*dz
+        typename V::vf na = V::sub(V::mul(ref_x, a), V::mul(ref_y, b));
+        typename V::vf nb = V::add(V::mul(ref_x, b), V::mul(ref_y, a));
+        na = V::add(na, na);
+        nb = V::add(nb, nb);
+
+        /*
+         * + s*dz^2 + dc, as (s*dz)*dz since dz itself may be close to
+         * 1/s, and squaring it would overflow
+         */
+        typename V::vf sab = V::mul(sa, b);
+        na = V::add(na, V::sub(V::mul(sa, a), V::mul(sb, b)));
+        nb = V::add(nb, V::add(sab, sab));
+        a = V::add(na, dcx);
+        b = V::add(nb, dcy);
+
+        k++;
+        sa = V::mul(s, a);
+        sb = V::mul(s, b);
+        zx = V::add(V::set1(ref->x[k]), sa);
+        zy = V::add(V::set1(ref->y[k]), sb);
+
+        typename V::vf dist = V::add(V::mul(zx, zx), V::mul(zy, zy));
+        if (SMOOTH)
+            escape_dist = V::select(not_escape, dist, escape_dist);
+        not_escape = V::mask_and(not_escape, V::lt(dist, dist_limit));
+
+        typename V::mask glitch = V::mask_and(not_escape,
+                                              V::lt(dist,
+                                                    V::set1(ref->tol[k])));
+        *glitched = V::mask_or(*glitched, glitch);
+        not_escape = V::mask_andnot(glitch, not_escape);
+    }
+
+    probe.done(V::WIDTH);
+    if (SMOOTH)
+        iterations = V::add_i(iterations, fraction<V>(escape_dist));
+    return iterations;
+}
+
+// perturb_member with the flags of kp
+template <class V>
+inline typename V::vi perturb_vector(const reference_orbit *ref,
+                                     typename V::vf dcx, typename V::vf dcy,
+                                     const kernel_params *kp,
+                                     typename V::mask *glitched)
+{
+    if (kp->flags & KERNEL_SMOOTH)
+        return perturb_member<V, true>(ref, dcx, dcy, kp->max_its, glitched);
+    return perturb_member<V, false>(ref, dcx, dcy, kp->max_its, glitched);
+}
+
+template <class V>
+inline void perturb_store(uint32_t *its, typename V::vi iterations,
+                          typename V::mask glitched, int n)
+{
+    uint32_t lanes[V::WIDTH];
+    const int glitch_bits = V::bits(glitched);
+
+    V::store(lanes, iterations);
+    for (int j = 0; j < n; j++) {
+        its[j] = lanes[j];
+        if (glitch_bits & (1 << j))
+            its[j] |= GLITCHED;
+    }
+}
+
+template <class V>
+inline void perturb_row(const reference_orbit *ref, double x0, double dx,
+                        double y, int first, int n, const kernel_params *kp,
+                        uint32_t *its)
+{
+    const typename V::vf dcy = V::set1(y);
+    typename V::mask glitched;
+
+    for (int i = 0; i < n; i += V::WIDTH) {
+        typename V::vi iterations = perturb_vector<V>(ref,
+                                                      V::ramp(x0, dx,
+                                                              first + i),
+                                                      dcy, kp, &glitched);
+        perturb_store<V>(its + i, iterations, glitched,
+                         n - i < V::WIDTH ? n - i : V::WIDTH);
+    }
+}
+
+template <class V>
+inline void perturb_points(const reference_orbit *ref, const double *x,
+                           const double *y, int n, const kernel_params *kp,
+                           uint32_t *its)
+{
+    typename V::mask glitched;
+    int i;
+
+    for (i = 0; i + V::WIDTH <= n; i += V::WIDTH) {
+        typename V::vi iterations = perturb_vector<V>(ref, V::load(x + i),
+                                                      V::load(y + i), kp,
+                                                      &glitched);
+        perturb_store<V>(its + i, iterations, glitched, V::WIDTH);
+    }
+
+    if (i < n) {
+        double tail_x[V::WIDTH], tail_y[V::WIDTH];
+
+        for (int j = 0; j < V::WIDTH; j++) {
+            tail_x[j] = x[i + (i + j < n ? j : 0)];
+            tail_y[j] = y[i + (i + j < n ? j : 0)];
+        }
+
+        typename V::vi iterations = perturb_vector<V>(ref, V::load(tail_x),
+                                                      V::load(tail_y), kp,
+                                                      &glitched);
+        perturb_store<V>(its + i, iterations, glitched, n - i);
+    }
+}
+
+} // namespace
+
+#endif // KERNEL_IMPL_H
@@ -0,0 +1,234 @@
+/*
+ * kernel_sse2.cc
+ *
+ * SSE2 instantiations of the escape-time kernels (4 floats or 2 doubles per
+ * vector). This is the baseline for x86-64 and is always available.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdint.h>
+
+// SSE Intrinsics
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+#include "kernel.h"
+
+namespace {
+
+struct sse2 {
+    enum { WIDTH = 4 };
+
+    typedef float real;
+    typedef __m128 vf;
+    typedef __m128i vi;
+    typedef __m128 mask;
+
+    static inline vf set1(float f) { return _mm_set1_ps(f); }
+    static inline vf load(const float *p) { return _mm_loadu_ps(p); }
+
+    static inline vf ramp(float x0, float dx, int i)
+    {
+        vf idx4 = _mm_add_ps(_mm_set1_ps((float)i),
+                             _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+        return _mm_add_ps(_mm_mul_ps(idx4, _mm_set1_ps(dx)), _mm_set1_ps(x0));
+    }
+
+    static inline vf add(vf a, vf b) { return _mm_add_ps(a, b); }
+    static inline vf sub(vf a, vf b) { return _mm_sub_ps(a, b); }
+    static inline vf mul(vf a, vf b) { return _mm_mul_ps(a, b); }
+    static inline vf abs(vf a)
+    {
+        return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+    }
+
+    static inline mask lt(vf a, vf b) { return _mm_cmplt_ps(a, b); }
+    static inline mask eq(vf a, vf b) { return _mm_cmpeq_ps(a, b); }
+    static inline mask mask_and(mask a, mask b) { return _mm_and_ps(a, b); }
+    static inline mask mask_or(mask a, mask b) { return _mm_or_ps(a, b); }
+    static inline mask mask_andnot(mask a, mask b)
+    {
+        return _mm_andnot_ps(a, b);
+    }
+    static inline mask none() { return _mm_setzero_ps(); }
+    static inline int bits(mask m) { return _mm_movemask_ps(m); }
+    static inline bool any(mask m) { return _mm_movemask_ps(m) != 0; }
+
+    static inline vi zero_i() { return _mm_setzero_si128(); }
+
+    /*
+     * Set lanes of the mask are 0xFFFFFFFF, the 2's complement of -1, so
+     * subtracting the mask increments exactly those lanes
+     */
+    static inline vi inc(vi v, mask m)
+    {
+        return _mm_sub_epi32(v, _mm_castps_si128(m));
+    }
+
+    static inline vi fill(vi v, mask m, int i)
+    {
+        const __m128i mi = _mm_castps_si128(m);
+
+        return _mm_or_si128(_mm_andnot_si128(mi, v),
+                            _mm_and_si128(mi, _mm_set1_epi32(i)));
+    }
+
+    static inline vf select(mask m, vf a, vf b)
+    {
+        return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+    }
+    static inline vi to_int(vf v) { return _mm_cvttps_epi32(v); }
+    static inline vi add_i(vi a, vi b) { return _mm_add_epi32(a, b); }
+    static inline vi shl_i(vi v, int n) { return _mm_slli_epi32(v, n); }
+
+    static inline void store(uint32_t *p, vi v)
+    {
+        _mm_storeu_si128((__m128i *)p, v);
+    }
+
+    static inline void store_real(float *p, vf v) { _mm_storeu_ps(p, v); }
+};
+
+
+/* Double precision, 2 points per vector with 64 bit iteration counters */
+struct sse2_d {
+    enum { WIDTH = 2 };
+
+    typedef double real;
+    typedef __m128d vf;
+    typedef __m128i vi;
+    typedef __m128d mask;
+
+    static inline vf set1(double f) { return _mm_set1_pd(f); }
+    static inline vf load(const double *p) { return _mm_loadu_pd(p); }
+
+    static inline vf ramp(double x0, double dx, int i)
+    {
+        vf idx2 = _mm_add_pd(_mm_set1_pd((double)i), _mm_setr_pd(0.0, 1.0));
+        return _mm_add_pd(_mm_mul_pd(idx2, _mm_set1_pd(dx)), _mm_set1_pd(x0));
+    }
+
+    static inline vf add(vf a, vf b) { return _mm_add_pd(a, b); }
+    static inline vf sub(vf a, vf b) { return _mm_sub_pd(a, b); }
+    static inline vf mul(vf a, vf b) { return _mm_mul_pd(a, b); }
+    static inline vf abs(vf a)
+    {
+        return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+    }
+
+    static inline mask lt(vf a, vf b) { return _mm_cmplt_pd(a, b); }
+    static inline mask eq(vf a, vf b) { return _mm_cmpeq_pd(a, b); }
+    static inline mask mask_and(mask a, mask b) { return _mm_and_pd(a, b); }
+    static inline mask mask_or(mask a, mask b) { return _mm_or_pd(a, b); }
+    static inline mask mask_andnot(mask a, mask b)
+    {
+        return _mm_andnot_pd(a, b);
+    }
+    static inline mask none() { return _mm_setzero_pd(); }
+    static inline int bits(mask m) { return _mm_movemask_pd(m); }
+    static inline bool any(mask m) { return _mm_movemask_pd(m) != 0; }
+
+    static inline vi zero_i() { return _mm_setzero_si128(); }
+
+    static inline vi inc(vi v, mask m)
+    {
+        return _mm_sub_epi64(v, _mm_castpd_si128(m));
+    }
+
+    static inline vi fill(vi v, mask m, int i)
+    {
+        const __m128i mi = _mm_castpd_si128(m);
+
+        return _mm_or_si128(_mm_andnot_si128(mi, v),
+                            _mm_and_si128(mi, _mm_set1_epi64x(i)));
+    }
+
+    static inline vf select(mask m, vf a, vf b)
+    {
+        return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));
+    }
+
+    // The two 32 bit results widened to the counters, as they are positive
+    static inline vi to_int(vf v)
+    {
+        return _mm_unpacklo_epi32(_mm_cvttpd_epi32(v), _mm_setzero_si128());
+    }
+    static inline vi add_i(vi a, vi b) { return _mm_add_epi64(a, b); }
+    static inline vi shl_i(vi v, int n) { return _mm_slli_epi64(v, n); }
+
+    // Keep the low half of each counter
+    static inline void store(uint32_t *p, vi v)
+    {
+        _mm_storel_epi64((__m128i *)p,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+
+    static inline void store_real(double *p, vf v) { _mm_storeu_pd(p, v); }
+};
+
+} // namespace
+
+#include "kernel_impl.h"
+
+static void row_sse2(float x0, float dx, float y, int first, int n,
+                     const kernel_params *kp, uint32_t *its)
+{
+    mandel_row<sse2>(x0, dx, y, first, n, kp, its);
+}
+
+static void row_d_sse2(double x0, double dx, double y, int first, int n,
+                       const kernel_params *kp, uint32_t *its)
+{
+    mandel_row<sse2_d>(x0, dx, y, first, n, kp, its);
+}
+
+static void block_sse2(float x0, float dx, const float *y, int first,
+                       int w, int h, const kernel_params *kp,
+                       uint32_t *its, int pitch)
+{
+    mandel_block<sse2>(x0, dx, y, first, w, h, kp, its, pitch);
+}
+
+static void block_d_sse2(double x0, double dx, const double *y,
+                         int first, int w, int h, const kernel_params *kp,
+                         uint32_t *its, int pitch)
+{
+    mandel_block<sse2_d>(x0, dx, y, first, w, h, kp, its, pitch);
+}
+
+static void points_sse2(const float *x, const float *y, int n,
+                        const kernel_params *kp, uint32_t *its)
+{
+    mandel_points<sse2>(x, y, n, kp, its);
+}
+
+static void points_d_sse2(const double *x, const double *y, int n,
+                          const kernel_params *kp, uint32_t *its)
+{
+    mandel_points<sse2_d>(x, y, n, kp, its);
+}
+
+static void perturb_row_sse2(const reference_orbit *ref, double x0, double dx,
+                             double y, int first, int n,
+                             const kernel_params *kp, uint32_t *its)
+{
+    perturb_row<sse2_d>(ref, x0, dx, y, first, n, kp, its);
+}
+
+static void perturb_points_sse2(const reference_orbit *ref, const double *x,
+                                const double *y, int n,
+                                const kernel_params *kp, uint32_t *its)
+{
+    perturb_points<sse2_d>(ref, x, y, n, kp, its);
+}
+
+const kernel kernel_sse2 = {
+    "sse2", sse2::WIDTH,
+    row_sse2, row_d_sse2, block_sse2, block_d_sse2,
+    points_sse2, points_d_sse2,
+    perturb_row_sse2, perturb_points_sse2
+};
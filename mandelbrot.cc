@@ -29,317 +29,711 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <stdint.h>
-
-// SSE Intrinsics
-#include <xmmintrin.h>
-#include <emmintrin.h>
+#include <vector>
 
 #include <omp.h> // OpenMP
 
 #include <SDL/SDL.h>
 
-const int X_RES = 700;          // horizontal resolution
-const int Y_RES = 700;          // vertical resolution
+#include "kernel.h"
+#include "fixedpoint.h"
+#include "render.h"
+#include "output.h"
+#include "config.h"
+#include "bench.h"
+#include "incremental.h"
+#include "async.h"
+#include "navigate.h"
+#include "budget.h"
+#include "distribute.h"
+#include "gpu.h"
+#include "store.h"
+#include "antialias.h"
+#include "pipeline.h"
+#include "instrument.h"
+#include "placement.h"
+#include "tiles.h"
+#include "server.h"
+
+const int FRAME_RATE = 30;      // of streamed video
+const int POSTER_STRIP = 1 << 22;   // pixels in a strip of a poster, about
 
-const int MAX_ITS = 500;       // Max iterations to check if a point escapes
-const int MAX_DEPTH = 150;      // max depth of zoom
-const float ZOOM_FACTOR = 1.07; // zoom between each frame
 
-/* Part of the image to zoom in on */
-const float PX = -0.702295281061;     // real component
-const float PY = +0.350220783400;     // imaginary component
+/*
+ * Print how each thread spent the frame, to compare schedulers and
+ * scaling
+ */
+void print_thread_stats(int depth, const std::vector<thread_stats> &stats)
+{
+    double busy = 0.0, idle = 0.0;
 
-const __m128i     MAX_ITERATIONS_4 = _mm_set1_epi32(MAX_ITS);
-const __m128    DIST_LIMIT_4 = _mm_set1_ps(4.0f);
+    for (size_t t = 0; t < stats.size(); t++) {
+        busy += stats[t].busy;
+        idle += stats[t].idle;
+    }
+    fprintf(stderr, "frame %d: %d threads, %.1f%% busy\n", depth,
+            (int)stats.size(), 100.0 * busy / (busy + idle));
 
+    for (size_t t = 0; t < stats.size(); t++) {
+        fprintf(stderr, "  thread %d: busy %.2f ms, idle %.2f ms, %d tiles,"
+                " %d stolen\n", (int)t, 1e3 * stats[t].busy,
+                1e3 * stats[t].idle, stats[t].tiles, stats[t].steals);
+    }
+}
 
 /*
- * Color Palette
+ * Compute the counts of the next frame, incrementally from the last one if
+ * configured
  */
-unsigned char pal[] = {
-    0, 0, 0,
-    255, 180, 4,
-    240, 156, 4,
-    220, 124, 4,
-    156, 71, 4,
-    72, 20, 4,
-    251, 180, 4,
-    180, 74, 4,
-    180, 70, 4,
-    164, 91, 4,
-    100, 28, 4,
-    191, 82, 4,
-    47, 5, 4,
-    138, 39, 4,
-    81, 27, 4,
-    192, 89, 4,
-    61, 27, 4,
-    216, 148, 4,
-    71, 14, 4,
-    142, 48, 4,
-    196, 102, 4,
-    58, 9, 4,
-    132, 45, 4,
-    95, 15, 4,
-    92, 21, 4,
-    166, 59, 4,
-    244, 178, 4,
-    194, 121, 4,
-    120, 41, 4,
-    53, 14, 4,
-    80, 15, 4,
-    23, 3, 4,
-    249, 204, 4,
-    97, 25, 4,
-    124, 30, 4,
-    151, 57, 4,
-    104, 36, 4,
-    239, 171, 4,
-    131, 57, 4,
-    111, 23, 4,
-    4, 2, 4,
-    255, 180, 4,
-    240, 156, 4,
-    220, 124, 4,
-    156, 71, 4,
-    72, 20, 4,
-    251, 180, 4,
-    180, 74, 4,
-    180, 70, 4,
-    164, 91, 4,
-    100, 28, 4,
-    191, 82, 4,
-    47, 5, 4,
-    138, 39, 4,
-    81, 27, 4,
-    192, 89, 4,
-    61, 27, 4,
-    216, 148, 4,
-    71, 14, 4,
-    142, 48, 4,
-    196, 102, 4,
-    58, 9, 4,
-    132, 45, 4,
-    95, 15, 4,
-    92, 21, 4,
+void count_frame(render_params *p, const config *c, incremental_state *inc,
+                 int depth, uint32_t *its, int pitch)
+{
+    if (c->incremental) {
+        incremental_stats is;
+
+        render_incremental(inc, &c->inc, p, its, pitch, &is);
+        if (c->stats) {
+            fprintf(stderr, "frame %d: %s, %d computed, %d reused (%.1f%%)",
+                    depth, is.keyframe ? "keyframe" : "incremental",
+                    is.computed, is.reused,
+                    100.0 * is.reused / (is.computed + is.reused));
+            if (c->inc.verify && !is.keyframe)
+                fprintf(stderr, ", %d wrong", is.errors);
+            fprintf(stderr, "\n");
+        }
+    } else {
+        std::vector<thread_stats> stats;
 
-};
-const int PAL_SIZE = 40;        // Number of entries in the palette 
+        render_iterations(p, its, pitch, c->stats ? &stats : NULL);
+        if (c->stats && !stats.empty())
+            print_thread_stats(depth, stats);
+    }
+}
 
+/*
+ * Colour the counts of the frame at depth into pixels, anti-aliased if
+ * configured (in which case the two must be different buffers)
+ */
+void color_frame(const render_params *p, const config *c, int depth,
+                 const uint32_t *its, uint32_t *pixels)
+{
+    aa_stats aa;
 
+    if (c->aa_grid == 0) {
+        render_colors(p, its, p->width, pixels, p->width);
+        return;
+    }
 
-inline void putpixel(SDL_Surface *surface, int x, int y, uint8_t r, uint8_t g,
-                     uint8_t b)
-{
-	uint32_t *pix_buf = (Uint32*)surface->pixels;
-	const uint32_t pixel = (r << 16) + (g << 8) + b;
-	const int line_offset = y * (surface->pitch >> 2);
+    render_antialiased(p, c->aa_grid, its, p->width, pixels, p->width, &aa);
+    if (c->stats) {
+        fprintf(stderr, "frame %d: %.1f%% of pixels at edges, %.1f%% "
+                "resampled, %.1f%% with the grid, %.2f samples per pixel\n",
+                depth, 100.0 * aa.edges / aa.pixels,
+                100.0 * aa.resampled / aa.pixels,
+                100.0 * aa.refined / aa.pixels,
+                1.0 + (double)aa.samples / aa.pixels);
+    }
+}
 
-	pix_buf[line_offset + x] = pixel;
+/*
+ * With --adaptive, set the iteration limit of the frame after depth from
+ * the census of the frame at depth
+ */
+void adapt_budget(render_params *p, const config *c, budget_state *b,
+                  int depth, const budget_census *census)
+{
+    p->kp.max_its = next_budget(b, pow(c->zoom_factor, depth + 1), census);
+    if (c->stats) {
+        fprintf(stderr, "frame %d: max_its %d, %.1f%% inside, %.2f%% near "
+                "the limit\n", depth, census->max_its,
+                100.0 * census->inside / census->pixels,
+                100.0 * census->near_limit / census->pixels);
+    }
 }
 
-/* 
- * Determine concurrently whether 4 points are members of the mandelbrot set
- * by checking whether they exceed a distance limit within a bounded number
- * of iterations. A packed integer vector is returned containing the number
- * of iterations executed for each point (in the corresponding position).
+/*
+ * What the frame at depth 0 shows. Pixels are square, 4 / min(width,
+ * height) wide, and zooming divides their size by the zoom factor each
+ * frame.
  */
-inline __m128i member4(__m128 cx4, __m128 cy4)
+void initial_params(render_params *p, const config *c, gpu_device *gpu)
 {
-    // We proceed in reverse down to 0
-    __m128i iterations4 = MAX_ITERATIONS_4;
-
-    __m128 x4 = cx4;
-    __m128 y4 = cy4;
-    __m128 x_sq4 = _mm_mul_ps(x4, x4);
-    __m128 y_sq4 = _mm_mul_ps(y4, y4);
-    __m128 aux4_a = _mm_add_ps(x_sq4, y_sq4);
-    __m128i aux4_b;
-    __m128i zero4 = _mm_setzero_si128();
-    __m128i not_escape4;
+    // Widest SIMD kernel this CPU supports (SSE2, AVX2 or AVX-512)
+    p->kern = c->kernel.empty() ? select_kernel()
+                                : find_kernel(c->kernel.c_str());
+    p->kp.max_its = c->max_its;
+    p->kp.flags = c->kernel_flags;
+    p->kp.formula = c->formula;
+    p->kp.julia_x = c->julia_x;
+    p->kp.julia_y = c->julia_y;
+
+    p->center_x = fixed_point::from_string(c->center_x.c_str());
+    p->center_y = fixed_point::from_string(c->center_y.c_str());
 
-    
-    aux4_a = _mm_cmplt_ps(aux4_a, DIST_LIMIT_4);
-    not_escape4 = (__m128i)aux4_a; // used to track
+    // Deltas
+    p->delta_x = 4.0 / (c->width < c->height ? c->width : c->height);
+    p->delta_y = p->delta_x;
+
+    p->width = c->width;
+    p->height = c->height;
+    p->mode = c->mode;
+    p->gpu = gpu;
+    p->store = c->store_path.empty() ? NULL
+                                     : open_store(c->store_path.c_str());
+    p->col = c->col;
+}
 
-    /*
-     * For all elements that have escaped, their corresponding value in
-     * not_escape4 = 0. Otherwise is is 0xFFFFFFFF
-     */
+/* The GPU asked for, or NULL to compute on the CPU */
+gpu_device *open_backend(const config *c)
+{
+    gpu_device *gpu = NULL;
 
-    // Mask away iterations of elements that have escaped
-    aux4_b = _mm_and_si128(not_escape4, iterations4);
+    if (c->backend == "opencl" && (gpu = open_gpu()) == NULL)
+        fprintf(stderr, "Rendering on the CPU instead\n");
+    return gpu;
+}
 
-    // Check that the iterations have not reached 0
-    aux4_b = _mm_cmpeq_epi32(aux4_b, zero4);
-    int mask = _mm_movemask_epi8(aux4_b);
-    while (mask != 0xFFFF) {
-        /*
-         * For all non-escaped points, 0xFFFFFFFF is in respective position
-         * of not_escape4. This number is the 2's complement of -1. Adding to
-         * iterations4 therefore decrements. But iteration count of escaped
-         * points is preserved (since respective position of not_escape4 is 0)
-         */
-         
-        iterations4 = _mm_add_epi32(iterations4, not_escape4);
+// Palette cycling, once per frame shown
+void cycle_colors(render_params *p, const config *c)
+{
+    p->col.offset = (p->col.offset + c->cycle) % p->col.pal->size;
+}
 
-        y4 = _mm_mul_ps(x4, y4); // x * y
-        y4 = _mm_add_ps(y4, y4); // (x * y) + (x * y) = 2*x*y
-        y4 = _mm_add_ps(y4, cy4); // 2*x*y + cy
+/* Advance p by a frame, until the configured depth is reached */
+bool zoom_in(render_params *p, const config *c, int *depth)
+{
+    // Zoom (replace dividing by m with multiplying by 1 / zoom_factor)
+    const double zoom_multiplier = 1.0 / c->zoom_factor;
 
-        x4 = _mm_sub_ps(x_sq4, y_sq4); // x*x - y*y
-        x4 = _mm_add_ps(x4, cx4); // (x*x - y*y) + cx
+    if (*depth >= c->max_depth)
+        return false;
 
-        x_sq4 = _mm_mul_ps(x4, x4); // x * x
-        y_sq4 = _mm_mul_ps(y4, y4); // y * y
+    (*depth)++;
+    p->delta_x *= zoom_multiplier;
+    p->delta_y *= zoom_multiplier;
+    return true;
+}
 
-        aux4_a = _mm_add_ps(x_sq4, y_sq4); // x*x + y*y
-        aux4_a = _mm_cmplt_ps(aux4_a, DIST_LIMIT_4); // (x*x + y*y) < 4 (limit)
-        not_escape4 = _mm_and_si128((__m128i)aux4_a, not_escape4);
+/* Render thread hooks */
+struct counter {
+    const config *c;
+    incremental_state inc;
+    nav_view nav;           // anchor of navigation
+    tile_cache *cache;
+};
 
-        aux4_b = _mm_and_si128(not_escape4, iterations4);
-        aux4_b = _mm_cmpeq_epi32(aux4_b, zero4);
-        mask = _mm_movemask_epi8(aux4_b);
-    }
+bool count_async(const render_params *p, int depth, uint32_t *its,
+                 int pitch, progress_cancel cancel, void *cancel_arg,
+                 void *arg)
+{
+    counter *k = (counter *)arg;
+    render_params q = *p;
 
-    return _mm_sub_epi32(MAX_ITERATIONS_4, iterations4);
+    count_frame(&q, k->c, &k->inc, depth, its, pitch);
+    return true;
 }
 
-
-/**
- * TODO: refactor (break up into smaller functions)
- */
-void mandelbrot(SDL_Surface *surface)
+bool count_navigation(const render_params *p, int depth, uint32_t *its,
+                      int pitch, progress_cancel cancel, void *cancel_arg,
+                      void *arg)
 {
-    SDL_Event event; // for handling SDL events
+    counter *k = (counter *)arg;
 
-    // Zoom (replace dividing by m with multiplying by 1 / zoom_factor)
-    const float zoom_multiplier = 1.0f / ZOOM_FACTOR;
-    const __m128 zoom_multiplier4 = _mm_set1_ps(zoom_multiplier);
+    return render_navigation(k->cache, &k->nav, p, its, pitch, cancel,
+                             cancel_arg);
+}
 
-    // Deltas
-    const float delta_x = (1.0f / X_RES) * 4;
-    __m128 delta_x4 = _mm_set1_ps(delta_x * 4); // skipping over 4 points
-    float delta_y = (1.0f / Y_RES) * 4.0f;
+// Wakes up SDL_WaitEvent; SDL_PushEvent may be called from any thread
+void notify_sdl(void *arg)
+{
+    SDL_Event event;
 
-    // Offsets
-    const float center = -0.5f * 4.0f;
-    float y_offset = center;
-    __m128 x_offset4 = _mm_setr_ps(center, center + delta_x,
-                                   center + 2*delta_x, center + 3*delta_x);
+    event.type = SDL_USEREVENT;
+    event.user.code = 0;
+    event.user.data1 = NULL;
+    event.user.data2 = NULL;
+    SDL_PushEvent(&event);
+}
 
-    // Center Translations
-    const __m128 x_translate4 = _mm_set1_ps(PX);
-    //const __m128 y_translate4 = _mm_set1_ps(PY);
-    const __m128i increment4 = _mm_set1_epi32(1);
+/* The SDL front-end, as seen by event handling */
+struct view {
+    SDL_Surface *surface;
+    render_params *p;
+    const config *c;
+    int palette_index;
+    bool new_colors;    // the shown frame needs colouring again
+    bool new_view;      // p has changed and must be rendered
+    bool quit;
+
+    async_setup setup;
+    async_renderer *renderer;
+    const async_frame *shown;   // owned by renderer
+    counter k;
+    budget_state budget;
+
+    bool navigating;    // the zoom has been taken over by the user
+    nav_view nav;
+    bool dragging;
+};
 
-    // Masks
-    const __m128i all_ones_mask4 = _mm_set1_epi32(0xFFFFFFFF);
-    const __m128i mod_mask4 = _mm_set1_epi32(0x3F);
+// In the current colours, but with the iteration limit f was computed with
+void show_counts(view *v, const async_frame *f)
+{
+    SDL_Surface *surface = v->surface;
+    render_params p = *v->p;
+
+    p.kp.max_its = f->p.kp.max_its;
+    if (SDL_MUSTLOCK(surface))
+        SDL_LockSurface(surface);
+    render_colors(&p, &f->its[0], f->p.width, (uint32_t *)surface->pixels,
+                  surface->pitch >> 2);
+    if (SDL_MUSTLOCK(surface))
+        SDL_UnlockSurface(surface);
+
+    // Show the rendered fractal
+    SDL_Flip(surface);
+}
 
+/*
+ * Stop the zoom and navigate from the view last requested. Navigation
+ * renders from the tile cache, so the render thread is started again with
+ * it.
+ */
+void start_navigating(view *v)
+{
+    if (v->navigating)
+        return;
+
+    start_navigation(&v->nav, v->p);
+    v->navigating = true;
+
+    stop_async(v->renderer);
+    v->shown = NULL;
+    v->k.nav = v->nav;
+    v->setup.count = count_navigation;
+    v->setup.show_passes = false;
+    v->renderer = start_async(&v->setup);
+    v->new_view = true;
+}
 
-    int depth = 0;
+void handle_key(view *v, SDLKey key)
+{
+    render_params *p = v->p;
+    const int step = (p->width < p->height ? p->width : p->height) / 8;
+
+    switch (key) {
+    case SDLK_p:
+        v->palette_index = (v->palette_index + 1) % num_palettes();
+        p->col.pal = get_palette(v->palette_index);
+        p->col.offset %= p->col.pal->size;
+        v->new_colors = true;
+        return;
+    case SDLK_h:
+        p->col.histogram = !p->col.histogram;
+        v->new_colors = true;
+        return;
+    case SDLK_ESCAPE:
+        v->quit = true;
+        return;
+    default:
+        break;
+    }
 
-    bool quit = false;
-
-    while (!quit) {
-        const float y_base = PY + y_offset; // translate y
-
-
-        #pragma omp parallel for default(none), shared(surface, pal),\
-                                 firstprivate(delta_y,\
-                                              x_offset4, delta_x4),\
-                                 schedule(guided, 50)
-        
-        for (int hy = 0; hy < Y_RES; hy++) {
-            __m128 y4 = _mm_set1_ps(y_base + hy*delta_y);
-            __m128 x4 = _mm_add_ps(x_translate4, x_offset4);
-
-            for (int hx = 0; hx < X_RES; hx += 4) {
-                /*
-                 * Check if all 4 points are members of mandelbrot set
-                 * member4 returns a vector containing the corresponding
-                 * number of iterations executed, for each point
-                 */
-                __m128i iterations4 = member4(x4, y4);
-
-
-                /*
-                 * There is no neq or lt integer comparisons in SSE2
-                 * Therefore must use eq, and invert using XOR
-                 */
-                __m128i max_mask4 = _mm_cmpeq_epi32(iterations4,
-                                                    MAX_ITERATIONS_4);
-                max_mask4 = _mm_xor_si128(max_mask4, all_ones_mask4);
-
-
-                /*
-                 * Mod 64 is equivilent to ANDing with 0x3F. I expanded the
-                 * color table from 40 to 64 entries, and replicated the first
-                 * 24 in the additonal 24. ANDing with 0x3F is then = mod 40
-                 */
-                iterations4 = _mm_and_si128(iterations4, mod_mask4);
-
-                // Skip first color in the palette (which is black)
-                iterations4 = _mm_add_epi32(iterations4, increment4);
-                
-                /*
-                 * Finally, apply mask to retain nonzero color index if the
-                 * iteration count was less than the escape limit
-                 */
-                iterations4 = _mm_and_si128(iterations4, max_mask4);
-                  
-                union {
-                    __m128i v;
-                    int color_index[4];
-                } u;
-
-                u.v = iterations4;
-
-                for (int j = 0; j < 4; j++) {
-                    int index = u.color_index[j] * 3;
-                    
-                    putpixel(surface, hx + j, hy, pal[index],
-                             pal[index + 1], pal[index + 2]);
-                }
+    start_navigating(v);
+    switch (key) {
+    case SDLK_LEFT:
+        nav_pan(&v->nav, -step, 0);
+        break;
+    case SDLK_RIGHT:
+        nav_pan(&v->nav, step, 0);
+        break;
+    case SDLK_UP:
+        nav_pan(&v->nav, 0, -step);
+        break;
+    case SDLK_DOWN:
+        nav_pan(&v->nav, 0, step);
+        break;
+    case SDLK_PLUS:
+    case SDLK_EQUALS:
+        nav_zoom(&v->nav, 1, 0, 0);
+        break;
+    case SDLK_MINUS:
+        nav_zoom(&v->nav, -1, 0, 0);
+        break;
+    case SDLK_HOME:
+        v->nav.level = 0;
+        v->nav.x = 0;
+        v->nav.y = 0;
+        break;
+    case SDLK_PAGEUP:
+        // At most what parse_args() allows
+        if (p->kp.max_its >= MAX_ITS)
+            return;
+        p->kp.max_its = p->kp.max_its <= MAX_ITS / 2 ? 2 * p->kp.max_its
+                                                     : MAX_ITS;
+        break;
+    case SDLK_PAGEDOWN:
+        if (p->kp.max_its > 1)
+            p->kp.max_its /= 2;
+        break;
+    default:
+        return;
+    }
+    v->new_view = true;
+}
 
-                x4 = _mm_add_ps(x4, delta_x4);
-            }
+void handle_event(view *v, const SDL_Event *event)
+{
+    const int mx = event->button.x - v->p->width / 2;
+    const int my = event->button.y - v->p->height / 2;
+
+    // Act on 
+    switch (event->type) {
+    case SDL_QUIT:
+        v->quit = true;
+        break;
+    case SDL_KEYDOWN:
+        handle_key(v, event->key.keysym.sym);
+        break;
+    case SDL_MOUSEBUTTONDOWN:
+        start_navigating(v);
+        if (event->button.button == SDL_BUTTON_LEFT) {
+            v->dragging = true;
+        } else if (event->button.button == SDL_BUTTON_WHEELUP) {
+            nav_zoom(&v->nav, 1, mx, my);
+            v->new_view = true;
+        } else if (event->button.button == SDL_BUTTON_WHEELDOWN) {
+            nav_zoom(&v->nav, -1, mx, my);
+            v->new_view = true;
         }
+        break;
+    case SDL_MOUSEBUTTONUP:
+        if (event->button.button == SDL_BUTTON_LEFT)
+            v->dragging = false;
+        break;
+    case SDL_MOUSEMOTION:
+        if (v->dragging) {
+            nav_pan(&v->nav, -event->motion.xrel, -event->motion.yrel);
+            v->new_view = true;
+        }
+        break;
+    }
+}
 
-        // Show the rendered fractal
-        SDL_Flip(surface);
+/*
+ * Render the zoom into the SDL surface, and keep showing the last frame
+ * until the window is closed. Frames are rendered on a thread of their
+ * own, so events are handled as they arrive; each frame of the zoom is
+ * requested as soon as the one before it is finished, and is computed
+ * while that one is shown. The counts of the shown frame are kept, so that
+ * changing the colours does not render it again:
+ *
+ *     p                   next palette
+ *     h                   histogram colouring on or off
+ *     Escape              quit
+ *
+ * Navigating takes over from the zoom, from wherever it has got to:
+ *
+ *     drag                pan
+ *     wheel               zoom in or out by 2 around the pointer
+ *     arrows              pan by an eighth of the view
+ *     + and -             zoom in or out by 2
+ *     Home                back to where navigation started
+ *     Page Up/Down        double or halve the iteration limit
+ *
+ * With --progressive every pass of a zoom frame is shown as it is
+ * computed.
+ */
+void mandelbrot(SDL_Surface *surface, render_params *p, const config *c)
+{
+    SDL_Event event; // for handling SDL events
+    int depth = 0;
+    view v;
+
+    v.surface = surface;
+    v.p = p;
+    v.c = c;
+    v.palette_index = 0;
+    v.new_colors = false;
+    v.new_view = false;
+    v.quit = false;
+    v.navigating = false;
+    v.dragging = false;
+    while (p->col.pal != get_palette(v.palette_index))
+        v.palette_index++;
+
+    v.k.c = c;
+    init_incremental(&v.k.inc);
+    v.k.cache = create_tile_cache(c->cache_tiles);
+    init_budget(&v.budget, c->max_its, c->its_limit);
+
+    v.setup.width = p->width;
+    v.setup.height = p->height;
+    v.setup.show_passes = c->progressive;
+    v.setup.interval = 1.0 / FRAME_RATE;
+    v.setup.count = c->progressive ? NULL : count_async;
+    v.setup.count_arg = &v.k;
+    v.setup.notify = notify_sdl;
+    v.setup.notify_arg = NULL;
+
+    v.renderer = start_async(&v.setup);
+    v.shown = NULL;
+    request_frame(v.renderer, p, depth);
+
+    while (!v.quit) {
+        if (v.new_view) {
+            nav_params(&v.nav, p);
+            request_frame(v.renderer, p, -1);
+            v.new_view = false;
+        }
 
+        const async_frame *f = take_frame(v.renderer);
 
-        if (depth < MAX_DEPTH) {
+        if (f != NULL) {
+            v.shown = f;
+            v.new_colors = true;
 
-            depth++;
+            // Start on the next frame of the zoom while this one is shown
+            if (!v.navigating && f->step == 1 && f->depth == depth) {
+                if (c->adaptive) {
+                    budget_census census;
+
+                    take_census(&census, &f->its[0], f->p.width, f->p.width,
+                                f->p.height, f->p.kp.max_its);
+                    adapt_budget(p, c, &v.budget, depth, &census);
+                }
+                if (zoom_in(p, c, &depth))
+                    request_frame(v.renderer, p, depth);
+            }
+        }
 
-            // Zoom in
-            delta_x4 = _mm_mul_ps(delta_x4, zoom_multiplier4);
-            x_offset4 = _mm_mul_ps(x_offset4, zoom_multiplier4);
-            delta_y *= zoom_multiplier;
-            y_offset *= zoom_multiplier;
+        if (v.new_colors && v.shown != NULL) {
+            show_counts(&v, v.shown);
+            cycle_colors(p, c);
+            v.new_colors = false;
         }
 
         /*
-         * We can handle events such SDL_KEYDOWN to allow navigation
-         * around the fractal
+         * Wait for an event (a published frame is one). Palette cycling
+         * instead recolours the shown frame at the frame rate.
          */
-        if(SDL_PollEvent(&event)) {
-            // Act on 
-            switch (event.type) {
-            case SDL_QUIT:
-                quit = true;
-            }
+        if (c->cycle != 0) {
+            SDL_Delay(1000 / FRAME_RATE);
+            v.new_colors = true;
+            while (!v.quit && SDL_PollEvent(&event))
+                handle_event(&v, &event);
+        } else if (SDL_WaitEvent(&event)) {
+            do {
+                handle_event(&v, &event);
+            } while (!v.quit && SDL_PollEvent(&event));
         }
+    }
+
+    stop_async(v.renderer);
+    destroy_tile_cache(v.k.cache);
+}
+
+/* Colouring stage of mandelbrot_headless(); arg is the config */
+void color_pipelined(const render_params *p, int depth, const uint32_t *its,
+                     uint32_t *pixels, void *arg)
+{
+    color_frame(p, (const config *)arg, depth, its, pixels);
+}
 
+/*
+ * Render the zoom from depth 0 to c->max_depth into memory, without a display,
+ * and report the throughput. If writer is not NULL every frame is handed to
+ * it. The next frame is computed while the last is coloured and the one
+ * before is written; only the incremental zoom and the adaptive limit need
+ * the frame before, and they are worked out with the counts.
+ */
+void mandelbrot_headless(render_params *p, const config *c,
+                         frame_writer *writer)
+{
+    frame_pipeline *fp = start_pipeline(p->width, p->height, writer,
+                                        color_pipelined, (void *)c);
+    incremental_state inc;
+    budget_state budget;
+    int depth = 0;
+    int frames = 0;
+    const double start = omp_get_wtime();
+
+    init_incremental(&inc);
+    init_budget(&budget, c->max_its, c->its_limit);
+    do {
+        uint32_t *its = next_counts(fp);
+        budget_census census;
+
+        count_frame(p, c, &inc, depth, its, p->width);
+        if (c->adaptive) {
+            take_census(&census, its, p->width, p->width, p->height,
+                        p->kp.max_its);
+        }
+        submit_counts(fp, p, depth);
+        cycle_colors(p, c);
+        if (c->adaptive)
+            adapt_budget(p, c, &budget, depth, &census);
+        frames++;
+    } while (zoom_in(p, c, &depth));
+
+    finish_pipeline(fp);
+    if (writer != NULL)
+        close_writer(writer);
+
+    const double elapsed = omp_get_wtime() - start;
+    fprintf(stderr, "%d frames of %dx%d in %.3f s, %.2f frames/s\n", frames,
+            p->width, p->height, elapsed, frames / elapsed);
+}
+
+/*
+ * Render the frame of params alone as a poster, a strip of rows at a time.
+ * Each strip is a frame of its own, centred on the rows it covers, and goes
+ * through the pipeline as the frames of a zoom do: its counts are
+ * computed by every thread while the strip before is coloured and the one
+ * before that written. Only the pipeline's few strips are ever in memory.
+ */
+void mandelbrot_poster(const render_params *params, const config *c)
+{
+    // Whole tiles, and about POSTER_STRIP pixels
+    const int width = params->width;
+    const int height = params->height;
+    int rows = POSTER_STRIP / width / DEFAULT_TILE_SIZE * DEFAULT_TILE_SIZE;
+    if (rows < DEFAULT_TILE_SIZE)
+        rows = DEFAULT_TILE_SIZE;
+    if (rows > height)
+        rows = height;
+
+    frame_writer *writer = open_poster(c->format, c->output_path.c_str(),
+                                       width, height, rows);
+    frame_pipeline *fp = start_pipeline(width, rows, writer,
+                                        color_pipelined, (void *)c);
+    const int limbs = params->center_y.limbs();
+    const double start = omp_get_wtime();
+    int strips = 0;
+
+    for (int y = 0; y < height; y += rows, strips++) {
+        render_params p = *params;
+        uint32_t *its = next_counts(fp);
+        std::vector<thread_stats> stats;
+
+        p.height = height - y < rows ? height - y : rows;
+        p.center_y = params->center_y + fixed_point::from_double(
+            (y + 0.5 * p.height - 0.5 * height) * p.delta_y, limbs);
+
+        render_iterations(&p, its, width, c->stats ? &stats : NULL);
+        if (c->stats && !stats.empty())
+            print_thread_stats(strips, stats);
+        submit_counts(fp, &p, 0);
     }
 
+    finish_pipeline(fp);
+    close_writer(writer);
+
+    const double elapsed = omp_get_wtime() - start;
+    fprintf(stderr, "%dx%d in %d strips of %d rows in %.3f s, "
+            "%.1f Mpixels/s\n", width, height, strips, rows, elapsed,
+            (double)width * height / elapsed / 1e6);
 }
 
+/* Where frames rendered by workers go */
+struct remote_output {
+    const config *c;
+    frame_writer *writer;
+    std::vector<uint32_t> pixels;   // if there is no writer
+    const std::vector<render_params> *frames;   // all of them, in order
+    std::vector<int> sent;          // index in frames of each frame sent
+    size_t done;                    // frames output
+    std::vector<uint32_t> stored;   // counts read from the store
+};
+
+void output_counts(remote_output *out, const render_params *p,
+                   const uint32_t *its)
+{
+    uint32_t *buffer = out->writer == NULL ? &out->pixels[0]
+                                           : next_buffer(out->writer);
+
+    color_frame(p, out->c, out->done, its, buffer);
+    if (out->writer != NULL)
+        submit_frame(out->writer);
+    out->done++;
+}
+
+/* Output the stored frames before frames[end] */
+void output_stored(remote_output *out, size_t end)
+{
+    while (out->done < end) {
+        const render_params *p = &(*out->frames)[out->done];
+
+        out->stored.resize(p->width * p->height);
+        if (!load_frame(p->store, p, &out->stored[0], p->width))
+            render_iterations(p, &out->stored[0], p->width, NULL);
+        output_counts(out, p, &out->stored[0]);
+    }
+}
+
+void output_remote(const render_params *p, int i, const uint32_t *its,
+                   void *arg)
+{
+    remote_output *out = (remote_output *)arg;
+
+    output_stored(out, out->sent[i]);
+    if (p->store != NULL)
+        save_frame(p->store, p, its, p->width);
+    output_counts(out, p, its);
+}
+
+/*
+ * As mandelbrot_headless, with the counts computed by the workers. Every
+ * frame is described up front, so the incremental zoom and the adaptive
+ * iteration limit, which both depend on the frame before, do not apply.
+ * Frames in the store are read locally and only the rest are sent.
+ */
+void mandelbrot_distributed(render_params *p, const config *c,
+                            frame_writer *writer)
+{
+    std::vector<render_params> frames, missing;
+    remote_output out;
+    int depth = 0;
+    const double start = omp_get_wtime();
+
+    if (c->incremental || c->adaptive) {
+        fprintf(stderr, "--incremental and --adaptive are ignored with "
+                "--workers\n");
+    }
+
+    do {
+        if (p->store == NULL || !has_frame(p->store, p)) {
+            out.sent.push_back(frames.size());
+            missing.push_back(*p);
+        }
+        frames.push_back(*p);
+        cycle_colors(p, c);
+    } while (zoom_in(p, c, &depth));
+
+    out.c = c;
+    out.writer = writer;
+    out.frames = &frames;
+    out.done = 0;
+    if (writer == NULL)
+        out.pixels.resize(p->width * p->height);
+    if (!missing.empty()) {
+        render_remote(c->workers, c->center_x, c->center_y, missing,
+                      output_remote, &out);
+    }
+    output_stored(&out, frames.size());
+
+    if (writer != NULL)
+        close_writer(writer);
+
+    const double elapsed = omp_get_wtime() - start;
+    fprintf(stderr, "%d frames of %dx%d in %.3f s, %.2f frames/s\n",
+            (int)frames.size(), p->width, p->height, elapsed,
+            frames.size() / elapsed);
+}
 
 
 int main(int argc, char *argv[])
@@ -348,6 +742,55 @@ int main(int argc, char *argv[])
     int bpp;
     uint32_t video_flags;
     SDL_Surface *surface;
+    config c;
+
+    default_config(&c);
+    parse_args(&c, argc, argv);
+    set_placement(c.pin);
+    if (!c.profile_path.empty() || !c.trace_path.empty()) {
+        start_recording(c.profile_path.empty() ? NULL
+                                               : c.profile_path.c_str(),
+                        c.trace_path.empty() ? NULL : c.trace_path.c_str());
+    }
+    gpu_device *gpu = open_backend(&c);
+
+    if (c.bench)
+        return run_bench(&c, gpu) ? 0 : 1;
+
+    if (c.check)
+        return run_check(&c, gpu) ? 0 : 1;
+
+    if (c.worker_port != 0) {
+        run_worker(c.worker_port, gpu, c.stats);
+        return 0;
+    }
+
+    render_params params;
+    initial_params(&params, &c, gpu);
+
+    if (c.serve_port != 0) {
+        run_server(c.serve_port, &params, c.cache_tiles, c.stats);
+        return 0;
+    }
+
+    // No display needed (or touched) at all
+    if (c.headless || c.output || !c.workers.empty()) {
+        frame_writer *writer = NULL;
+
+        if (c.poster) {
+            mandelbrot_poster(&params, &c);
+            return 0;
+        }
+        if (c.output) {
+            writer = open_writer(c.format, c.output_path.c_str(),
+                                 params.width, params.height, FRAME_RATE);
+        }
+        if (c.workers.empty())
+            mandelbrot_headless(&params, &c, writer);
+        else
+            mandelbrot_distributed(&params, &c, writer);
+        return 0;
+    }
 
     atexit(SDL_Quit);
     
@@ -368,13 +811,14 @@ int main(int argc, char *argv[])
 
     video_flags = SDL_HWSURFACE;
 	
-    if ((surface = SDL_SetVideoMode(X_RES, Y_RES, bpp, video_flags)) == NULL) {
+    if ((surface = SDL_SetVideoMode(c.width, c.height, bpp,
+                                    video_flags)) == NULL) {
         sprintf(msg_buf, "Failed to initialize video: %s", SDL_GetError());
         perror(msg_buf);
         exit(EXIT_FAILURE);
     }
 
-    mandelbrot(surface);
+    mandelbrot(surface, &params, &c);
 
     return 0;
 }
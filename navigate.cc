@@ -0,0 +1,294 @@
+/*
+ * navigate.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <omp.h> // OpenMP
+
+#include "navigate.h"
+
+struct tile_key {
+    int level;
+    int64_t x;          // tile column and row on the grid
+    int64_t y;
+    int max_its;
+
+    bool operator<(const tile_key &b) const
+    {
+        if (level != b.level)
+            return level < b.level;
+        if (x != b.x)
+            return x < b.x;
+        if (y != b.y)
+            return y < b.y;
+        return max_its < b.max_its;
+    }
+};
+
+struct cached_tile {
+    tile_key key;
+    std::vector<uint32_t> its;
+};
+
+/*
+ * Most recently used first. The map points into the list, whose iterators
+ * stay valid as other tiles come and go.
+ */
+struct tile_cache {
+    int capacity;
+    std::list<cached_tile> tiles;
+    std::map<tile_key, std::list<cached_tile>::iterator> index;
+};
+
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+void start_navigation(nav_view *n, const render_params *p)
+{
+    n->anchor_x = p->center_x;
+    n->anchor_y = p->center_y;
+    n->delta0 = p->delta_x;
+    n->level = 0;
+    n->x = 0;
+    n->y = 0;
+}
+
+static double level_delta(const nav_view *n, int level)
+{
+    return ldexp(n->delta0, -level);
+}
+
+/*
+ * anchor + offset*delta, in enough precision to resolve pixels of size
+ * delta. The product is done in double, which is exact enough: offsets are
+ * pixel counts, far below 2^53.
+ */
+static fixed_point grid_point(const fixed_point &anchor, int64_t offset,
+                              double delta)
+{
+    int limbs = fixed_point_limbs(delta);
+
+    limbs = limbs > anchor.limbs() ? limbs : anchor.limbs();
+    return anchor.resized(limbs) +
+           fixed_point::from_double((double)offset * delta, limbs);
+}
+
+void nav_params(const nav_view *n, render_params *p)
+{
+    const double delta = level_delta(n, n->level);
+
+    p->center_x = grid_point(n->anchor_x, n->x, delta);
+    p->center_y = grid_point(n->anchor_y, n->y, delta);
+    p->delta_x = delta;
+    p->delta_y = delta;
+}
+
+void nav_pan(nav_view *n, int64_t dx, int64_t dy)
+{
+    n->x += dx;
+    n->y += dy;
+}
+
+void nav_zoom(nav_view *n, int by, int mx, int my)
+{
+    if (by > 0) {
+        n->x = 2 * (n->x + mx) - mx;
+        n->y = 2 * (n->y + my) - my;
+        n->level++;
+    } else {
+        n->x = floor_div(n->x + mx, 2) - mx;
+        n->y = floor_div(n->y + my, 2) - my;
+        n->level--;
+    }
+}
+
+tile_cache *create_tile_cache(int capacity)
+{
+    tile_cache *cache = new tile_cache;
+
+    cache->capacity = capacity;
+    return cache;
+}
+
+void destroy_tile_cache(tile_cache *cache)
+{
+    delete cache;
+}
+
+static const cached_tile *find_tile(tile_cache *cache, const tile_key &key)
+{
+    std::map<tile_key, std::list<cached_tile>::iterator>::iterator i =
+        cache->index.find(key);
+
+    if (i == cache->index.end())
+        return NULL;
+
+    // Move it to the front
+    cache->tiles.splice(cache->tiles.begin(), cache->tiles, i->second);
+    return &*i->second;
+}
+
+static void add_tile(tile_cache *cache, const tile_key &key,
+                     std::vector<uint32_t> &its)
+{
+    if (cache->capacity <= 0 || cache->index.count(key) != 0)
+        return;
+
+    while ((int)cache->tiles.size() >= cache->capacity) {
+        cache->index.erase(cache->tiles.back().key);
+        cache->tiles.pop_back();
+    }
+
+    cache->tiles.push_front(cached_tile());
+    cache->tiles.front().key = key;
+    cache->tiles.front().its.swap(its);
+    cache->index[key] = cache->tiles.begin();
+}
+
+/*
+ * Each tile is rendered as a frame of its own, centred on the tile, so
+ * that its pixels are exactly where the grid puts them whichever view it
+ * is first computed for
+ */
+static void render_tile(const nav_view *n, const render_params *p,
+                        const tile_key &key, uint32_t *its)
+{
+    const double delta = level_delta(n, key.level);
+    render_params q = *p;
+
+    q.center_x = grid_point(n->anchor_x, key.x * NAV_TILE + NAV_TILE / 2,
+                            delta);
+    q.center_y = grid_point(n->anchor_y, key.y * NAV_TILE + NAV_TILE / 2,
+                            delta);
+    q.delta_x = delta;
+    q.delta_y = delta;
+    q.width = NAV_TILE;
+    q.height = NAV_TILE;
+    q.mode = RENDER_ROWS;
+    q.store = NULL;     // the tile cache keeps tiles, the store frames
+    render_iterations(&q, its, NAV_TILE, NULL);
+}
+
+bool render_navigation(tile_cache *cache, const nav_view *n,
+                       const render_params *p, uint32_t *its, int pitch,
+                       progress_cancel cancel, void *cancel_arg)
+{
+    const double delta = p->delta_x;
+    const int level = (int)floor(log(n->delta0 / delta) / log(2.0) + 0.5);
+    const double grid = ldexp(n->delta0, -level);
+
+    // The pixel offsets of p's centre, which nav_params() made exact
+    const int64_t cx = (int64_t)floor((p->center_x - n->anchor_x.resized(
+        p->center_x.limbs())).to_double() / grid + 0.5);
+    const int64_t cy = (int64_t)floor((p->center_y - n->anchor_y.resized(
+        p->center_y.limbs())).to_double() / grid + 0.5);
+
+    // Grid position of the view's top left pixel
+    const int64_t left = cx - p->width / 2;
+    const int64_t top = cy - p->height / 2;
+    const int64_t tx0 = floor_div(left, NAV_TILE);
+    const int64_t ty0 = floor_div(top, NAV_TILE);
+    const int64_t tx1 = floor_div(left + p->width - 1, NAV_TILE);
+    const int64_t ty1 = floor_div(top + p->height - 1, NAV_TILE);
+
+    std::vector<tile_key> keys;
+    std::vector<const cached_tile *> found;
+    for (int64_t ty = ty0; ty <= ty1; ty++) {
+        for (int64_t tx = tx0; tx <= tx1; tx++) {
+            tile_key key;
+
+            key.level = level;
+            key.x = tx;
+            key.y = ty;
+            key.max_its = p->kp.max_its;
+            keys.push_back(key);
+            found.push_back(find_tile(cache, key));
+        }
+    }
+
+    // Compute the missing tiles in parallel, each on one thread
+    std::vector<int> missing;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (found[i] == NULL)
+            missing.push_back(i);
+    }
+
+    const int num_missing = missing.size();
+    std::vector<std::vector<uint32_t> > fresh(num_missing);
+    bool cancelled = false;
+
+    #pragma omp parallel for default(none), shared(n, p, keys, missing,\
+                                                   fresh, cancel, cancel_arg,\
+                                                   cancelled),\
+                             firstprivate(num_missing), schedule(dynamic, 1)
+    for (int m = 0; m < num_missing; m++) {
+        bool stop;
+
+        #pragma omp critical(nav_cancel)
+        {
+            if (!cancelled && cancel(cancel_arg))
+                cancelled = true;
+            stop = cancelled;
+        }
+        if (stop)
+            continue;
+
+        fresh[m].resize(NAV_TILE * NAV_TILE);
+        render_tile(n, p, keys[missing[m]], &fresh[m][0]);
+    }
+
+    /*
+     * Keep what was finished even if cancelled; found[] is looked up again
+     * since adding tiles may have dropped some from the cache
+     */
+    for (int m = 0; m < num_missing; m++) {
+        if (!fresh[m].empty())
+            add_tile(cache, keys[missing[m]], fresh[m]);
+    }
+    if (cancelled)
+        return false;
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        const cached_tile *t = find_tile(cache, keys[i]);
+        const int64_t x0 = keys[i].x * NAV_TILE - left;
+        const int64_t y0 = keys[i].y * NAV_TILE - top;
+
+        // A cache too small for the view: render the tile again
+        std::vector<uint32_t> again;
+        const uint32_t *src;
+        if (t != NULL) {
+            src = &t->its[0];
+        } else {
+            again.resize(NAV_TILE * NAV_TILE);
+            render_tile(n, p, keys[i], &again[0]);
+            src = &again[0];
+        }
+
+        for (int ty = 0; ty < NAV_TILE; ty++) {
+            const int64_t hy = y0 + ty;
+            const int64_t hx0 = x0 < 0 ? 0 : x0;
+            const int64_t hx1 = x0 + NAV_TILE < p->width ? x0 + NAV_TILE
+                                                          : p->width;
+
+            if (hy < 0 || hy >= p->height || hx0 >= hx1)
+                continue;
+            memcpy(its + hy*pitch + hx0, src + ty*NAV_TILE + (hx0 - x0),
+                   (hx1 - hx0) * sizeof(uint32_t));
+        }
+    }
+
+    return true;
+}
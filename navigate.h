@@ -0,0 +1,68 @@
+/*
+ * navigate.h
+ *
+ * Interactive navigation over a fixed grid of pixels, so that what has
+ * been computed once can be kept. Zoom levels are powers of two apart
+ * from the view navigation started from, and at each level pixels sit at
+ * integer offsets from that view's centre (the anchor). The grid is cut
+ * into tiles, which are cached by level, position and iteration limit:
+ * panning only computes the newly exposed tiles, and returning to an
+ * earlier view is free while its tiles are still cached.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef NAVIGATE_H
+#define NAVIGATE_H
+
+#include <stdint.h>
+
+#include "render.h"
+#include "progressive.h"
+
+const int NAV_TILE = 64;        // tile side, in pixels
+
+/* A view on the grid */
+struct nav_view {
+    fixed_point anchor_x;       // centre of the view at level 0, offset 0
+    fixed_point anchor_y;
+    double delta0;              // pixel size at level 0
+    int level;                  // pixel size is delta0 / 2^level
+    int64_t x;                  // centre pixel, from the anchor
+    int64_t y;
+};
+
+/* Start navigating from the view p renders */
+void start_navigation(nav_view *n, const render_params *p);
+
+// Set the centre and pixel size of p to those of n
+void nav_params(const nav_view *n, render_params *p);
+
+// Move the view by (dx, dy) pixels
+void nav_pan(nav_view *n, int64_t dx, int64_t dy);
+
+/*
+ * Zoom in (by = 1) or out (by = -1) by a level, keeping the point
+ * (mx, my) pixels from the centre in place
+ */
+void nav_zoom(nav_view *n, int by, int mx, int my);
+
+/* The least recently used tiles are dropped once there are capacity */
+struct tile_cache;
+
+tile_cache *create_tile_cache(int capacity);
+void destroy_tile_cache(tile_cache *cache);
+
+/*
+ * Compute the counts of the view p (as set by nav_params() from a view
+ * with the anchor and delta0 of n) into its, from cached tiles where
+ * possible. cancel is polled between tiles. Returns false if cancelled.
+ */
+bool render_navigation(tile_cache *cache, const nav_view *n,
+                       const render_params *p, uint32_t *its, int pitch,
+                       progress_cancel cancel, void *cancel_arg);
+
+#endif // NAVIGATE_H
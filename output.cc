@@ -0,0 +1,311 @@
+/*
+ * output.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <pthread.h>
+#include <png.h>
+
+#include "output.h"
+#include "queue.h"
+
+/*
+ * Frame buffers cycled between the renderer and the writer thread. Two are
+ * enough to overlap rendering with writing; a third absorbs frames which
+ * happen to render faster than they encode.
+ */
+const int NUM_BUFFERS = 3;
+
+struct frame_writer {
+    output_format format;
+    const char *path;
+    int width;
+    int height;
+
+    std::vector<uint32_t> buffer[NUM_BUFFERS];
+    std::vector<uint8_t> line;  // encoded data of one frame
+
+    int strip;                  // rows in each buffer of a poster, or 0
+    int rows_done;              // of the poster, written
+
+    // The PNG file being written
+    char name[1024];
+    FILE *file;
+    png_structp png;
+    png_infop info;
+
+    /*
+     * Each buffer is in one of the queues, or the renderer's (current)
+     * between next_buffer() and submit_frame(), or being written. NULL in
+     * queued marks the end.
+     */
+    ptr_queue *queued;          // to the writer
+    ptr_queue *spare;           // back to the renderer
+    uint32_t *current;
+
+    pthread_t thread;
+};
+
+
+static void write_or_die(const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, stdout) != size) {
+        perror("Failed to write frame");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void write_raw(frame_writer *w, const uint32_t *pixels, int rows)
+{
+    const int n = w->width * rows;
+    uint8_t *p = &w->line[0];
+
+    for (int i = 0; i < n; i++) {
+        *p++ = pixels[i] >> 16;
+        *p++ = pixels[i] >> 8;
+        *p++ = pixels[i];
+    }
+    write_or_die(&w->line[0], 3 * n);
+}
+
+static inline uint8_t clamp_byte(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* BT.601 studio range, in 8.8 fixed point */
+static void write_y4m(frame_writer *w, const uint32_t *pixels)
+{
+    const int n = w->width * w->height;
+    uint8_t *y = &w->line[0];
+    uint8_t *u = y + n;
+    uint8_t *v = u + n;
+
+    for (int i = 0; i < n; i++) {
+        const int r = (pixels[i] >> 16) & 0xFF;
+        const int g = (pixels[i] >> 8) & 0xFF;
+        const int b = pixels[i] & 0xFF;
+
+        y[i] = clamp_byte(((66*r + 129*g + 25*b + 128) >> 8) + 16);
+        u[i] = clamp_byte(((-38*r - 74*g + 112*b + 128) >> 8) + 128);
+        v[i] = clamp_byte(((112*r - 94*g - 18*b + 128) >> 8) + 128);
+    }
+
+    static const char marker[] = "FRAME\n";
+    write_or_die(marker, sizeof(marker) - 1);
+    write_or_die(&w->line[0], 3 * n);
+}
+
+// Start the PNG file called name
+static void begin_png(frame_writer *w, const char *name)
+{
+    if (name != w->name)
+        snprintf(w->name, sizeof(w->name), "%s", name);
+    w->file = fopen(w->name, "wb");
+    if (w->file == NULL) {
+        perror(w->name);
+        exit(EXIT_FAILURE);
+    }
+
+    w->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+                                     NULL);
+    w->info = w->png == NULL ? NULL : png_create_info_struct(w->png);
+    if (w->info == NULL || setjmp(png_jmpbuf(w->png))) {
+        fprintf(stderr, "Failed to write %s\n", w->name);
+        exit(EXIT_FAILURE);
+    }
+
+    png_init_io(w->png, w->file);
+    // Rendered frames are noisy; fast compression is nearly as small
+    png_set_compression_level(w->png, 3);
+    png_set_IHDR(w->png, w->info, w->width, w->height, 8,
+                 PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(w->png, w->info);
+}
+
+// The next rows of the image begun
+static void write_png_rows(frame_writer *w, const uint32_t *pixels,
+                           int rows)
+{
+    if (setjmp(png_jmpbuf(w->png))) {
+        fprintf(stderr, "Failed to write %s\n", w->name);
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *row = &w->line[0];
+    for (int hy = 0; hy < rows; hy++) {
+        const uint32_t *src = pixels + hy * w->width;
+
+        for (int hx = 0; hx < w->width; hx++) {
+            row[3*hx] = src[hx] >> 16;
+            row[3*hx + 1] = src[hx] >> 8;
+            row[3*hx + 2] = src[hx];
+        }
+        png_write_row(w->png, row);
+    }
+}
+
+static void end_png(frame_writer *w)
+{
+    if (setjmp(png_jmpbuf(w->png))) {
+        fprintf(stderr, "Failed to write %s\n", w->name);
+        exit(EXIT_FAILURE);
+    }
+
+    png_write_end(w->png, NULL);
+    png_destroy_write_struct(&w->png, &w->info);
+    if (fclose(w->file) != 0) {
+        perror(w->name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Frame number of a zoom, named by the pattern checked by parse_args()
+static void write_png(frame_writer *w, const uint32_t *pixels, long number)
+{
+    snprintf(w->name, sizeof(w->name), w->path, (int)number);
+    begin_png(w, w->name);
+    write_png_rows(w, pixels, w->height);
+    end_png(w);
+}
+
+/* The next strip of a poster, of however many rows are left of it */
+static void write_strip(frame_writer *w, const uint32_t *pixels)
+{
+    const int rows = w->height - w->rows_done < w->strip
+                     ? w->height - w->rows_done : w->strip;
+
+    if (w->format == OUTPUT_RAW) {
+        write_raw(w, pixels, rows);
+    } else {
+        if (w->rows_done == 0)
+            begin_png(w, w->path);
+        write_png_rows(w, pixels, rows);
+        if (w->rows_done + rows == w->height)
+            end_png(w);
+    }
+    w->rows_done += rows;
+}
+
+static void *writer_thread(void *arg)
+{
+    frame_writer *w = (frame_writer *)arg;
+    const uint32_t *pixels;
+
+    for (long number = 0;
+         (pixels = (const uint32_t *)queue_take(w->queued)) != NULL;
+         number++) {
+        if (w->strip > 0) {
+            write_strip(w, pixels);
+            queue_put(w->spare, (void *)pixels);
+            continue;
+        }
+
+        switch (w->format) {
+        case OUTPUT_RAW:
+            write_raw(w, pixels, w->height);
+            break;
+        case OUTPUT_Y4M:
+            write_y4m(w, pixels);
+            break;
+        case OUTPUT_PNG:
+            write_png(w, pixels, number);
+            break;
+        }
+        queue_put(w->spare, (void *)pixels);
+    }
+
+    if (w->strip > 0 && w->rows_done < w->height) {
+        fprintf(stderr, "Poster ended %d rows short\n",
+                w->height - w->rows_done);
+        exit(EXIT_FAILURE);
+    }
+    if (w->format != OUTPUT_PNG && fflush(stdout) != 0) {
+        perror("Failed to write frame");
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+/* A writer of frames, or with strip (rows in each buffer) of a poster */
+static frame_writer *start_writer(output_format format, const char *path,
+                                  int width, int height, int strip, int fps)
+{
+    frame_writer *w = new frame_writer;
+    const int frame_height = strip > 0 ? strip : height;
+
+    w->format = format;
+    w->path = path;
+    w->width = width;
+    w->height = height;
+    w->strip = strip;
+    w->rows_done = 0;
+    for (int i = 0; i < NUM_BUFFERS; i++)
+        w->buffer[i].resize((size_t)width * frame_height);
+    w->line.resize(format == OUTPUT_PNG ? 3 * width
+                                        : 3 * width * frame_height);
+
+    // Room for the end marker as well as every buffer
+    w->queued = create_queue(NUM_BUFFERS + 1);
+    w->spare = create_queue(NUM_BUFFERS);
+    for (int i = 0; i < NUM_BUFFERS; i++)
+        queue_put(w->spare, &w->buffer[i][0]);
+    w->current = NULL;
+
+    if (format == OUTPUT_Y4M) {
+        printf("YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height,
+               fps);
+    }
+
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        perror("Failed to start the writer thread");
+        exit(EXIT_FAILURE);
+    }
+    return w;
+}
+
+frame_writer *open_writer(output_format format, const char *path, int width,
+                          int height, int fps)
+{
+    return start_writer(format, path, width, height, 0, fps);
+}
+
+frame_writer *open_poster(output_format format, const char *path, int width,
+                          int height, int strip)
+{
+    if (format == OUTPUT_Y4M) {
+        fprintf(stderr, "A poster cannot be written as YUV4MPEG2\n");
+        exit(EXIT_FAILURE);
+    }
+    return start_writer(format, path, width, height, strip, 0);
+}
+
+uint32_t *next_buffer(frame_writer *w)
+{
+    w->current = (uint32_t *)queue_take(w->spare);
+    return w->current;
+}
+
+void submit_frame(frame_writer *w)
+{
+    queue_put(w->queued, w->current);
+    w->current = NULL;
+}
+
+void close_writer(frame_writer *w)
+{
+    queue_put(w->queued, NULL);
+    pthread_join(w->thread, NULL);
+    destroy_queue(w->queued);
+    destroy_queue(w->spare);
+    delete w;
+}
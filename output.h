@@ -0,0 +1,61 @@
+/*
+ * output.h
+ *
+ * Streaming rendered frames out of the program: raw RGB or YUV4MPEG2 on
+ * stdout, ready to be piped into an encoder such as ffmpeg, or a numbered
+ * sequence of PNG files. Frames are encoded and written by a thread of
+ * their own, so that the next frame renders while the last one is written.
+ * A poster, an image too big for memory, is written the same way a strip
+ * at a time.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+
+enum output_format {
+    OUTPUT_RAW,         // rgb24, no header
+    OUTPUT_Y4M,         // YUV4MPEG2, 4:4:4 full resolution chroma
+    OUTPUT_PNG          // one file per frame
+};
+
+struct frame_writer;
+
+/*
+ * Start a writer of width x height frames at fps frames per second. Raw
+ * and Y4M go to stdout and ignore path. PNG files are named by the printf
+ * pattern path, which is given the frame number; "frame%04d.png", say.
+ * It must have one conversion of an int and no other, bar "%%".
+ */
+frame_writer *open_writer(output_format format, const char *path, int width,
+                          int height, int fps);
+
+/*
+ * Start a writer of one width x height image, raw or PNG, which is given
+ * in strips of strip rows (the last perhaps fewer): each buffer from
+ * next_buffer() is width x strip, and holds the next strip. The image is
+ * written out in order as the strips come, so it need never be in memory
+ * whole. A PNG file is named by path as it is, not as a pattern.
+ */
+frame_writer *open_poster(output_format format, const char *path, int width,
+                          int height, int strip);
+
+/*
+ * Return a buffer of width x height 0x00RRGGBB pixels to render the next
+ * frame into, waiting for the writer if every buffer is still queued
+ */
+uint32_t *next_buffer(frame_writer *w);
+
+/* Queue the buffer last returned by next_buffer() for writing */
+void submit_frame(frame_writer *w);
+
+// Write out every queued frame and free the writer
+void close_writer(frame_writer *w);
+
+#endif // OUTPUT_H
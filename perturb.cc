@@ -0,0 +1,265 @@
+/*
+ * perturb.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <math.h>
+
+#include <omp.h> // OpenMP
+
+#include "perturb.h"
+
+const int MAX_REFERENCES = 16;     // references tried per frame
+const double GLITCH_TOLERANCE = 1e-6;   // on |z|^2 / |Z|^2
+const int POINTS_CHUNK = 256;      // glitched points per parallel work item
+const double SERIES_TOLERANCE = 1e-3;   // neglected term, in pixels
+const int SERIES_PROBES = 5;       // probes a side, checking the series
+
+
+/*
+ * Start points at step k of ref, which must have been fitted at least that
+ * far
+ */
+static void use_series(reference *ref, int k)
+{
+    const double *c = &ref->series[6*k];
+
+    ref->orbit.skip = k;
+    ref->orbit.ax = c[0];
+    ref->orbit.ay = c[1];
+    ref->orbit.bx = c[2];
+    ref->orbit.by = c[3];
+    ref->orbit.cx = c[4];
+    ref->orbit.cy = c[5];
+}
+
+/*
+ * Iterate the series of dz along the orbit of ref,
+ *
+ *     A' = 2*Z*A + 1,   B' = 2*Z*B + A^2,   C' = 2*Z*C + 2*A*B
+ *
+ * in the units of the deltas (which makes s*A^2 and 2*s*A*B), for deltas
+ * up to radius, and return the last step at which |C|*radius^3 is within
+ * SERIES_TOLERANCE of a pixel's difference in dz, |A|. The fourth order
+ * term, which is left out, is smaller still while the series converges.
+ */
+static int fit_series(reference *ref, double radius)
+{
+    const reference_orbit *o = &ref->orbit;
+    const double s = o->scale;
+    const double r3 = radius * radius * radius;
+    double ax = 1.0, ay = 0.0;
+    double bx = 0.0, by = 0.0;
+    double cx = 0.0, cy = 0.0;
+    int k;
+
+    ref->series.assign(6 * (o->length + 1), 0.0);
+    ref->series[6] = 1.0;
+    for (k = 1; k + 1 < o->length; k++) {
+        const double zx = 2.0 * o->x[k];
+        const double zy = 2.0 * o->y[k];
+        const double sax = s * ax;
+        const double say = s * ay;
+
+        const double nax = zx*ax - zy*ay + 1.0;
+        const double nay = zx*ay + zy*ax;
+        const double nbx = zx*bx - zy*by + (sax*ax - say*ay);
+        const double nby = zx*by + zy*bx + (sax*ay + say*ax);
+        const double ncx = zx*cx - zy*cy + 2.0 * (sax*bx - say*by);
+        const double ncy = zx*cy + zy*cx + 2.0 * (sax*by + say*bx);
+
+        const double a = hypot(nax, nay);
+        if (!(hypot(ncx, ncy) * r3 <= SERIES_TOLERANCE * a && a < HUGE_VAL))
+            break;
+
+        ax = nax, ay = nay;
+        bx = nbx, by = nby;
+        cx = ncx, cy = ncy;
+
+        double *c = &ref->series[6*(k + 1)];
+        c[0] = ax, c[1] = ay;
+        c[2] = bx, c[3] = by;
+        c[4] = cx, c[5] = cy;
+    }
+    return k;
+}
+
+
+void compute_reference(reference *ref, const fixed_point &cx,
+                       const fixed_point &cy, double scale, int max_its)
+{
+    fixed_point x = cx;
+    fixed_point y = cy;
+    int k;
+
+    ref->x.assign(max_its + 2, 0.0);
+    ref->y.assign(max_its + 2, 0.0);
+    ref->tol.assign(max_its + 2, 0.0);
+
+    // Z_1 = C, Z_k+1 = Z_k^2 + C
+    for (k = 1; k <= max_its + 1; k++) {
+        const double dx = x.to_double();
+        const double dy = y.to_double();
+        const double dist = dx*dx + dy*dy;
+
+        ref->x[k] = dx;
+        ref->y[k] = dy;
+        ref->tol[k] = GLITCH_TOLERANCE * dist;
+
+        if (dist >= 4.0 || k == max_its + 1)
+            break;
+
+        const fixed_point xy = x * y;
+        x = x * x - y * y + cx;
+        y = xy + xy + cy;
+    }
+
+    ref->orbit.x = &ref->x[0];
+    ref->orbit.y = &ref->y[0];
+    ref->orbit.tol = &ref->tol[0];
+    ref->orbit.length = k;
+    ref->orbit.scale = scale;
+
+    ref->series.assign(12, 0.0);
+    ref->series[6] = 1.0;       // dz_1 = dc
+    use_series(ref, 1);
+}
+
+/*
+ * Start the pixels of p as far into its orbit as the series is accurate to
+ * a fraction of a pixel, over the whole frame and a pixel beyond for
+ * samples, and no further than probes on a grid across it agree with
+ * their counts from the first step. Probes that glitch from the first step
+ * say nothing and are left out.
+ */
+static void choose_skip(perturbation *p, const kernel *kern,
+                        const kernel_params *kp, int width, int height)
+{
+    const int n = SERIES_PROBES * SERIES_PROBES;
+    double x[SERIES_PROBES * SERIES_PROBES], y[SERIES_PROBES * SERIES_PROBES];
+    uint32_t exact[SERIES_PROBES * SERIES_PROBES];
+    uint32_t its[SERIES_PROBES * SERIES_PROBES];
+    int skip = fit_series(&p->ref,
+                          hypot(fabs(p->x0) + 1.0, fabs(p->y0) + p->aspect));
+
+    if (skip <= 1)
+        return;
+
+    for (int j = 0; j < SERIES_PROBES; j++) {
+        for (int i = 0; i < SERIES_PROBES; i++) {
+            x[j*SERIES_PROBES + i] =
+                perturb_x(p, i * (width - 1) / (SERIES_PROBES - 1));
+            y[j*SERIES_PROBES + i] =
+                perturb_y(p, j * (height - 1) / (SERIES_PROBES - 1));
+        }
+    }
+    kern->perturb_points(&p->ref.orbit, x, y, n, kp, exact);
+
+    for (; skip > 1; skip /= 2) {
+        bool agree = true;
+
+        use_series(&p->ref, skip);
+        kern->perturb_points(&p->ref.orbit, x, y, n, kp, its);
+        for (int i = 0; agree && i < n; i++) {
+            agree = (exact[i] & GLITCHED) ||
+                    (its[i] & (COUNT_MASK | GLITCHED)) ==
+                    (exact[i] & COUNT_MASK);
+        }
+        if (agree)
+            return;
+    }
+    use_series(&p->ref, 1);
+}
+
+void setup_perturbation(perturbation *p, const kernel *kern,
+                        const kernel_params *kp, const fixed_point &cx,
+                        const fixed_point &cy, double delta_x, double delta_y,
+                        int width, int height)
+{
+    p->limbs = fixed_point_limbs(delta_x < delta_y ? delta_x : delta_y);
+    p->center_x = cx.resized(p->limbs);
+    p->center_y = cy.resized(p->limbs);
+    p->scale = delta_x;
+    p->aspect = delta_y / delta_x;
+    p->x0 = -0.5 * width;
+    p->y0 = -0.5 * height * p->aspect;
+
+    compute_reference(&p->ref, p->center_x, p->center_y, p->scale,
+                      kp->max_its);
+    if (kp->flags & KERNEL_SERIES)
+        choose_skip(p, kern, kp, width, height);
+}
+
+void correct_glitches(const perturbation *p, const kernel *kern,
+                      const kernel_params *kp, int width, int height,
+                      uint32_t *its, int pitch)
+{
+    /*
+     * The new reference point is computed exactly, so it always resolves
+     * at least itself and every round makes progress
+     */
+    reference ref;
+    const reference_orbit *orbit = &ref.orbit;
+    std::vector<int> glitched;
+    std::vector<double> gx, gy;
+    std::vector<uint32_t> gits;
+
+    for (int round = 1; round < MAX_REFERENCES; round++) {
+        glitched.clear();
+        for (int hy = 0; hy < height; hy++) {
+            for (int hx = 0; hx < width; hx++) {
+                if (its[hy*pitch + hx] & GLITCHED)
+                    glitched.push_back(hy*pitch + hx);
+            }
+        }
+        if (glitched.empty())
+            break;
+
+        const int pick = glitched[glitched.size() / 2];
+        const double ox = perturb_x(p, pick % pitch);
+        const double oy = perturb_y(p, pick / pitch);
+
+        compute_reference(&ref,
+                          p->center_x +
+                          fixed_point::from_double(ox * p->scale, p->limbs),
+                          p->center_y +
+                          fixed_point::from_double(oy * p->scale, p->limbs),
+                          p->scale, kp->max_its);
+
+        const int n = (int)glitched.size();
+        gx.resize(n);
+        gy.resize(n);
+        gits.resize(n);
+        for (int i = 0; i < n; i++) {
+            gx[i] = perturb_x(p, glitched[i] % pitch) - ox;
+            gy[i] = perturb_y(p, glitched[i] / pitch) - oy;
+        }
+
+        double *px = &gx[0];
+        double *py = &gy[0];
+        uint32_t *pits = &gits[0];
+
+        #pragma omp parallel for default(none), shared(kern, kp, orbit, px,\
+                                                       py, pits),\
+                                 firstprivate(n),\
+                                 schedule(dynamic, 1)
+        for (int i = 0; i < n; i += POINTS_CHUNK) {
+            const int m = n - i < POINTS_CHUNK ? n - i : POINTS_CHUNK;
+
+            kern->perturb_points(orbit, px + i, py + i, m, kp, pits + i);
+        }
+
+        for (int i = 0; i < n; i++)
+            its[glitched[i]] = gits[i];
+    }
+
+    // Whatever is left after the last reference is kept as it is
+    for (int hy = 0; hy < height; hy++) {
+        for (int hx = 0; hx < width; hx++)
+            its[hy*pitch + hx] &= ~GLITCHED;
+    }
+}
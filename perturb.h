@@ -0,0 +1,99 @@
+/*
+ * perturb.h
+ *
+ * Deep zoom rendering by perturbation. One reference orbit is iterated in
+ * high precision per frame and every pixel is then computed in double
+ * precision as a small difference from it (see perturb_member in
+ * kernel_impl.h). Pixels for which the difference
+ * loses its accuracy ("glitches") are detected by the kernels and redone
+ * against a new reference placed among them.
+ *
+ * With KERNEL_SERIES the first iterations are not computed per pixel at
+ * all. While the deltas are small their orbit is very nearly a polynomial
+ * in the pixel's own delta, whose coefficients are iterated along with the
+ * reference, and every pixel starts from that polynomial at the last step
+ * where its leading neglected term is still a small fraction of a pixel
+ * anywhere in the frame. That step is then checked against probes across
+ * the frame computed in full, and brought back until they agree, which
+ * catches what the bound cannot see, such as pixels escaping before it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef PERTURB_H
+#define PERTURB_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "kernel.h"
+#include "fixedpoint.h"
+
+/* A reference orbit together with the storage it points into */
+struct reference {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> tol;
+    std::vector<double> series;     // A, B and C of each step, 6 per step
+    reference_orbit orbit;
+};
+
+/*
+ * Iterate the orbit of (cx, cy) for up to max_its iterations or until it
+ * escapes. scale is the unit the kernels' pixel deltas will be given in.
+ * Points are computed from the first step.
+ */
+void compute_reference(reference *ref, const fixed_point &cx,
+                       const fixed_point &cy, double scale, int max_its);
+
+/*
+ * Perturbation state of one frame: the reference orbit at the frame's
+ * centre and the mapping from pixels to deltas. All deltas are in units of
+ * scale (the pixel width), so pixel (hx, hy) is at
+ * (x0 + hx, y0 + hy*aspect) from the centre.
+ */
+struct perturbation {
+    fixed_point center_x;
+    fixed_point center_y;
+    int limbs;          // precision the orbit is computed in
+    double scale;
+    double aspect;      // pixel height / pixel width
+    double x0;
+    double y0;
+    reference ref;
+};
+
+/*
+ * Compute the reference orbit of a width x height frame around (cx, cy),
+ * and with KERNEL_SERIES in kp the step its pixels are started from,
+ * checked with kern
+ */
+void setup_perturbation(perturbation *p, const kernel *kern,
+                        const kernel_params *kp, const fixed_point &cx,
+                        const fixed_point &cy, double delta_x, double delta_y,
+                        int width, int height);
+
+inline double perturb_x(const perturbation *p, int hx)
+{
+    // Must match the kernels' ramp with dx = 1
+    return p->x0 + (double)hx * 1.0;
+}
+
+inline double perturb_y(const perturbation *p, int hy)
+{
+    return p->y0 + hy * p->aspect;
+}
+
+/*
+ * Redo the pixels of a width x height frame marked GLITCHED against new
+ * references taken from among them, and clear the mark from any that are
+ * left
+ */
+void correct_glitches(const perturbation *p, const kernel *kern,
+                      const kernel_params *kp, int width, int height,
+                      uint32_t *its, int pitch);
+
+#endif // PERTURB_H
@@ -0,0 +1,125 @@
+/*
+ * pipeline.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "queue.h"
+#include "placement.h"
+#include "tiles.h"
+
+/*
+ * Counts buffers: one being computed, one being coloured and one queued
+ * between them, for frames which happen to compute faster than they colour
+ */
+const int NUM_COUNTS = 3;
+
+struct counted_frame {
+    render_params p;
+    int depth;
+    uint32_t *its;                  // from alloc_counts()
+};
+
+struct frame_pipeline {
+    int width;
+    int height;
+    frame_writer *writer;
+    std::vector<uint32_t> pixels;   // if there is no writer
+    color_function color;
+    void *color_arg;
+
+    /*
+     * As the writer's buffers: each frame is in one of the queues, or
+     * being computed (current) or coloured. NULL in queued marks the end.
+     */
+    counted_frame frame[NUM_COUNTS];
+    ptr_queue *queued;              // to the colouring thread
+    ptr_queue *spare;               // back to the computing one
+    counted_frame *current;
+
+    pthread_t thread;
+};
+
+
+static void *color_thread(void *arg)
+{
+    frame_pipeline *fp = (frame_pipeline *)arg;
+    counted_frame *f;
+
+    while ((f = (counted_frame *)queue_take(fp->queued)) != NULL) {
+        uint32_t *pixels = fp->writer == NULL ? &fp->pixels[0]
+                                              : next_buffer(fp->writer);
+
+        fp->color(&f->p, f->depth, f->its, pixels, fp->color_arg);
+        if (fp->writer != NULL)
+            submit_frame(fp->writer);
+        queue_put(fp->spare, f);
+    }
+    return NULL;
+}
+
+frame_pipeline *start_pipeline(int width, int height, frame_writer *writer,
+                               color_function color, void *color_arg)
+{
+    frame_pipeline *fp = new frame_pipeline;
+
+    fp->width = width;
+    fp->height = height;
+    fp->writer = writer;
+    if (writer == NULL)
+        fp->pixels.resize(width * height);
+    fp->color = color;
+    fp->color_arg = color_arg;
+
+    // Room for the end marker as well as every frame
+    fp->queued = create_queue(NUM_COUNTS + 1);
+    fp->spare = create_queue(NUM_COUNTS);
+    for (int i = 0; i < NUM_COUNTS; i++) {
+        fp->frame[i].its = alloc_counts(width * height);
+        place_counts(fp->frame[i].its, width, width, height,
+                     DEFAULT_TILE_SIZE);
+        queue_put(fp->spare, &fp->frame[i]);
+    }
+    fp->current = NULL;
+
+    if (pthread_create(&fp->thread, NULL, color_thread, fp) != 0) {
+        perror("Failed to start the colouring thread");
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+uint32_t *next_counts(frame_pipeline *fp)
+{
+    fp->current = (counted_frame *)queue_take(fp->spare);
+    return fp->current->its;
+}
+
+void submit_counts(frame_pipeline *fp, const render_params *p, int depth)
+{
+    fp->current->p = *p;
+    fp->current->depth = depth;
+    queue_put(fp->queued, fp->current);
+    fp->current = NULL;
+}
+
+void finish_pipeline(frame_pipeline *fp)
+{
+    queue_put(fp->queued, NULL);
+    pthread_join(fp->thread, NULL);
+    destroy_queue(fp->queued);
+    destroy_queue(fp->spare);
+    for (int i = 0; i < NUM_COUNTS; i++)
+        free_counts(fp->frame[i].its, fp->width * fp->height);
+    delete fp;
+}
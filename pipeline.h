@@ -0,0 +1,61 @@
+/*
+ * pipeline.h
+ *
+ * Frames streamed out in three stages, each on a thread of its own: the
+ * counts of a frame are computed while the frame before is coloured and
+ * the one before that is encoded and written, so a zoom goes only as fast
+ * as its slowest stage rather than all three together. Frames are passed
+ * between the stages through queues, in buffers allocated up front and
+ * recycled, so nothing is allocated once the pipeline is running.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+
+#include "render.h"
+#include "output.h"
+
+/*
+ * Colours the counts of the frame p at depth into pixels (width x height,
+ * both), on the colouring thread
+ */
+typedef void (*color_function)(const render_params *p, int depth,
+                               const uint32_t *its, uint32_t *pixels,
+                               void *arg);
+
+struct frame_pipeline;
+
+/*
+ * Start colouring width x height frames with color, and writing them to
+ * writer. If writer is NULL frames are coloured and thrown away, as for
+ * benchmarking.
+ */
+frame_pipeline *start_pipeline(int width, int height, frame_writer *writer,
+                               color_function color, void *color_arg);
+
+/*
+ * Return a buffer for the counts of the next frame, waiting for the
+ * colouring thread if every buffer is still queued
+ */
+uint32_t *next_counts(frame_pipeline *fp);
+
+/*
+ * Queue the buffer last returned by next_counts(), holding the counts of
+ * p at depth, for colouring and writing. p is copied.
+ */
+void submit_counts(frame_pipeline *fp, const render_params *p, int depth);
+
+/*
+ * Colour every queued frame, hand it to the writer and free the pipeline.
+ * The writer is left open.
+ */
+void finish_pipeline(frame_pipeline *fp);
+
+#endif // PIPELINE_H
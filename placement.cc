@@ -0,0 +1,232 @@
+/*
+ * placement.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include <pthread.h>
+
+#include "placement.h"
+
+/*
+ * The CPUs the process may run on, as the system describes them. Where
+ * there is no NUMA information they are all on node 0, and where there is
+ * none about speed they all have speed 1.
+ */
+struct topology {
+    std::vector<int> places;            // allowed CPUs, node by node
+    std::vector<int> node;              // of each CPU, by number
+    std::vector<double> speed;          // of each CPU, by number
+    std::vector<cpu_set_t> node_cpus;   // allowed CPUs of each node
+};
+
+static topology topo;
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+static pin_mode pinning = PIN_NONE;
+
+// Which pinning the thread has, as thread me, or -1
+static __thread int placed_as = -1;
+
+static const char *const pin_names[] = { "none", "cores", "nodes" };
+
+
+bool find_pin_mode(const char *name, pin_mode *mode)
+{
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, pin_names[i]) == 0) {
+            *mode = (pin_mode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The first line of a file under /sys, or false
+static bool read_line(const char *path, char *line, int size)
+{
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+        return false;
+    const bool ok = fgets(line, size, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+// A number in a file under /sys, or -1
+static double read_number(const char *path)
+{
+    char line[64];
+
+    if (!read_line(path, line, sizeof(line)))
+        return -1.0;
+    return atof(line);
+}
+
+// A list such as "0-3,8-11", of CPUs or of nodes, into set
+static void parse_cpu_list(const char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*s >= '0' && *s <= '9') {
+        char *end;
+        const long first = strtol(s, &end, 10);
+        long last = first;
+
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+static void read_topology()
+{
+    cpu_set_t allowed;
+    char path[128], line[4096];
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+
+    // Without NUMA, one node of everything
+    cpu_set_t nodes;
+    CPU_ZERO(&nodes);
+    if (read_line("/sys/devices/system/node/online", line, sizeof(line)))
+        parse_cpu_list(line, &nodes);
+
+    topo.node.assign(CPU_SETSIZE, 0);
+    for (int n = 0; n < CPU_SETSIZE; n++) {
+        cpu_set_t cpus = allowed;
+
+        if (CPU_COUNT(&nodes) > 0) {
+            if (!CPU_ISSET(n, &nodes))
+                continue;
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/node/node%d/cpulist", n);
+            if (!read_line(path, line, sizeof(line)))
+                continue;
+            parse_cpu_list(line, &cpus);
+            CPU_AND(&cpus, &cpus, &allowed);
+        } else if (n > 0) {
+            break;
+        }
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                topo.node[cpu] = topo.node_cpus.size();
+                topo.places.push_back(cpu);
+            }
+        }
+        topo.node_cpus.push_back(cpus);
+    }
+
+    /*
+     * cpu_capacity is the kernel's own scale of what each core does, where
+     * it has one; otherwise the highest clock is the best guess at the
+     * difference between performance and efficiency cores
+     */
+    static const char *const sources[] = {
+        "/sys/devices/system/cpu/cpu%d/cpu_capacity",
+        "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq"
+    };
+
+    topo.speed.assign(CPU_SETSIZE, 1.0);
+    for (int s = 0; s < 2; s++) {
+        std::vector<double> speed(CPU_SETSIZE, 0.0);
+        double fastest = 0.0;
+        bool known = true;
+
+        for (size_t i = 0; known && i < topo.places.size(); i++) {
+            const int cpu = topo.places[i];
+
+            snprintf(path, sizeof(path), sources[s], cpu);
+            speed[cpu] = read_number(path);
+            known = speed[cpu] > 0.0;
+            if (speed[cpu] > fastest)
+                fastest = speed[cpu];
+        }
+        if (known && !topo.places.empty()) {
+            for (size_t i = 0; i < topo.places.size(); i++) {
+                const int cpu = topo.places[i];
+
+                topo.speed[cpu] = speed[cpu] / fastest;
+            }
+            break;
+        }
+    }
+
+    // Nothing allowed at all is not possible, but is not worth crashing on
+    if (topo.places.empty()) {
+        topo.places.push_back(0);
+        topo.node_cpus.push_back(allowed);
+    }
+}
+
+static const topology *get_topology()
+{
+    pthread_once(&topo_once, read_topology);
+    return &topo;
+}
+
+void set_placement(pin_mode mode)
+{
+    get_topology();
+    pinning = mode;
+}
+
+void place_thread(int me)
+{
+    if (pinning == PIN_NONE || placed_as == me)
+        return;
+    placed_as = me;
+
+    const topology *t = get_topology();
+    const int cpu = t->places[me % t->places.size()];
+    cpu_set_t set = t->node_cpus[t->node[cpu]];
+
+    if (pinning == PIN_CORES && me != 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+
+    // Not fatal: the thread only runs where it would have anyway
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+double cpu_speed(int cpu)
+{
+    const topology *t = get_topology();
+
+    if (cpu < 0 || cpu >= (int)t->speed.size())
+        return 1.0;
+    return t->speed[cpu];
+}
+
+uint32_t *alloc_counts(size_t n)
+{
+    void *its = mmap(NULL, n * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (its == MAP_FAILED) {
+        perror("Failed to allocate a frame");
+        exit(EXIT_FAILURE);
+    }
+    return (uint32_t *)its;
+}
+
+void free_counts(uint32_t *its, size_t n)
+{
+    munmap(its, n * sizeof(uint32_t));
+}
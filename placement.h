@@ -0,0 +1,60 @@
+/*
+ * placement.h
+ *
+ * Where the compute threads run and where their counts live, for machines
+ * with more than one NUMA node or with cores of more than one speed.
+ *
+ * Threads can be pinned, to a core each or to the cores of a node. Either
+ * way the nodes are filled in turn, so the threads sharing out one part of
+ * the tile order (tiles.h) are on the same node. Count buffers are
+ * allocated untouched and first written by the threads which compute
+ * them, so that each page is put on the node of a thread using it.
+ *
+ * The speed of each core is read from the kernel, so that the tile
+ * scheduler can give slow cores less of a frame, and smaller pieces of it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum pin_mode {
+    PIN_NONE,           // wherever the system puts them
+    PIN_CORES,          // each thread to a core of its own
+    PIN_NODES           // each thread to the cores of its node
+};
+
+// The mode called name (none, cores or nodes); false if there is none
+bool find_pin_mode(const char *name, pin_mode *mode);
+
+/* How compute threads are pinned from now on. PIN_NONE unless set. */
+void set_placement(pin_mode mode);
+
+/*
+ * Pin the calling thread as thread me of an OpenMP team, unless it already
+ * is. The first thread of a team, which started it, keeps the cores of its
+ * whole node even with PIN_CORES, for the threads it goes on to start.
+ */
+void place_thread(int me);
+
+/*
+ * The speed of cpu as a fraction of that of the fastest the process may
+ * run on, or 1 if the system does not say or cpu is not known
+ */
+double cpu_speed(int cpu);
+
+/*
+ * n counts, whose pages are not touched until they are first written;
+ * see place_counts() in tiles.h. Exits if there is not the memory.
+ */
+uint32_t *alloc_counts(size_t n);
+void free_counts(uint32_t *its, size_t n);
+
+#endif // PLACEMENT_H
@@ -0,0 +1,146 @@
+/*
+ * progressive.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <vector>
+
+#include <omp.h> // OpenMP
+
+#include "progressive.h"
+#include "gpu.h"
+
+/*
+ * Sample rows computed between polls for cancellation: at least BAND_ROWS,
+ * and BAND_ROWS_PER_THREAD for each thread so that every thread has a few
+ * rows to balance. Small enough to react within a frame period.
+ */
+const int BAND_ROWS = 16;
+const int BAND_ROWS_PER_THREAD = 4;
+
+
+/*
+ * Compute the pixels of pass step in rows [first, last): those on the grid
+ * of spacing step which are not on the grid of the previous pass
+ */
+static void compute_band(const frame *f, int step, int first, int last,
+                         uint32_t *its, int pitch)
+{
+    const int width = f->width;
+    const int coarse = 2 * step;
+    const bool first_pass = step == PROGRESSIVE_STEP;
+
+    #pragma omp parallel default(none), shared(f, its),\
+                         firstprivate(width, step, coarse, first_pass,\
+                                      first, last, pitch)
+    {
+        std::vector<int> xs(width), ys(width);
+        std::vector<uint32_t> counts(width);
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int hy = first; hy < last; hy += step) {
+            // On rows of the previous pass, only the new columns
+            const bool old_row = !first_pass && hy % coarse == 0;
+            const int start = old_row ? step : 0;
+            const int stride = old_row ? coarse : step;
+            int n = 0;
+
+            for (int hx = start; hx < width; hx += stride) {
+                xs[n] = hx;
+                ys[n] = hy;
+                n++;
+            }
+            if (n == 0)
+                continue;
+
+            compute_pixels(f, &xs[0], &ys[0], n, &counts[0]);
+            uint32_t *row = its + hy*pitch;
+            for (int i = 0; i < n; i++)
+                row[xs[i]] = counts[i];
+        }
+    }
+}
+
+/*
+ * Fill rows [first, last) from the pixels on the grid of spacing step. Any
+ * GLITCHED mark is not copied, so that glitch correction only sees the
+ * computed pixels.
+ */
+static void fill_band(int width, int step, int first, int last,
+                      uint32_t *its, int pitch)
+{
+    if (step == 1)
+        return;
+
+    #pragma omp parallel for default(none), shared(its),\
+                             firstprivate(width, step, first, last, pitch),\
+                             schedule(static)
+    for (int hy = first; hy < last; hy++) {
+        const uint32_t *src = its + (hy - hy % step)*pitch;
+        uint32_t *row = its + hy*pitch;
+
+        for (int hx = 0; hx < width; hx += step) {
+            const uint32_t v = src[hx] & ~GLITCHED;
+            const int end = hx + step < width ? hx + step : width;
+
+            for (int x = hy % step == 0 ? hx + 1 : hx; x < end; x++)
+                row[x] = v;
+        }
+    }
+}
+
+bool render_progressive(const render_params *p, uint32_t *its, int pitch,
+                        double interval, progress_cancel cancel,
+                        progress_show show, void *arg)
+{
+    const int height = p->height;
+    const int threads_rows = BAND_ROWS_PER_THREAD * omp_get_max_threads();
+    const int band_rows = threads_rows > BAND_ROWS ? threads_rows : BAND_ROWS;
+    frame f;
+
+    setup_frame(&f, p->kern, &p->kp, p->center_x, p->center_y, p->delta_x,
+                p->delta_y, p->width, height);
+    double last_show = omp_get_wtime();
+
+    // A frame the GPU can compute comes faster than any preview of it
+    if (p->gpu != NULL && gpu_compute_frame(p->gpu, &f, its, pitch)) {
+        show(its, pitch, 1, arg);
+        return true;
+    }
+
+    for (int step = PROGRESSIVE_STEP; step >= 1; step /= 2) {
+        for (int band = 0; band < height; band += band_rows * step) {
+            const int end = band + band_rows * step < height ?
+                            band + band_rows * step : height;
+
+            if (cancel(arg))
+                return false;
+            compute_band(&f, step, band, end, its, pitch);
+
+            /*
+             * Rows below the band still hold the previous pass (or, in the
+             * first pass, the previous frame) so are worth showing with it
+             */
+            if (end < height && omp_get_wtime() - last_show > interval) {
+                fill_band(p->width, step, 0, end, its, pitch);
+                show(its, pitch, step, arg);
+                last_show = omp_get_wtime();
+            }
+        }
+
+        if (f.prec == PRECISION_PERTURB) {
+            correct_glitches(&f.pert, f.kern, &f.kp, p->width, height, its,
+                             pitch);
+        }
+        fill_band(p->width, step, 0, height, its, pitch);
+        show(its, pitch, step, arg);
+        last_show = omp_get_wtime();
+    }
+
+    return true;
+}
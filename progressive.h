@@ -0,0 +1,49 @@
+/*
+ * progressive.h
+ *
+ * Progressive rendering, for interactive use. A frame is computed at every
+ * 8th pixel, then every 4th, 2nd and finally every pixel, each pass adding
+ * only the pixels the earlier ones did not compute. After each pass the
+ * missing pixels are filled in from the nearest computed one above and to
+ * the left, so there is always a complete (if blocky) image to show.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include <stdint.h>
+
+#include "render.h"
+
+const int PROGRESSIVE_STEP = 8;     // pixel spacing of the first pass
+
+/*
+ * Polled by the thread calling render_progressive() between bands of
+ * rows. Returning true abandons the frame.
+ */
+typedef bool (*progress_cancel)(void *arg);
+
+/*
+ * Called with the counts so far, every pixel filled in. step is the
+ * spacing of the last pass completed (or under way), 1 once the frame is
+ * final.
+ */
+typedef void (*progress_show)(const uint32_t *its, int pitch, int step,
+                              void *arg);
+
+/*
+ * Compute the counts of the frame described by p into its (pitch entries
+ * per row). show is called after every pass, and also part way through a
+ * pass once interval seconds have passed since the last call. Returns
+ * false if cancelled, in which case its holds an incomplete frame.
+ */
+bool render_progressive(const render_params *p, uint32_t *its, int pitch,
+                        double interval, progress_cancel cancel,
+                        progress_show show, void *arg);
+
+#endif // PROGRESSIVE_H
@@ -0,0 +1,81 @@
+/*
+ * queue.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <semaphore.h>
+
+#include "queue.h"
+
+struct ptr_queue {
+    std::vector<void *> slot;
+    /*
+     * Items are at [head, tail) round the ring. tail is only written by
+     * the putting thread and head by the taking one; the semaphores order
+     * a slot's write before its read, and its read before it is reused.
+     */
+    size_t head;
+    size_t tail;
+    sem_t full;
+    sem_t empty;
+};
+
+
+ptr_queue *create_queue(int capacity)
+{
+    ptr_queue *q = new ptr_queue;
+
+    q->slot.resize(capacity);
+    q->head = 0;
+    q->tail = 0;
+    if (sem_init(&q->full, 0, 0) != 0 ||
+        sem_init(&q->empty, 0, capacity) != 0) {
+        perror("Failed to create a queue");
+        exit(EXIT_FAILURE);
+    }
+    return q;
+}
+
+void destroy_queue(ptr_queue *q)
+{
+    sem_destroy(&q->full);
+    sem_destroy(&q->empty);
+    delete q;
+}
+
+// Interrupted waits (by a debugger attaching, say) are carried on with
+static void wait_for(sem_t *s)
+{
+    while (sem_wait(s) != 0) {
+        if (errno != EINTR) {
+            perror("Failed to wait on a queue");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void queue_put(ptr_queue *q, void *item)
+{
+    wait_for(&q->empty);
+    q->slot[q->tail] = item;
+    q->tail = (q->tail + 1) % q->slot.size();
+    sem_post(&q->full);
+}
+
+void *queue_take(ptr_queue *q)
+{
+    wait_for(&q->full);
+    void *item = q->slot[q->head];
+    q->head = (q->head + 1) % q->slot.size();
+    sem_post(&q->empty);
+    return item;
+}
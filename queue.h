@@ -0,0 +1,38 @@
+/*
+ * queue.h
+ *
+ * A bounded queue of pointers from one thread to another, for handing
+ * frames between the stages of a pipeline. No lock is taken: each side
+ * owns its own end of a ring of slots, and a pair of counting semaphores
+ * says how many slots are full and how many empty. These only enter the
+ * kernel when a side has to wait, for an item or for room, so passing an
+ * item is otherwise an atomic operation on each side.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+struct ptr_queue;
+
+/* A queue with room for capacity items */
+ptr_queue *create_queue(int capacity);
+void destroy_queue(ptr_queue *q);
+
+/*
+ * Add item at the back, waiting while the queue is full. Only one thread
+ * may put to a queue.
+ */
+void queue_put(ptr_queue *q, void *item);
+
+/*
+ * Remove the item at the front, waiting while the queue is empty. Only one
+ * thread may take from a queue.
+ */
+void *queue_take(ptr_queue *q);
+
+#endif // QUEUE_H
@@ -0,0 +1,338 @@
+/*
+ * render.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <math.h>
+
+#include <omp.h> // OpenMP
+
+#include "render.h"
+#include "gpu.h"
+#include "store.h"
+#include "subdivide.h"
+#include "tiles.h"
+#include "instrument.h"
+#include "placement.h"
+
+const int PIXELS_CHUNK = 64;    // pixels converted to points at a time
+const int BLOCK_ROWS = 64;      // rows of a block given to the kernel at once
+
+
+/*
+ * Pick the cheapest arithmetic in which neighbouring pixels are still at
+ * least 64 units in the last place apart at the largest coordinate
+ * (magnitude) of the frame. Any less and rounding errors, magnified by the
+ * iteration, show up as blocks.
+ */
+precision choose_precision(double delta, double magnitude)
+{
+    if (delta > ldexp(magnitude, -18))        // float: 24 bit significand
+        return PRECISION_FLOAT;
+    if (delta > ldexp(magnitude, -46))        // double: 53 bits
+        return PRECISION_DOUBLE;
+    return PRECISION_PERTURB;
+}
+
+precision frame_precision(const kernel_params *kp, const fixed_point &cx,
+                          const fixed_point &cy, double delta_x,
+                          double delta_y, int width, int height)
+{
+    const double px = fabs(cx.to_double()) + 0.5 * width * delta_x;
+    const double py = fabs(cy.to_double()) + 0.5 * height * delta_y;
+    const precision prec = choose_precision(fmin(delta_x, delta_y),
+                                            fmax(px, py));
+
+    // Only the Mandelbrot set has perturbation kernels
+    if (prec == PRECISION_PERTURB && kp->formula != FORMULA_MANDELBROT)
+        return PRECISION_DOUBLE;
+    return prec;
+}
+
+void setup_frame(frame *f, const kernel *kern, const kernel_params *kp,
+                 const fixed_point &cx, const fixed_point &cy,
+                 double delta_x, double delta_y, int width, int height)
+{
+    const double px = cx.to_double();
+    const double py = cy.to_double();
+    const double half_w = 0.5 * width * delta_x;
+    const double half_h = 0.5 * height * delta_y;
+
+    f->kern = kern;
+    f->kp = *kp;
+    f->width = width;
+    f->height = height;
+    f->x_base = px - half_w;
+    f->y_base = py - half_h;
+    f->delta_x = delta_x;
+    f->delta_y = delta_y;
+    f->prec = frame_precision(kp, cx, cy, delta_x, delta_y, width, height);
+    f->gpu = NULL;
+
+    if (f->prec == PRECISION_PERTURB) {
+        setup_perturbation(&f->pert, kern, kp, cx, cy, delta_x, delta_y,
+                           width, height);
+    }
+}
+
+/*
+ * The y coordinate of a row. x coordinates are computed by the kernels'
+ * ramp, (float)hx * dx + x0, and compute_pixels repeats that exactly.
+ */
+static inline double row_y(const frame *f, int hy)
+{
+    return f->y_base + hy*f->delta_y;
+}
+
+void compute_span(const frame *f, int hx, int hy, int n, uint32_t *its)
+{
+    const kernel *kern = f->kern;
+
+    switch (f->prec) {
+    case PRECISION_FLOAT:
+        kern->row((float)f->x_base, (float)f->delta_x, (float)row_y(f, hy),
+                  hx, n, &f->kp, its);
+        break;
+    case PRECISION_DOUBLE:
+        kern->row_d(f->x_base, f->delta_x, row_y(f, hy), hx, n, &f->kp, its);
+        break;
+    case PRECISION_PERTURB:
+        kern->perturb_row(&f->pert.ref.orbit, f->pert.x0, 1.0,
+                          perturb_y(&f->pert, hy), hx, n, &f->kp, its);
+        break;
+    }
+}
+
+void compute_block(const frame *f, int hx, int hy, int w, int h,
+                   uint32_t *its, int pitch)
+{
+    const kernel *kern = f->kern;
+
+    for (int j = 0; j < h; j += BLOCK_ROWS) {
+        const int m = h - j < BLOCK_ROWS ? h - j : BLOCK_ROWS;
+        uint32_t *block = its + j*pitch;
+
+        if (f->prec == PRECISION_FLOAT) {
+            float y[BLOCK_ROWS];
+
+            for (int k = 0; k < m; k++)
+                y[k] = (float)row_y(f, hy + j + k);
+            kern->block((float)f->x_base, (float)f->delta_x, y, hx, w, m,
+                        &f->kp, block, pitch);
+        } else if (f->prec == PRECISION_DOUBLE) {
+            double y[BLOCK_ROWS];
+
+            for (int k = 0; k < m; k++)
+                y[k] = row_y(f, hy + j + k);
+            kern->block_d(f->x_base, f->delta_x, y, hx, w, m, &f->kp, block,
+                          pitch);
+        } else {
+            for (int k = 0; k < m; k++)
+                compute_span(f, hx, hy + j + k, w, block + k*pitch);
+        }
+    }
+}
+
+void compute_pixels(const frame *f, const int *hx, const int *hy, int n,
+                    uint32_t *its)
+{
+    const kernel *kern = f->kern;
+
+    for (int i = 0; i < n; i += PIXELS_CHUNK) {
+        const int m = n - i < PIXELS_CHUNK ? n - i : PIXELS_CHUNK;
+
+        if (f->prec == PRECISION_FLOAT) {
+            const float x0 = (float)f->x_base;
+            const float dx = (float)f->delta_x;
+            float x[PIXELS_CHUNK], y[PIXELS_CHUNK];
+
+            for (int j = 0; j < m; j++) {
+                x[j] = (float)hx[i + j] * dx + x0;
+                y[j] = (float)row_y(f, hy[i + j]);
+            }
+            kern->points(x, y, m, &f->kp, its + i);
+        } else {
+            double x[PIXELS_CHUNK], y[PIXELS_CHUNK];
+
+            for (int j = 0; j < m; j++) {
+                if (f->prec == PRECISION_DOUBLE) {
+                    x[j] = (double)hx[i + j] * f->delta_x + f->x_base;
+                    y[j] = row_y(f, hy[i + j]);
+                } else {
+                    x[j] = perturb_x(&f->pert, hx[i + j]);
+                    y[j] = perturb_y(&f->pert, hy[i + j]);
+                }
+            }
+
+            if (f->prec == PRECISION_DOUBLE)
+                kern->points_d(x, y, m, &f->kp, its + i);
+            else
+                kern->perturb_points(&f->pert.ref.orbit, x, y, m, &f->kp,
+                                     its + i);
+        }
+    }
+}
+
+void compute_samples(const frame *f, const double *sx, const double *sy,
+                     int n, uint32_t *its)
+{
+    const kernel *kern = f->kern;
+
+    for (int i = 0; i < n; i += PIXELS_CHUNK) {
+        const int m = n - i < PIXELS_CHUNK ? n - i : PIXELS_CHUNK;
+
+        if (f->prec == PRECISION_FLOAT) {
+            float x[PIXELS_CHUNK], y[PIXELS_CHUNK];
+
+            for (int j = 0; j < m; j++) {
+                x[j] = (float)(f->x_base + sx[i + j]*f->delta_x);
+                y[j] = (float)(f->y_base + sy[i + j]*f->delta_y);
+            }
+            kern->points(x, y, m, &f->kp, its + i);
+        } else {
+            double x[PIXELS_CHUNK], y[PIXELS_CHUNK];
+
+            for (int j = 0; j < m; j++) {
+                if (f->prec == PRECISION_DOUBLE) {
+                    x[j] = f->x_base + sx[i + j]*f->delta_x;
+                    y[j] = f->y_base + sy[i + j]*f->delta_y;
+                } else {
+                    x[j] = f->pert.x0 + sx[i + j];
+                    y[j] = f->pert.y0 + sy[i + j]*f->pert.aspect;
+                }
+            }
+
+            if (f->prec == PRECISION_DOUBLE)
+                kern->points_d(x, y, m, &f->kp, its + i);
+            else
+                kern->perturb_points(&f->pert.ref.orbit, x, y, m, &f->kp,
+                                     its + i);
+        }
+    }
+}
+
+/*
+ * Rows handed out by OpenMP's guided schedule, as the renderer originally
+ * did
+ */
+static void row_frame(const frame *f, uint32_t *its, int pitch,
+                      std::vector<thread_stats> *stats)
+{
+    const int height = f->height;
+    const int width = f->width;
+    std::vector<thread_stats> thread(omp_get_max_threads());
+    thread_stats *ts = &thread[0];
+    const double start = omp_get_wtime();
+    int team = 1;
+
+    #pragma omp parallel default(none), shared(f, its, ts, team),\
+                         firstprivate(width, height, pitch)
+    {
+        const int me = omp_get_thread_num();
+        thread_stats mine = thread_stats();
+
+        place_thread(me);
+        if (me == 0)
+            team = omp_get_num_threads();
+
+        #pragma omp for schedule(guided, 50) nowait
+        for (int hy = 0; hy < height; hy++) {
+            const kernel_counters before = read_counters();
+            const double t0 = omp_get_wtime();
+
+            compute_span(f, 0, hy, width, its + hy*pitch);
+            const double t1 = omp_get_wtime();
+            mine.busy += t1 - t0;
+            mine.tiles++;
+            if (recording())
+                record_tile(me, 0, hy, width, 1, t0, t1, &before);
+        }
+
+        ts[me] = mine;
+    }
+
+    if (stats != NULL) {
+        const double wall = omp_get_wtime() - start;
+
+        thread.resize(team);
+        for (int t = 0; t < team; t++)
+            thread[t].idle = wall - thread[t].busy;
+        *stats = thread;
+    }
+}
+
+void compute_frame(const frame *f, render_mode mode, uint32_t *its,
+                   int pitch, std::vector<thread_stats> *stats)
+{
+    if (recording())
+        begin_frame_record(f, mode);
+    if (f->gpu != NULL && gpu_compute_frame(f->gpu, f, its, pitch)) {
+        if (stats != NULL)
+            stats->clear();
+        if (recording())
+            end_frame_record(f, its, pitch);
+        return;
+    }
+
+    switch (mode) {
+    case RENDER_TILES:
+        tile_frame(f, its, pitch, DEFAULT_TILE_SIZE, stats);
+        break;
+    case RENDER_ROWS:
+        row_frame(f, its, pitch, stats);
+        break;
+    case RENDER_SUBDIVIDE:
+        subdivide_frame(f, its, pitch);
+        if (stats != NULL)
+            stats->clear();
+        break;
+    }
+
+    if (f->prec == PRECISION_PERTURB) {
+        correct_glitches(&f->pert, f->kern, &f->kp, f->width, f->height, its,
+                         pitch);
+    }
+    if (recording())
+        end_frame_record(f, its, pitch);
+}
+
+void render_iterations(const render_params *p, uint32_t *its, int pitch,
+                       std::vector<thread_stats> *stats)
+{
+    frame f;
+
+    if (p->store != NULL && load_frame(p->store, p, its, pitch)) {
+        if (stats != NULL)
+            stats->clear();
+        return;
+    }
+
+    setup_frame(&f, p->kern, &p->kp, p->center_x, p->center_y, p->delta_x,
+                p->delta_y, p->width, p->height);
+    f.gpu = p->gpu;
+    compute_frame(&f, p->mode, its, pitch, stats);
+    if (p->store != NULL)
+        save_frame(p->store, p, its, pitch);
+}
+
+void render_colors(const render_params *p, const uint32_t *its,
+                   int its_pitch, uint32_t *pixels, int pitch)
+{
+    color_map map;
+
+    build_color_map(&map, &p->col, p->kp.max_its,
+                    (p->kp.flags & KERNEL_SMOOTH) != 0, its, its_pitch,
+                    p->width, p->height);
+    colorize(its, its_pitch, p->width, p->height, &map, pixels, pitch);
+}
+
+void render_frame(const render_params *p, uint32_t *pixels, int pitch,
+                  std::vector<thread_stats> *stats)
+{
+    render_iterations(p, pixels, pitch, stats);
+    render_colors(p, pixels, pitch, pixels, pitch);
+}
@@ -0,0 +1,159 @@
+/*
+ * render.h
+ *
+ * Computing the iteration counts of a frame: choosing the arithmetic,
+ * mapping pixels to points of the complex plane and handing them to the
+ * kernels, and the strategies for covering a whole frame.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "kernel.h"
+#include "fixedpoint.h"
+#include "perturb.h"
+#include "colorize.h"
+
+struct gpu_device;      // see gpu.h
+struct frame_store;     // see store.h
+
+/*
+ * Arithmetic used to render a frame. Float and double are direct, perturb
+ * is computed relative to a high precision reference orbit.
+ */
+enum precision {
+    PRECISION_FLOAT,
+    PRECISION_DOUBLE,
+    PRECISION_PERTURB
+};
+
+/*
+ * How a frame is covered: by tiles handed out by a work-stealing scheduler
+ * (see tiles.h), every pixel row by row, or by Mariani-Silver subdivision
+ * (see subdivide.h)
+ */
+enum render_mode {
+    RENDER_TILES,
+    RENDER_ROWS,
+    RENDER_SUBDIVIDE
+};
+
+/* Everything needed to compute any pixel of one frame */
+struct frame {
+    const kernel *kern;
+    kernel_params kp;
+    int width;
+    int height;
+    double x_base;      // top left pixel
+    double y_base;
+    double delta_x;     // pixel size
+    double delta_y;
+    precision prec;
+    perturbation pert;  // PRECISION_PERTURB only
+    gpu_device *gpu;    // to compute on if it can, or NULL
+};
+
+/* What to render, independently of where the pixels go */
+struct render_params {
+    const kernel *kern;
+    kernel_params kp;
+    fixed_point center_x;   // in full, for perturbation
+    fixed_point center_y;
+    double delta_x;         // pixel size
+    double delta_y;
+    int width;
+    int height;
+    render_mode mode;
+    gpu_device *gpu;        // NULL to compute on the CPU only
+    frame_store *store;     // where computed frames are kept, or NULL
+    coloring col;
+};
+
+/* Per-thread accounting of one frame */
+struct thread_stats {
+    double busy;        // seconds spent computing
+    double idle;        // the rest of the frame's wall time
+    int tiles;          // work items (tiles or rows) done
+    int steals;         // tiles taken from another thread's queue
+};
+
+precision choose_precision(double delta, double magnitude);
+
+/* The arithmetic setup_frame() would choose */
+precision frame_precision(const kernel_params *kp, const fixed_point &cx,
+                          const fixed_point &cy, double delta_x,
+                          double delta_y, int width, int height);
+
+/*
+ * Prepare f for a width x height frame of pixels delta_x by delta_y
+ * centred on (cx, cy). For perturbation this computes the reference orbit.
+ * f is computed on the CPU unless f->gpu is set afterwards.
+ */
+void setup_frame(frame *f, const kernel *kern, const kernel_params *kp,
+                 const fixed_point &cx, const fixed_point &cy,
+                 double delta_x, double delta_y, int width, int height);
+
+/*
+ * Compute pixels hx..hx+n-1 of row hy, the w x h block from (hx, hy), or n
+ * arbitrary pixels. A pixel's value does not depend on which other pixels
+ * it is computed with.
+ */
+void compute_span(const frame *f, int hx, int hy, int n, uint32_t *its);
+void compute_block(const frame *f, int hx, int hy, int w, int h,
+                   uint32_t *its, int pitch);
+void compute_pixels(const frame *f, const int *hx, const int *hy, int n,
+                    uint32_t *its);
+
+/*
+ * Compute n points anywhere in the frame, at (sx[i], sy[i]) in pixels:
+ * pixel (hx, hy) is the point (hx, hy), and covers half a pixel around it.
+ * Perturbation results may be GLITCHED, as there is no correction.
+ */
+void compute_samples(const frame *f, const double *sx, const double *sy,
+                     int n, uint32_t *its);
+
+/*
+ * Compute the whole frame into its (pitch entries per row), including
+ * glitch correction for perturbation, on f->gpu if it can and otherwise
+ * with mode. If stats is not NULL it is given one entry per thread (none
+ * for RENDER_SUBDIVIDE, whose tasks are not accounted, or for frames
+ * computed on the GPU).
+ */
+void compute_frame(const frame *f, render_mode mode, uint32_t *its,
+                   int pitch, std::vector<thread_stats> *stats);
+
+/*
+ * Compute the iteration counts of the frame described by p into the
+ * caller's buffer, pitch entries (at least p->width) per row, to be
+ * coloured with colorize(). With p->store the frame is read from the store
+ * if it is there (leaving stats empty) and added to it if not. stats is
+ * otherwise as for compute_frame.
+ */
+void render_iterations(const render_params *p, uint32_t *its, int pitch,
+                       std::vector<thread_stats> *stats);
+
+/*
+ * Colour the counts in its with p->col, into pixels. The two may be the
+ * same buffer, provided the pitches are equal.
+ */
+void render_colors(const render_params *p, const uint32_t *its,
+                   int its_pitch, uint32_t *pixels, int pitch);
+
+/*
+ * Render the frame described by p as 0x00RRGGBB pixels into the caller's
+ * buffer, pitch pixels (at least p->width) per row. The buffer doubles as
+ * the iteration count buffer, so the counts are lost; use
+ * render_iterations() to keep them.
+ */
+void render_frame(const render_params *p, uint32_t *pixels, int pitch,
+                  std::vector<thread_stats> *stats);
+
+#endif // RENDER_H
@@ -0,0 +1,584 @@
+/*
+ * server.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <png.h>
+
+#include <omp.h> // OpenMP
+
+#include "server.h"
+
+const size_t MAX_REQUEST = 8192;    // bytes of request line and headers
+const int MAX_SERVER_ITS = 1 << 20;
+
+enum tile_kind {
+    TILE_PNG,
+    TILE_COUNTS
+};
+
+/* Everything that decides the body of a response */
+struct tile_request {
+    int level;
+    int64_t x;          // tile column and row at level
+    int64_t y;
+    int max_its;
+    int size;
+    tile_kind kind;
+
+    bool operator<(const tile_request &b) const
+    {
+        if (level != b.level)
+            return level < b.level;
+        if (x != b.x)
+            return x < b.x;
+        if (y != b.y)
+            return y < b.y;
+        if (max_its != b.max_its)
+            return max_its < b.max_its;
+        if (size != b.size)
+            return size < b.size;
+        return kind < b.kind;
+    }
+};
+
+struct cached_body {
+    tile_request key;
+    std::string body;
+};
+
+/* As navigate.cc's tile cache: most recently used first */
+struct body_cache {
+    int capacity;
+    std::list<cached_body> bodies;
+    std::map<tile_request, std::list<cached_body>::iterator> index;
+};
+
+/*
+ * A request of a connection, answered in the order received. Requests
+ * which fail are answered as soon as they are read; the rest wait for the
+ * batch they are in.
+ */
+struct pending {
+    bool ready;
+    tile_request key;
+    std::string response;
+    bool close;         // the connection closes after the response
+};
+
+struct client {
+    int fd;
+    std::string in;     // received, not yet parsed
+    std::string out;    // to send
+    std::deque<pending> requests;
+    bool closing;       // read nothing more, and close once all is sent
+};
+
+
+static const cached_body *find_body(body_cache *cache,
+                                    const tile_request &key)
+{
+    std::map<tile_request, std::list<cached_body>::iterator>::iterator i =
+        cache->index.find(key);
+
+    if (i == cache->index.end())
+        return NULL;
+
+    // Move it to the front
+    cache->bodies.splice(cache->bodies.begin(), cache->bodies, i->second);
+    return &*i->second;
+}
+
+static void add_body(body_cache *cache, const tile_request &key,
+                     const std::string &body)
+{
+    if (cache->capacity <= 0 || cache->index.count(key) != 0)
+        return;
+
+    while ((int)cache->bodies.size() >= cache->capacity) {
+        cache->index.erase(cache->bodies.back().key);
+        cache->bodies.pop_back();
+    }
+
+    cache->bodies.push_front(cached_body());
+    cache->bodies.front().key = key;
+    cache->bodies.front().body = body;
+    cache->index[key] = cache->bodies.begin();
+}
+
+static std::string http_response(int status, const char *reason,
+                                 const char *type, const std::string &body,
+                                 bool close)
+{
+    char head[512];
+
+    snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %lu\r\n"
+             "Access-Control-Allow-Origin: *\r\n"
+             "Connection: %s\r\n\r\n", status, reason, type,
+             (unsigned long)body.size(), close ? "close" : "keep-alive");
+    return head + body;
+}
+
+static pending failure(int status, const char *reason, bool close)
+{
+    pending r;
+
+    r.ready = true;
+    r.close = close;
+    r.response = http_response(status, reason, "text/plain",
+                               std::string(reason) + "\n", close);
+    return r;
+}
+
+// The value of query parameter name in query, if it is a number in range
+static bool query_int(const char *query, const char *name, int min, int max,
+                      int *v)
+{
+    const size_t len = strlen(name);
+
+    for (const char *s = query; s != NULL && *s != '\0'; ) {
+        if (strncmp(s, name, len) == 0 && s[len] == '=') {
+            char *end;
+            errno = 0;
+            const long l = strtol(s + len + 1, &end, 10);
+
+            if (errno != 0 || end == s + len + 1 ||
+                (*end != '\0' && *end != '&') || l < min || l > max)
+                return false;
+            *v = (int)l;
+            return true;
+        }
+        s = strchr(s, '&');
+        if (s != NULL)
+            s++;
+    }
+    return true;
+}
+
+/*
+ * The request whose request line and headers are head, with defaults
+ * from p. A request the server cannot answer gets a failure.
+ */
+static pending parse_request(const std::string &head, const render_params *p)
+{
+    char method[16], target[1024], version[16];
+    pending r;
+
+    r.ready = false;
+    if (sscanf(head.c_str(), "%15s %1023s %15s", method, target,
+               version) != 3 || strncmp(version, "HTTP/1.", 7) != 0)
+        return failure(400, "Bad Request", true);
+
+    // HTTP/1.0 closes unless asked not to, HTTP/1.1 only when asked to
+    r.close = strcmp(version, "HTTP/1.0") == 0;
+    for (size_t line = head.find("\r\n"); line != std::string::npos;
+         line = head.find("\r\n", line + 2)) {
+        const char *h = head.c_str() + line + 2;
+
+        if (strncasecmp(h, "Connection:", 11) != 0)
+            continue;
+        for (h += 11; *h == ' ' || *h == '\t'; h++)
+            ;
+        if (strncasecmp(h, "close", 5) == 0)
+            r.close = true;
+        else if (strncasecmp(h, "keep-alive", 10) == 0)
+            r.close = false;
+    }
+
+    if (strcmp(method, "GET") != 0)
+        return failure(405, "Method Not Allowed", r.close);
+
+    // /tile/LEVEL/X/Y.png or .its, then the query
+    tile_request *k = &r.key;
+    char *query = strchr(target, '?');
+    char *end;
+    if (query != NULL)
+        *query++ = '\0';
+    if (strncmp(target, "/tile/", 6) != 0)
+        return failure(404, "Not Found", r.close);
+    const char *s = target + 6;
+    k->level = (int)strtol(s, &end, 10);
+    if (end == s || *end != '/' || k->level < 0 ||
+        k->level > MAX_SERVER_LEVEL)
+        return failure(404, "Not Found", r.close);
+    s = end + 1;
+    k->x = strtoll(s, &end, 10);
+    if (end == s || *end != '/')
+        return failure(404, "Not Found", r.close);
+    s = end + 1;
+    k->y = strtoll(s, &end, 10);
+    const int64_t across = (int64_t)1 << k->level;
+    if (end == s || k->x < 0 || k->x >= across || k->y < 0 ||
+        k->y >= across)
+        return failure(404, "Not Found", r.close);
+    if (strcmp(end, ".png") == 0)
+        k->kind = TILE_PNG;
+    else if (strcmp(end, ".its") == 0)
+        k->kind = TILE_COUNTS;
+    else
+        return failure(404, "Not Found", r.close);
+
+    const int max_its = MAX_SERVER_ITS < MAX_ITS ? MAX_SERVER_ITS : MAX_ITS;
+    k->max_its = p->kp.max_its < max_its ? p->kp.max_its : max_its;
+    k->size = SERVER_TILE;
+    if (!query_int(query, "its", 1, max_its, &k->max_its) ||
+        !query_int(query, "size", 16, MAX_SERVER_TILE, &k->size))
+        return failure(400, "Bad Request", r.close);
+    return r;
+}
+
+static void append_png(png_structp png, png_bytep data, png_size_t n)
+{
+    std::string *out = (std::string *)png_get_io_ptr(png);
+
+    out->append((const char *)data, n);
+}
+
+static void flush_png(png_structp png)
+{
+}
+
+static bool encode_png(const uint32_t *pixels, int size, std::string *out)
+{
+    std::vector<uint8_t> row(3 * size);
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                              NULL, NULL);
+    png_infop info = png == NULL ? NULL : png_create_info_struct(png);
+
+    if (info == NULL || setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    png_set_write_fn(png, out, append_png, flush_png);
+    // Rendered frames are noisy; fast compression is nearly as small
+    png_set_compression_level(png, 3);
+    png_set_IHDR(png, info, size, size, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (int hy = 0; hy < size; hy++) {
+        const uint32_t *src = pixels + hy * size;
+
+        for (int hx = 0; hx < size; hx++) {
+            row[3*hx] = src[hx] >> 16;
+            row[3*hx + 1] = src[hx] >> 8;
+            row[3*hx + 2] = src[hx];
+        }
+        png_write_row(png, &row[0]);
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+
+/*
+ * A tile is a frame of its own, centred on the tile. Its offset from the
+ * starting view's centre is exact in a double, the tiles of
+ * MAX_SERVER_LEVEL being 2^-46 across.
+ */
+static void render_tile(const render_params *p, const tile_request &key,
+                        render_mode mode, std::string *body)
+{
+    const double side = ldexp(4.0, -key.level);
+    const double delta = side / key.size;
+    int limbs = fixed_point_limbs(delta);
+    render_params q = *p;
+
+    limbs = limbs > p->center_x.limbs() ? limbs : p->center_x.limbs();
+    limbs = limbs > p->center_y.limbs() ? limbs : p->center_y.limbs();
+    q.center_x = p->center_x.resized(limbs) +
+                 fixed_point::from_double((key.x + 0.5) * side - 2.0, limbs);
+    q.center_y = p->center_y.resized(limbs) +
+                 fixed_point::from_double((key.y + 0.5) * side - 2.0, limbs);
+    q.delta_x = delta;
+    q.delta_y = delta;
+    q.width = key.size;
+    q.height = key.size;
+    q.kp.max_its = key.max_its;
+    q.mode = mode;
+
+    const int pixels = key.size * key.size;
+    std::vector<uint32_t> its(pixels);
+    render_iterations(&q, &its[0], key.size, NULL);
+
+    if (key.kind == TILE_COUNTS) {
+        body->assign((const char *)&its[0], pixels * sizeof(uint32_t));
+        return;
+    }
+    render_colors(&q, &its[0], key.size, &its[0], key.size);
+    if (!encode_png(&its[0], key.size, body))
+        body->clear();
+}
+
+/*
+ * Compute the tiles of keys. A batch with a tile for every thread is
+ * shared out a tile per thread, which is as parallel as it gets with none
+ * of the cost of sharing a tile out; a smaller one is rendered a tile
+ * after another, by all the threads.
+ */
+static void render_batch(const render_params *p,
+                         const std::vector<tile_request> &keys,
+                         std::vector<std::string> *bodies)
+{
+    const int n = keys.size();
+
+    bodies->resize(n);
+    if (n < omp_get_max_threads()) {
+        for (int i = 0; i < n; i++)
+            render_tile(p, keys[i], RENDER_TILES, &(*bodies)[i]);
+        return;
+    }
+
+    std::string *out = &(*bodies)[0];
+    #pragma omp parallel for default(none), shared(p, keys, out),\
+                             firstprivate(n), schedule(dynamic, 1)
+    for (int i = 0; i < n; i++)
+        render_tile(p, keys[i], RENDER_ROWS, &out[i]);
+}
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void accept_clients(int server, std::vector<client> *clients)
+{
+    for (;;) {
+        const int fd = accept(server, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Failed to accept a client");
+            return;
+        }
+        set_nonblocking(fd);
+        clients->push_back(client());
+        clients->back().fd = fd;
+        clients->back().closing = false;
+    }
+}
+
+/* Read what has arrived and parse the requests complete in it */
+static void read_requests(client *c, const render_params *p)
+{
+    char buf[4096];
+
+    while (!c->closing) {
+        const ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            c->closing = true;
+            break;
+        }
+        c->in.append(buf, n);
+    }
+
+    size_t end;
+    while (!c->closing && (end = c->in.find("\r\n\r\n")) !=
+           std::string::npos) {
+        c->requests.push_back(parse_request(c->in.substr(0, end), p));
+        c->in.erase(0, end + 4);
+        c->closing = c->requests.back().close;
+    }
+    if (!c->closing && c->in.size() > MAX_REQUEST) {
+        c->requests.push_back(failure(431,
+            "Request Header Fields Too Large", true));
+        c->closing = true;
+    }
+}
+
+static void send_responses(client *c)
+{
+    while (!c->requests.empty() && c->requests.front().ready) {
+        c->out += c->requests.front().response;
+        c->requests.pop_front();
+    }
+
+    while (!c->out.empty()) {
+        const ssize_t n = send(c->fd, c->out.data(), c->out.size(),
+                               MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            // The client has gone; nothing more can be sent it
+            c->out.clear();
+            c->requests.clear();
+            c->closing = true;
+            return;
+        }
+        c->out.erase(0, n);
+    }
+}
+
+static void answer(pending *r, const std::string &body)
+{
+    if (body.empty()) {
+        *r = failure(500, "Internal Server Error", r->close);
+        return;
+    }
+    r->response = http_response(200, "OK", r->key.kind == TILE_PNG
+                                               ? "image/png"
+                                               : "application/octet-stream",
+                                body, r->close);
+    r->ready = true;
+}
+
+/*
+ * Answer every tile request waiting, from the cache or by computing the
+ * tiles missing from it together
+ */
+static void answer_batch(std::vector<client> *clients, body_cache *cache,
+                         const render_params *p, bool stats)
+{
+    std::map<tile_request, int> wanted;
+    std::vector<tile_request> keys;
+
+    for (size_t i = 0; i < clients->size(); i++) {
+        std::deque<pending> &requests = (*clients)[i].requests;
+
+        for (size_t j = 0; j < requests.size(); j++) {
+            pending &r = requests[j];
+            const cached_body *c;
+
+            if (r.ready)
+                continue;
+            if ((c = find_body(cache, r.key)) != NULL)
+                answer(&r, c->body);
+            else if (wanted.count(r.key) == 0) {
+                wanted[r.key] = keys.size();
+                keys.push_back(r.key);
+            }
+        }
+    }
+    if (keys.empty())
+        return;
+
+    const double start = omp_get_wtime();
+    std::vector<std::string> bodies;
+    render_batch(p, keys, &bodies);
+    if (stats) {
+        fprintf(stderr, "batch of %d tiles in %.3f s\n", (int)keys.size(),
+                omp_get_wtime() - start);
+    }
+
+    for (size_t i = 0; i < clients->size(); i++) {
+        std::deque<pending> &requests = (*clients)[i].requests;
+
+        for (size_t j = 0; j < requests.size(); j++) {
+            if (!requests[j].ready)
+                answer(&requests[j], bodies[wanted[requests[j].key]]);
+        }
+    }
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (!bodies[i].empty())
+            add_body(cache, keys[i], bodies[i]);
+    }
+}
+
+void run_server(int port, const render_params *p, int cache_tiles,
+                bool stats)
+{
+    const int server = socket(AF_INET, SOCK_STREAM, 0);
+    const int on = 1;
+    sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (server < 0 ||
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(server, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server, 64) < 0) {
+        perror("Failed to listen for clients");
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(server);
+    fprintf(stderr, "Serving tiles on port %d\n", port);
+
+    // Tiles are coloured one by one, so not by the histogram of any frame
+    render_params base = *p;
+    base.col.histogram = false;
+    base.col.offset = 0;
+    base.gpu = NULL;
+    base.store = NULL;
+
+    body_cache cache;
+    std::vector<client> clients;
+    std::vector<pollfd> fds;
+
+    cache.capacity = cache_tiles;
+    for (;;) {
+        fds.resize(clients.size() + 1);
+        fds[0].fd = server;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < clients.size(); i++) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = (clients[i].closing ? 0 : POLLIN) |
+                                (clients[i].out.empty() ? 0 : POLLOUT);
+        }
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno != EINTR) {
+                perror("Failed to wait for clients");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < clients.size(); i++) {
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+                read_requests(&clients[i], &base);
+        }
+        if (fds[0].revents & POLLIN)
+            accept_clients(server, &clients);
+
+        answer_batch(&clients, &cache, &base, stats);
+
+        for (size_t i = 0; i < clients.size(); ) {
+            client *c = &clients[i];
+
+            send_responses(c);
+            if (c->closing && c->out.empty() && c->requests.empty()) {
+                close(c->fd);
+                clients.erase(clients.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+}
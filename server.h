@@ -0,0 +1,45 @@
+/*
+ * server.h
+ *
+ * A tile server for zoomable viewers. The plane is cut into map-style
+ * tiles: level 0 is one tile covering the starting view's 4 x 4 square
+ * around its centre, and each level has twice as many tiles across as the
+ * one before. Tiles are served over HTTP as
+ *
+ *     GET /tile/LEVEL/X/Y.png         coloured, as a PNG image
+ *     GET /tile/LEVEL/X/Y.its         counts, as little endian uint32_t
+ *
+ * with the query parameters its=N (the iteration limit, by default that
+ * of the configuration, and at most 2^20) and size=N (pixels a side, 256
+ * by default).
+ *
+ * Requests are taken from every connection at once, so that the tiles a
+ * viewer asks for together are computed together, in one parallel pass
+ * with each tile on a thread of its own. Finished tiles are kept in a
+ * least recently used cache, so that tiles already seen are sent without
+ * being computed again.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "render.h"
+
+const int SERVER_TILE = 256;        // default tile side, in pixels
+const int MAX_SERVER_TILE = 1024;
+const int MAX_SERVER_LEVEL = 48;    // tile offsets stay exact in a double
+
+/*
+ * Serve tiles of the view p starts at on port, forever, rendering them
+ * with the kernel, flags, formula and colouring of p and keeping up to
+ * cache_tiles of them. With stats the time of each batch is reported.
+ */
+void run_server(int port, const render_params *p, int cache_tiles,
+                bool stats);
+
+#endif // SERVER_H
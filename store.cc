@@ -0,0 +1,314 @@
+/*
+ * store.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "store.h"
+
+/*
+ * A frame file: the header, the key, then for each tile in row order its
+ * offset and length in the file, then the tiles. A tile is its counts row
+ * by row, each given as the difference from the one to its left (which
+ * makes the long runs of a smooth frame compress well), deflated.
+ */
+const uint32_t STORE_MAGIC = 0x5354494D;       // "MITS" when little endian
+const uint32_t STORE_VERSION = 1;
+
+struct store_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile;
+    uint32_t key_length;
+};
+
+struct tile_entry {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct frame_store {
+    std::string path;
+};
+
+/* A frame file mapped for reading */
+struct mapped_frame {
+    const unsigned char *data;
+    size_t size;
+    store_header header;
+    const unsigned char *index;
+};
+
+frame_store *open_store(const char *path)
+{
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    frame_store *s = new frame_store;
+    s->path = path;
+    return s;
+}
+
+void close_store(frame_store *s)
+{
+    delete s;
+}
+
+/*
+ * Everything that decides the counts of p. The Mandelbrot set is not named,
+ * so its frames keep the keys they had before there were other formulas,
+ * and the series approximation only where it is used.
+ */
+static std::string frame_key(const render_params *p)
+{
+    uint32_t dx[2], dy[2], jx[2], jy[2];
+    char numbers[128], formula[128] = "";
+    const bool series = (p->kp.flags & KERNEL_SERIES) &&
+                        frame_precision(&p->kp, p->center_x, p->center_y,
+                                        p->delta_x, p->delta_y, p->width,
+                                        p->height) == PRECISION_PERTURB;
+
+    memcpy(dx, &p->delta_x, sizeof(dx));
+    memcpy(dy, &p->delta_y, sizeof(dy));
+    snprintf(numbers, sizeof(numbers), " %08x%08x %08x%08x %d %d %d %s%s%s",
+             dx[1], dx[0], dy[1], dy[0], p->width, p->height, p->kp.max_its,
+             p->mode == RENDER_SUBDIVIDE ? "subdivide" : "exact",
+             p->kp.flags & KERNEL_SMOOTH ? " smooth" : "",
+             series ? " series" : "");
+    if (p->kp.formula == FORMULA_JULIA) {
+        memcpy(jx, &p->kp.julia_x, sizeof(jx));
+        memcpy(jy, &p->kp.julia_y, sizeof(jy));
+        snprintf(formula, sizeof(formula), " julia %08x%08x %08x%08x",
+                 jx[1], jx[0], jy[1], jy[0]);
+    } else if (p->kp.formula != FORMULA_MANDELBROT) {
+        snprintf(formula, sizeof(formula), " %s",
+                 formula_name(p->kp.formula));
+    }
+    return p->center_x.to_hex() + " " + p->center_y.to_hex() + numbers +
+           formula;
+}
+
+/* Named by a 64 bit FNV-1a hash of the key, which the file repeats */
+static std::string frame_path(const frame_store *s, const std::string &key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    char name[32];
+
+    for (size_t i = 0; i < key.size(); i++)
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    snprintf(name, sizeof(name), "/%08x%08x.its", (uint32_t)(h >> 32),
+             (uint32_t)h);
+    return s->path + name;
+}
+
+static int tiles_across(int n)
+{
+    return (n + STORE_TILE - 1) / STORE_TILE;
+}
+
+static void unmap_frame(mapped_frame *m)
+{
+    munmap((void *)m->data, m->size);
+}
+
+/* Map the file of p, if there is one and it is for p */
+static bool map_frame(frame_store *s, const render_params *p,
+                      mapped_frame *m)
+{
+    const std::string key = frame_key(p);
+    const int fd = open(frame_path(s, key).c_str(), O_RDONLY);
+    struct stat st;
+
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(store_header)) {
+        close(fd);
+        return false;
+    }
+    m->size = st.st_size;
+    void *data = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    m->data = (const unsigned char *)data;
+
+    const size_t tiles = (size_t)tiles_across(p->width) *
+                         tiles_across(p->height);
+    store_header *h = &m->header;
+    memcpy(h, m->data, sizeof(*h));
+    m->index = m->data + sizeof(*h) + h->key_length;
+    if (h->magic != STORE_MAGIC || h->version != STORE_VERSION ||
+        h->width != (uint32_t)p->width || h->height != (uint32_t)p->height ||
+        h->tile != (uint32_t)STORE_TILE || h->key_length != key.size() ||
+        m->size < sizeof(*h) + key.size() + tiles * sizeof(tile_entry) ||
+        memcmp(m->data + sizeof(*h), key.data(), key.size()) != 0) {
+        unmap_frame(m);
+        return false;
+    }
+    return true;
+}
+
+bool has_frame(frame_store *s, const render_params *p)
+{
+    mapped_frame m;
+
+    if (!map_frame(s, p, &m))
+        return false;
+    unmap_frame(&m);
+    return true;
+}
+
+bool load_frame(frame_store *s, const render_params *p, uint32_t *its,
+                int pitch)
+{
+    const int across = tiles_across(p->width);
+    const int tiles = across * tiles_across(p->height);
+    const int width = p->width;
+    const int height = p->height;
+    mapped_frame m;
+    bool damaged = false;
+
+    if (!map_frame(s, p, &m))
+        return false;
+
+    #pragma omp parallel default(none), shared(m, its, damaged),\
+                         firstprivate(across, tiles, width, height, pitch)
+    {
+        std::vector<uint32_t> tile(STORE_TILE * STORE_TILE);
+
+        #pragma omp for schedule(dynamic)
+        for (int t = 0; t < tiles; t++) {
+            const int x = t % across * STORE_TILE;
+            const int y = t / across * STORE_TILE;
+            const int w = width - x < STORE_TILE ? width - x : STORE_TILE;
+            const int h = height - y < STORE_TILE ? height - y : STORE_TILE;
+            tile_entry e;
+            uLongf length = w * h * sizeof(uint32_t);
+
+            memcpy(&e, m.index + t * sizeof(e), sizeof(e));
+            if (e.offset > m.size || e.length > m.size - e.offset ||
+                uncompress((Bytef *)&tile[0], &length, m.data + e.offset,
+                           e.length) != Z_OK ||
+                length != w * h * sizeof(uint32_t)) {
+                damaged = true;
+                continue;
+            }
+
+            for (int j = 0; j < h; j++) {
+                const uint32_t *src = &tile[j * w];
+                uint32_t *row = its + (y + j)*pitch + x;
+                uint32_t last = 0;
+
+                for (int i = 0; i < w; i++)
+                    row[i] = last += src[i];
+            }
+        }
+    }
+
+    unmap_frame(&m);
+    return !damaged;
+}
+
+void save_frame(frame_store *s, const render_params *p, const uint32_t *its,
+                int pitch)
+{
+    const int across = tiles_across(p->width);
+    const int tiles = across * tiles_across(p->height);
+    const int width = p->width;
+    const int height = p->height;
+    const std::string key = frame_key(p);
+    std::vector<std::vector<Bytef> > packed(tiles);
+    bool failed = false;
+
+    #pragma omp parallel default(none), shared(its, packed, failed),\
+                         firstprivate(across, tiles, width, height, pitch)
+    {
+        std::vector<uint32_t> tile(STORE_TILE * STORE_TILE);
+
+        #pragma omp for schedule(dynamic)
+        for (int t = 0; t < tiles; t++) {
+            const int x = t % across * STORE_TILE;
+            const int y = t / across * STORE_TILE;
+            const int w = width - x < STORE_TILE ? width - x : STORE_TILE;
+            const int h = height - y < STORE_TILE ? height - y : STORE_TILE;
+            const uLong size = w * h * sizeof(uint32_t);
+            uLongf length = compressBound(size);
+
+            for (int j = 0; j < h; j++) {
+                const uint32_t *row = its + (y + j)*pitch + x;
+                uint32_t last = 0;
+
+                for (int i = 0; i < w; i++) {
+                    tile[j * w + i] = row[i] - last;
+                    last = row[i];
+                }
+            }
+
+            packed[t].resize(length);
+            if (compress2(&packed[t][0], &length, (const Bytef *)&tile[0],
+                          size, Z_BEST_SPEED) != Z_OK)
+                failed = true;
+            packed[t].resize(length);
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "Failed to compress a frame for the store\n");
+        return;
+    }
+
+    store_header h;
+    h.magic = STORE_MAGIC;
+    h.version = STORE_VERSION;
+    h.width = width;
+    h.height = height;
+    h.tile = STORE_TILE;
+    h.key_length = key.size();
+
+    std::vector<tile_entry> index(tiles);
+    uint64_t offset = sizeof(h) + key.size() + tiles * sizeof(tile_entry);
+    for (int t = 0; t < tiles; t++) {
+        index[t].offset = offset;
+        index[t].length = packed[t].size();
+        offset += packed[t].size();
+    }
+
+    // Readers only ever see the file by its final name, complete
+    const std::string path = frame_path(s, key);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    const std::string temp = path + suffix;
+    FILE *f = fopen(temp.c_str(), "wb");
+    bool ok = f != NULL &&
+              fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(key.data(), key.size(), 1, f) == 1 &&
+              fwrite(&index[0], sizeof(tile_entry), tiles, f) ==
+                  (size_t)tiles;
+    for (int t = 0; ok && t < tiles; t++)
+        ok = fwrite(&packed[t][0], packed[t].size(), 1, f) == 1;
+    if (f != NULL && fclose(f) != 0)
+        ok = false;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        perror(temp.c_str());
+        unlink(temp.c_str());
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * store.h
+ *
+ * A store of computed frames on disk, so that rendering a zoom again, with
+ * another palette or output format say, reads its counts back instead of
+ * computing them. Frames are looked up by everything that decides their
+ * counts: the centre in full, the pixel size, the size of the frame, the
+ * iteration limit, whether it was subdivided or started from a series
+ * (which approximate), whether the counts have fractions, and the
+ * formula. Kernels, their early-outs and the GPU all give the same
+ * counts, so are not part of it.
+ *
+ * Each frame is a file of its own, cut into tiles compressed separately
+ * so that they are packed and unpacked in parallel. Files are read through
+ * mmap and written whole under another name and renamed into place, so
+ * any number of processes may use the same store at once: a reader sees a
+ * frame complete or not at all.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+
+#include "render.h"
+
+const int STORE_TILE = 64;      // side of a compressed tile, in pixels
+
+struct frame_store;
+
+/* Use the store in the directory at path, creating it if need be */
+frame_store *open_store(const char *path);
+void close_store(frame_store *s);
+
+/*
+ * Read the counts of the frame described by p into its (pitch entries per
+ * row). Returns false if the store does not have it, or has it damaged.
+ */
+bool load_frame(frame_store *s, const render_params *p, uint32_t *its,
+                int pitch);
+
+/* Whether load_frame() would find the frame, without reading it */
+bool has_frame(frame_store *s, const render_params *p);
+
+/* Add the counts of p. Failures are reported but not fatal. */
+void save_frame(frame_store *s, const render_params *p, const uint32_t *its,
+                int pitch);
+
+#endif // STORE_H
@@ -0,0 +1,128 @@
+/*
+ * subdivide.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <omp.h> // OpenMP
+
+#include "render.h"
+#include "subdivide.h"
+
+const int MIN_SUBDIVIDE = 32;            // smaller rectangles are computed
+const int MIN_TASK_PIXELS = 64 * 64;    // smaller ones are not worth a task
+const int COLUMN_CHUNK = 64;
+
+
+/* Compute n pixels of column hx starting at row hy */
+static void compute_column(const frame *f, int hx, int hy, int n,
+                           uint32_t *its, int pitch)
+{
+    int xs[COLUMN_CHUNK], ys[COLUMN_CHUNK];
+    uint32_t column[COLUMN_CHUNK];
+
+    for (int i = 0; i < n; i += COLUMN_CHUNK) {
+        const int m = n - i < COLUMN_CHUNK ? n - i : COLUMN_CHUNK;
+
+        for (int j = 0; j < m; j++) {
+            xs[j] = hx;
+            ys[j] = hy + i + j;
+        }
+        compute_pixels(f, xs, ys, m, column);
+        for (int j = 0; j < m; j++)
+            its[(hy + i + j)*pitch + hx] = column[j];
+    }
+}
+
+static bool border_uniform(const uint32_t *its, int pitch, int x, int y,
+                           int w, int h)
+{
+    const uint32_t value = its[y*pitch + x];
+    const uint32_t *top = its + y*pitch + x;
+    const uint32_t *bottom = its + (y + h - 1)*pitch + x;
+
+    for (int i = 0; i < w; i++) {
+        if (top[i] != value || bottom[i] != value)
+            return false;
+    }
+    for (int j = 1; j < h - 1; j++) {
+        if (top[j*pitch] != value || top[j*pitch + w - 1] != value)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * The border of the w x h rectangle at (x, y) has been computed; fill in
+ * the rest
+ */
+static void subdivide(const frame *f, uint32_t *its, int pitch, int x, int y,
+                      int w, int h)
+{
+    if (w <= 2 || h <= 2)
+        return;
+
+    if (border_uniform(its, pitch, x, y, w, h)) {
+        const uint32_t value = its[y*pitch + x];
+
+        for (int j = y + 1; j < y + h - 1; j++) {
+            for (int i = x + 1; i < x + w - 1; i++)
+                its[j*pitch + i] = value;
+        }
+        return;
+    }
+
+    if (w <= MIN_SUBDIVIDE || h <= MIN_SUBDIVIDE) {
+        for (int j = y + 1; j < y + h - 1; j++)
+            compute_span(f, x + 1, j, w - 2, its + j*pitch + x + 1);
+        return;
+    }
+
+    // The dividing line becomes part of the border of both halves
+    const bool task = w * h > MIN_TASK_PIXELS;
+    if (w >= h) {
+        const int mid = x + w / 2;
+
+        compute_column(f, mid, y + 1, h - 2, its, pitch);
+
+        #pragma omp task default(none), shared(f, its),\
+                         firstprivate(pitch, x, y, h, mid), if(task)
+        subdivide(f, its, pitch, x, y, mid - x + 1, h);
+        #pragma omp task default(none), shared(f, its),\
+                         firstprivate(pitch, x, y, w, h, mid), if(task)
+        subdivide(f, its, pitch, mid, y, x + w - mid, h);
+    } else {
+        const int mid = y + h / 2;
+
+        compute_span(f, x + 1, mid, w - 2, its + mid*pitch + x + 1);
+
+        #pragma omp task default(none), shared(f, its),\
+                         firstprivate(pitch, x, y, w, mid), if(task)
+        subdivide(f, its, pitch, x, y, w, mid - y + 1);
+        #pragma omp task default(none), shared(f, its),\
+                         firstprivate(pitch, x, y, w, h, mid), if(task)
+        subdivide(f, its, pitch, x, mid, w, y + h - mid);
+    }
+}
+
+void subdivide_frame(const frame *f, uint32_t *its, int pitch)
+{
+    const int width = f->width;
+    const int height = f->height;
+
+    #pragma omp parallel default(none), shared(f, its),\
+                         firstprivate(width, height, pitch)
+    #pragma omp single
+    {
+        // Border of the whole frame
+        compute_span(f, 0, 0, width, its);
+        compute_span(f, 0, height - 1, width, its + (height - 1)*pitch);
+        compute_column(f, 0, 1, height - 2, its, pitch);
+        compute_column(f, width - 1, 1, height - 2, its, pitch);
+
+        subdivide(f, its, pitch, 0, 0, width, height);
+    }
+}
@@ -0,0 +1,27 @@
+/*
+ * subdivide.h
+ *
+ * Mariani-Silver rendering. The set is connected, so if the border of a
+ * rectangle has the same iteration count all the way round, so (barring
+ * features smaller than a pixel) has its inside. Only the border is
+ * computed and the rectangle filled; otherwise it is split in two along
+ * its longer side and both halves are treated the same way, as OpenMP
+ * tasks.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef SUBDIVIDE_H
+#define SUBDIVIDE_H
+
+#include <stdint.h>
+
+struct frame;
+
+/* Compute f into its (pitch entries per row) by subdivision */
+void subdivide_frame(const frame *f, uint32_t *its, int pitch);
+
+#endif // SUBDIVIDE_H
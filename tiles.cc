@@ -0,0 +1,337 @@
+/*
+ * tiles.cc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <algorithm>
+
+#include <omp.h> // OpenMP
+
+#include "render.h"
+#include "tiles.h"
+#include "instrument.h"
+#include "placement.h"
+
+const int CACHE_LINE = 64;
+
+/*
+ * Cores slower than this, as a fraction of the fastest in the team, are
+ * given quarter tiles, so that the last tiles of a frame are not held up
+ * on them as long
+ */
+const double SLOW_CORE = 0.8;
+
+struct tile {
+    uint32_t code;      // position along the Morton curve
+    int x;              // top left pixel
+    int y;
+};
+
+/*
+ * A run [head, tail) of the tile order. The owner takes from the head,
+ * thieves from the tail. Each queue has a cache line to itself so that
+ * threads working on their own queues do not contend.
+ */
+struct tile_queue {
+    omp_lock_t lock;
+    int head;
+    int tail;
+    char pad[CACHE_LINE - sizeof(omp_lock_t) - 2 * sizeof(int)];
+};
+
+/*
+ * n queues starting on a cache line, which new does not promise for more
+ * than the alignment of the members. Freed with free().
+ */
+static tile_queue *alloc_queues(int n)
+{
+    void *queues;
+
+    if (posix_memalign(&queues, CACHE_LINE, n * sizeof(tile_queue)) != 0) {
+        fprintf(stderr, "Failed to allocate the tile queues\n");
+        exit(EXIT_FAILURE);
+    }
+    return (tile_queue *)queues;
+}
+
+// Interleave the bits of x and y: ...y1x1y0x0
+static uint32_t morton(uint32_t x, uint32_t y)
+{
+    uint32_t code = 0;
+
+    for (int b = 0; b < 16; b++) {
+        code |= ((x >> b) & 1) << (2 * b);
+        code |= ((y >> b) & 1) << (2 * b + 1);
+    }
+    return code;
+}
+
+static bool tile_before(const tile &a, const tile &b)
+{
+    return a.code < b.code;
+}
+
+/*
+ * Give the team of threads runs of the order in proportion to their speeds,
+ * and the queues of threads not in the team nothing
+ */
+static void share_out(tile_queue *queues, int num_queues, int num_tiles,
+                      const double *speed, int team)
+{
+    double total = 0.0, sum = 0.0;
+
+    for (int q = 0; q < team; q++)
+        total += speed[q];
+    for (int q = 0; q < num_queues; q++) {
+        queues[q].head = (int)(num_tiles * sum / total + 0.5);
+        if (q < team)
+            sum += speed[q];
+        queues[q].tail = q < team ? (int)(num_tiles * sum / total + 0.5)
+                                  : queues[q].head;
+    }
+}
+
+// The tiles of a frame, in Morton order
+static void order_tiles(std::vector<tile> *order, int width, int height,
+                        int tile_size)
+{
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+
+    order->resize(tiles_x * tiles_y);
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            tile &t = (*order)[ty*tiles_x + tx];
+
+            t.code = morton(tx, ty);
+            t.x = tx * tile_size;
+            t.y = ty * tile_size;
+        }
+    }
+    std::sort(order->begin(), order->end(), tile_before);
+}
+
+// The speed of the core the calling thread is on
+static double thread_speed()
+{
+    return cpu_speed(sched_getcpu());
+}
+
+/*
+ * Take the tile at the head of q, or with group the quarters following it
+ * of the same tile as well. Returns the first, with their number in n, or
+ * -1 if q is empty.
+ */
+static int take_head(tile_queue *q, const tile *tiles, bool group, int *n)
+{
+    int t = -1;
+
+    omp_set_lock(&q->lock);
+    if (q->head < q->tail) {
+        t = q->head++;
+        while (group && q->head < q->tail &&
+               tiles[q->head].code >> 2 == tiles[t].code >> 2)
+            q->head++;
+        *n = q->head - t;
+    }
+    omp_unset_lock(&q->lock);
+    return t;
+}
+
+static int take_tail(tile_queue *q, const tile *tiles, bool group, int *n)
+{
+    int t = -1;
+
+    omp_set_lock(&q->lock);
+    if (q->head < q->tail) {
+        const int last = --q->tail;
+
+        while (group && q->head < q->tail &&
+               tiles[q->tail - 1].code >> 2 == tiles[last].code >> 2)
+            q->tail--;
+        t = q->tail;
+        *n = last + 1 - t;
+    }
+    omp_unset_lock(&q->lock);
+    return t;
+}
+
+/*
+ * Try every other queue once, starting from a random one. Nothing is ever
+ * added to a queue, so if all are empty the frame is (or is about to be)
+ * finished.
+ */
+static int steal(tile_queue *queues, int num_queues, int me,
+                 unsigned *seed, const tile *tiles, bool group, int *n)
+{
+    const int start = rand_r(seed) % num_queues;
+
+    for (int i = 0; i < num_queues; i++) {
+        const int victim = (start + i) % num_queues;
+
+        if (victim == me)
+            continue;
+
+        int t = take_tail(&queues[victim], tiles, group, n);
+        if (t >= 0)
+            return t;
+    }
+    return -1;
+}
+
+static void compute_tile(const frame *f, int x, int y, int size,
+                         uint32_t *its, int pitch, int me)
+{
+    const int w = std::min(size, f->width - x);
+    const int h = std::min(size, f->height - y);
+    const kernel_counters before = read_counters();
+    const double t0 = omp_get_wtime();
+
+    compute_block(f, x, y, w, h, its + y*pitch + x, pitch);
+    if (recording())
+        record_tile(me, x, y, w, h, t0, omp_get_wtime(), &before);
+}
+
+void tile_frame(const frame *f, uint32_t *its, int pitch, int tile_size,
+                std::vector<thread_stats> *stats)
+{
+    /*
+     * One queue per thread we might get. If the runtime gives us fewer,
+     * the queues nobody owns are left empty.
+     */
+    const int num_queues = omp_get_max_threads();
+    tile_queue *queues = alloc_queues(num_queues);
+    for (int q = 0; q < num_queues; q++)
+        omp_init_lock(&queues[q].lock);
+
+    std::vector<tile> order;
+    std::vector<double> speeds(num_queues);
+    std::vector<thread_stats> thread(num_queues);
+    const int quarter = (tile_size + 1) / 2;
+    std::vector<tile> *tiles = &order;
+    double *speed = &speeds[0];
+    thread_stats *ts = &thread[0];
+    const double start = omp_get_wtime();
+    bool split = false;
+    double fastest = 0.0;
+    int team = 1;
+
+    #pragma omp parallel default(none), shared(f, its, queues, tiles, ts,\
+                                               speed, team, split, fastest),\
+                         firstprivate(pitch, tile_size, quarter, num_queues)
+    {
+        const int me = omp_get_thread_num();
+
+        place_thread(me);
+        speed[me] = thread_speed();
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            team = omp_get_num_threads();
+            for (int q = 0; q < team; q++)
+                fastest = std::max(fastest, speed[q]);
+            for (int q = 0; q < team; q++)
+                split = split || speed[q] < SLOW_CORE * fastest;
+
+            order_tiles(tiles, f->width, f->height,
+                        split ? quarter : tile_size);
+            share_out(queues, num_queues, tiles->size(), speed, team);
+        }
+
+        // Fast cores take whole tiles, slow ones each quarter on its own
+        const bool group = split && speed[me] >= SLOW_CORE * fastest;
+        const tile *order = &(*tiles)[0];
+        unsigned seed = 0x9E3779B9u * (me + 1);
+        thread_stats mine = thread_stats();
+
+        for (;;) {
+            int n;
+            int t = take_head(&queues[me], order, group, &n);
+
+            if (t < 0) {
+                t = steal(queues, num_queues, me, &seed, order, group, &n);
+                if (t < 0)
+                    break;
+                mine.steals++;
+            }
+
+            const double t0 = omp_get_wtime();
+            if (n == 4) {
+                compute_tile(f, order[t].x, order[t].y, 2 * quarter, its,
+                             pitch, me);
+                mine.tiles++;
+            } else {
+                for (int i = t; i < t + n; i++) {
+                    compute_tile(f, order[i].x, order[i].y,
+                                 split ? quarter : tile_size, its, pitch,
+                                 me);
+                    mine.tiles++;
+                }
+            }
+            mine.busy += omp_get_wtime() - t0;
+        }
+
+        ts[me] = mine;
+    }
+
+    const double wall = omp_get_wtime() - start;
+
+    for (int q = 0; q < num_queues; q++)
+        omp_destroy_lock(&queues[q].lock);
+    free(queues);
+
+    if (stats != NULL) {
+        thread.resize(team);
+        for (int q = 0; q < team; q++)
+            thread[q].idle = wall - thread[q].busy;
+        *stats = thread;
+    }
+}
+
+void place_counts(uint32_t *its, int pitch, int width, int height,
+                  int tile_size)
+{
+    const int num_queues = omp_get_max_threads();
+    tile_queue *queues = alloc_queues(num_queues);
+    std::vector<tile> order;
+    std::vector<double> speeds(num_queues);
+    std::vector<tile> *tiles = &order;
+    double *speed = &speeds[0];
+
+    order_tiles(tiles, width, height, tile_size);
+
+    #pragma omp parallel default(none), shared(its, queues, tiles, speed),\
+                         firstprivate(pitch, width, height, tile_size,\
+                                      num_queues)
+    {
+        const int me = omp_get_thread_num();
+
+        place_thread(me);
+        speed[me] = thread_speed();
+
+        #pragma omp barrier
+        #pragma omp single
+        share_out(queues, num_queues, tiles->size(), speed,
+                  omp_get_num_threads());
+
+        for (int t = queues[me].head; t < queues[me].tail; t++) {
+            const tile &tt = (*tiles)[t];
+            const int w = std::min(tile_size, width - tt.x);
+            const int h = std::min(tile_size, height - tt.y);
+
+            for (int y = tt.y; y < tt.y + h; y++)
+                memset(its + y*pitch + tt.x, 0, w * sizeof(uint32_t));
+        }
+    }
+
+    free(queues);
+}
@@ -0,0 +1,47 @@
+/*
+ * tiles.h
+ *
+ * Tile scheduler. The frame is cut into square tiles which are ordered
+ * along a Morton (Z-order) curve, so that tiles next to each other in the
+ * order are next to each other in the frame. Each thread starts with a run
+ * of that order in its own deque, as long as its core is fast, works from
+ * the front of it, and when it runs out steals from the back of another
+ * thread's deque.
+ *
+ * Where some cores are much slower than others the deques hold quarter
+ * tiles. Fast cores take the quarters of a tile together, slow ones one at
+ * a time, so a slow core is never the last to finish by much.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef TILES_H
+#define TILES_H
+
+#include <stdint.h>
+#include <vector>
+
+struct frame;
+struct thread_stats;
+
+const int DEFAULT_TILE_SIZE = 32;
+
+/*
+ * Compute f into its (pitch entries per row) in tile_size x tile_size
+ * tiles. If stats is not NULL it gets one entry per thread.
+ */
+void tile_frame(const frame *f, uint32_t *its, int pitch, int tile_size,
+                std::vector<thread_stats> *stats);
+
+/*
+ * Zero its as tile_frame() would first share it out, each thread the
+ * tiles of its run, so that each page of a buffer from alloc_counts()
+ * (placement.h) is on the NUMA node of a thread which will compute it
+ */
+void place_counts(uint32_t *its, int pitch, int width, int height,
+                  int tile_size);
+
+#endif // TILES_H